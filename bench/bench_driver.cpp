@@ -0,0 +1,293 @@
+#include "bench_driver.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef __linux__
+#include <poll.h>
+#elif defined(_WIN32)
+#include <Windows.h>
+#endif
+#include <vector>
+
+#include "atomic_utils.h"
+#include "encoding_task.h"
+#include "logging_utils.h"
+#include "message_queue.h"
+#include "progress_reporter.h"
+#include "riff_wave.h"
+#include "shared_pcm_source.h"
+#include "task_scheduler.h"
+#include "thread_pool.h"
+
+using namespace GMp3Enc;
+
+namespace {
+
+struct DispatchContext
+{
+    TaskScheduler *scheduler;
+    MessageQueue<EncodingTask*> *queue;
+    size_t worker;
+    volatile long *done;
+};
+
+void* dispatchWorker(void *h)
+{
+    DispatchContext *ctx = static_cast<DispatchContext*>(h);
+    EncodingTask *task = NULL;
+    if (ctx->scheduler) {
+        while (ctx->scheduler->acquire(ctx->worker, task))
+            atomicFetchAdd(ctx->done, 1);
+    } else {
+        while (ctx->queue->recv(task, true) == MsgQResSuccess)
+            atomicFetchAdd(ctx->done, 1);
+    }
+    return NULL;
+}
+
+std::string baseName(const std::string &path)
+{
+    size_t pos = path.find_last_of("/\\");
+    return pos == std::string::npos ? path : path.substr(pos + 1);
+}
+
+void waitThreadMessages(ThreadPool &pool)
+{
+#ifdef __linux__
+    pollfd pfd;
+    pfd.fd = pool.messagesEventFd();
+    pfd.events = POLLIN;
+    poll(&pfd, 1, 100);
+#elif defined(_WIN32)
+    Sleep(1);
+#endif
+}
+
+}
+
+BenchDriver::BenchDriver()
+    : readerType_(WaveReaderMmap)
+    , placement_(CpuPlacement::PolicyNone)
+    , ioBackend_(IoBackendSync)
+{
+}
+
+bool BenchDriver::runEncoding(
+        const Corpus &corpus,
+        const std::string &outDir,
+        size_t threads,
+        EncodingRun &run)
+{
+    run.corpus = corpus.name;
+    run.placement = CpuPlacement::policyName(placement_);
+    run.threads = threads;
+    run.files = corpus.files.size();
+    run.failed = 0;
+    run.seconds = 0.0;
+    run.filesPerSec = 0.0;
+    run.mbPerSec = 0.0;
+    run.realtimeFactor = 0.0;
+    run.speedup = 0.0;
+    run.efficiency = 0.0;
+    run.peakRssKb = 0;
+    run.outputBytes = 0;
+    run.outputKbps = 0.0;
+
+    ThreadPool pool(threads);
+    if (!pool.setPlacement(placement_) || !pool.setIoBackend(ioBackend_) || !pool.runThreads())
+        return false;
+
+    resetPeakRss();
+    double start = now();
+
+    std::vector<EncodingTask*> tasks;
+    for (size_t i = 0; i < corpus.files.size(); i++) {
+        RiffWave wave(corpus.files[i].path);
+        wave.setReaderType(readerType_);
+        std::string name = outDir + "/" + baseName(corpus.files[i].path);
+
+        if (bitrates_.size() > 1) {
+            SharedPcmSource *source = SharedPcmSource::create(wave, bitrates_.size());
+            if (!source) {
+                run.failed++;
+                continue;
+            }
+            for (size_t b = 0; b < bitrates_.size(); b++) {
+                char suffix[16];
+                snprintf(suffix, sizeof(suffix), "-%dk.mp3", bitrates_[b]);
+                EncodingTask *task = EncodingTask::createShared(
+                            source, -1, name + suffix, tasks.size());
+                task->setProfile(profile_.withBitrate(bitrates_[b]));
+                if (!pool.executeAsyncTask(task)) {
+                    delete task;
+                    run.failed++;
+                    continue;
+                }
+                tasks.push_back(task);
+            }
+            source->release();
+            continue;
+        }
+
+        EncodingTask *task = EncodingTask::create(wave, name + ".mp3", i);
+        if (!task) {
+            run.failed++;
+            continue;
+        }
+        task->setProfile(bitrates_.empty() ? profile_ : profile_.withBitrate(bitrates_[0]));
+        if (!pool.executeAsyncTask(task)) {
+            delete task;
+            run.failed++;
+            continue;
+        }
+        tasks.push_back(task);
+    }
+
+    size_t finished = 0;
+    std::vector<EncodingTask*> startedTasks;
+    std::vector<EncodingTask*> finishedTasks;
+    while (finished < tasks.size()) {
+        pool.readThreadMessages(startedTasks, finishedTasks);
+        if (finishedTasks.empty()) {
+            waitThreadMessages(pool);
+            continue;
+        }
+        finished += finishedTasks.size();
+    }
+
+    run.seconds = now() - start;
+    run.peakRssKb = peakRssKb();
+    pool.stopThreads();
+
+    for (size_t i = 0; i < tasks.size(); i++) {
+        if (tasks[i]->result() != EncodingTask::EncodingSuccess) {
+            GMP3ENC_LOGGER_ERROR(
+                        "Failed to encode %s: %s",
+                        tasks[i]->sourceFilePath().c_str(),
+                        tasks[i]->errorStr().c_str());
+            run.failed++;
+        }
+        run.outputBytes += tasks[i]->bytesWritten();
+        delete tasks[i];
+    }
+
+    if (run.seconds > 0.0) {
+        run.filesPerSec = run.files / run.seconds;
+        run.mbPerSec = corpus.dataSize / (1024.0 * 1024.0) / run.seconds;
+        run.realtimeFactor = corpus.audioSeconds / run.seconds;
+    }
+    if (corpus.audioSeconds > 0.0)
+        run.outputKbps = run.outputBytes * 8.0 / 1000.0 / corpus.audioSeconds;
+
+    return true;
+}
+
+bool BenchDriver::runDispatch(
+        const std::string &queue,
+        size_t threads,
+        size_t tasks,
+        DispatchRun &run)
+{
+    run.queue = queue;
+    run.threads = threads;
+    run.tasks = tasks;
+    run.seconds = 0.0;
+    run.tasksPerSec = 0.0;
+
+    TaskScheduler scheduler(threads);
+    MessageQueue<EncodingTask*> messageQueue;
+    bool useScheduler = queue == "scheduler";
+    if (useScheduler) {
+        if (!scheduler.init())
+            return false;
+    } else if (queue == "message_queue") {
+        if (!messageQueue.init())
+            return false;
+    } else {
+        return false;
+    }
+
+    volatile long done = 0;
+    std::vector<DispatchContext> contexts(threads);
+    std::vector<pthread_t> ids(threads);
+    size_t started = 0;
+    for (; started < threads; started++) {
+        DispatchContext &ctx = contexts[started];
+        ctx.scheduler = useScheduler ? &scheduler : NULL;
+        ctx.queue = &messageQueue;
+        ctx.worker = started;
+        ctx.done = &done;
+        if (pthread_create(&ids[started], NULL, dispatchWorker, &ctx))
+            break;
+    }
+
+    double start = now();
+    if (started == threads) {
+        // Tasks are never dereferenced, any unique non-null pointer will do:
+        for (size_t i = 0; i < tasks; i++) {
+            EncodingTask *task = reinterpret_cast<EncodingTask*>(i + 1);
+            if (useScheduler)
+                scheduler.submit(task);
+            else
+                messageQueue.send(task);
+        }
+        while (atomicLoadAcquire(&done) < static_cast<long>(tasks))
+            sched_yield();
+    }
+    run.seconds = now() - start;
+
+    if (useScheduler)
+        scheduler.invalidate();
+    else
+        messageQueue.invalidate();
+    for (size_t i = 0; i < started; i++)
+        pthread_join(ids[i], NULL);
+
+    if (started != threads)
+        return false;
+
+    if (run.seconds > 0.0)
+        run.tasksPerSec = tasks / run.seconds;
+    return true;
+}
+
+double BenchDriver::now()
+{
+    return ProgressReporter::now();
+}
+
+void BenchDriver::resetPeakRss()
+{
+#ifdef __linux__
+    // "5" resets the peak resident set size (VmHWM) of the process:
+    FILE *f = fopen("/proc/self/clear_refs", "w");
+    if (f) {
+        fputs("5", f);
+        fclose(f);
+    }
+#endif
+}
+
+long BenchDriver::peakRssKb()
+{
+#ifdef __linux__
+    FILE *f = fopen("/proc/self/status", "r");
+    if (!f)
+        return 0;
+
+    long kb = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "VmHWM:", 6) == 0) {
+            sscanf(line + 6, "%ld", &kb);
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+#else
+    return 0;
+#endif
+}
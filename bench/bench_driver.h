@@ -0,0 +1,92 @@
+#ifndef GMP3ENC_BENCH_DRIVER_
+#define GMP3ENC_BENCH_DRIVER_
+
+#include <string>
+#include <vector>
+
+#include "corpus_generator.h"
+#include "cpu_placement.h"
+#include "encoding_profile.h"
+#include "io_ring.h"
+#include "wave_reader.h"
+
+namespace GMp3Enc {
+
+struct EncodingRun
+{
+    std::string corpus;
+    std::string placement;
+    size_t threads;
+    size_t files;
+    size_t failed;
+    double seconds;
+    double filesPerSec;
+    double mbPerSec;
+    double realtimeFactor;
+    double speedup;        // Relative to the single worker run.
+    double efficiency;     // speedup / threads.
+    long peakRssKb;
+    unsigned long long outputBytes;
+    double outputKbps;     // Average bitrate of the output.
+};
+
+struct DispatchRun
+{
+    std::string queue;
+    size_t threads;
+    size_t tasks;
+    double seconds;
+    double tasksPerSec;
+};
+
+// Runs the same path as the encoder application: RiffWave headers are
+// parsed, EncodingTasks are submitted into a ThreadPool and completion
+// notifications are collected from it.
+class BenchDriver
+{
+public:
+    BenchDriver();
+
+    inline void setReaderType(WaveReaderType type) { readerType_ = type; }
+    inline void setProfile(const EncodingProfile &profile) { profile_ = profile; }
+
+    // Every file is encoded into one CBR output per bitrate, several
+    // outputs share reading and unpacking of the source.
+    inline void setBitrates(const std::vector<int> &bitrates) { bitrates_ = bitrates; }
+
+    // Unsupported placement fails the run.
+    inline void setPlacement(CpuPlacement::Policy policy) { placement_ = policy; }
+
+    // Unsupported backend fails the run as well.
+    inline void setIoBackend(IoBackend backend) { ioBackend_ = backend; }
+
+    bool runEncoding(
+            const Corpus &corpus,
+            const std::string &outDir,
+            size_t threads,
+            EncodingRun &run);
+
+    // Measures only task dispatch. Fake tasks are passed through
+    // TaskScheduler ("scheduler") or the former shared MessageQueue
+    // ("message_queue") and are not executed.
+    static bool runDispatch(
+            const std::string &queue,
+            size_t threads,
+            size_t tasks,
+            DispatchRun &run);
+
+    static double now();
+    static void resetPeakRss();
+    static long peakRssKb();
+
+private:
+    WaveReaderType readerType_;
+    EncodingProfile profile_;
+    std::vector<int> bitrates_;
+    CpuPlacement::Policy placement_;
+    IoBackend ioBackend_;
+};
+
+}
+
+#endif
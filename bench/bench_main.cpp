@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#ifdef __linux__
+#include <sys/stat.h>
+#elif defined(_WIN32)
+#include <direct.h>
+#endif
+
+#include "bench_driver.h"
+#include "bench_report.h"
+#include "corpus_generator.h"
+#include "cpu_count.h"
+#include "cpu_placement.h"
+#include "encoding_profile.h"
+#include "logging_utils.h"
+#include "pcm_unpack.h"
+
+using namespace GMp3Enc;
+
+static void showUsage()
+{
+    printf("gmp3enc_bench [options]\n"
+           "Generates synthetic wave corpora, encodes them with 1..N worker threads\n"
+           "and prints JSON report.\n"
+           "Options:\n"
+           "\t-c --corpus <name>: tiny, huge, mixed (default) or all.\n"
+           "\t-w --work-dir <dir>: Directory for corpora and mp3 output\n"
+           "\t\t(default gmp3enc_bench_data). Generated corpora are reused.\n"
+           "\t-t --threads <N>: Maximal number of workers (default CPU count).\n"
+           "\t-r --repeat <k>: Runs per thread count, the fastest one is reported\n"
+           "\t\t(default 3). The first run warms up caches.\n"
+           "\t--scale <x>: Multiplies durations of corpus files (default 1.0).\n"
+           "\t--reader <type>: Wave data reader: mmap (default), mmap-huge or stdio.\n"
+           "\t--io <backend>: I/O backend: sync (default) or uring.\n"
+           "\t--unpack <kernels>: PCM unpack kernels: avx2 (default), sse2 or scalar.\n"
+           "\t--profile <name>: Encoding profile: fast-cbr, standard-vbr (default)\n"
+           "\t\tor archival.\n"
+           "\t--replaygain: Enable ReplayGain analysis.\n"
+           "\t--bitrates <list>: Encode every file into CBR outputs with these bitrates\n"
+           "\t\t(kbps, comma separated), the source is read once for all of them.\n"
+           "\t--placement <list>: Worker placement policies to compare, comma separated:\n"
+           "\t\tnone (default), compact, scatter or nodes. Every policy is run for\n"
+           "\t\tevery thread count. On multi-socket hosts compact keeps workers on one\n"
+           "\t\tnode as long as it has CPUs, scatter crosses sockets from the second one.\n"
+           "\t--dispatch <tasks>: Number of fake tasks for the dispatch benchmark\n"
+           "\t\t(default 200000, 0 - disabled).\n"
+           "\t-o --report <file>: Write report into file instead of stdout.\n"
+           "\t-h --help: show this message\n");
+}
+
+static void makeDir(const std::string &dir)
+{
+#ifdef _WIN32
+    _mkdir(dir.c_str());
+#else
+    mkdir(dir.c_str(), 0755);
+#endif
+}
+
+int main(int argc, char *argv[])
+{
+    std::string corpusName = "mixed";
+    std::string workDir = "gmp3enc_bench_data";
+    std::string reportPath;
+    size_t maxThreads = CpuCount::detect();
+    size_t dispatchTasks = 200000;
+    size_t repeat = 3;
+    double scale = 1.0;
+    WaveReaderType readerType = WaveReaderMmap;
+    IoBackend ioBackend = IoBackendSync;
+    PcmUnpack::KernelSet unpackKernels = PcmUnpack::KernelAvx2;
+    EncodingProfile profile;
+    bool replayGain = false;
+    std::vector<int> bitrates;
+    std::string bitratesList;
+    std::vector<CpuPlacement::Policy> placements;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "-h" || arg == "--help") {
+            showUsage();
+            return 0;
+        } else if ((arg == "-c" || arg == "--corpus") && hasValue) {
+            corpusName = argv[++i];
+        } else if ((arg == "-w" || arg == "--work-dir") && hasValue) {
+            workDir = argv[++i];
+        } else if ((arg == "-t" || arg == "--threads") && hasValue) {
+            maxThreads = strtoul(argv[++i], NULL, 10);
+        } else if ((arg == "-r" || arg == "--repeat") && hasValue) {
+            repeat = strtoul(argv[++i], NULL, 10);
+        } else if (arg == "--scale" && hasValue) {
+            scale = strtod(argv[++i], NULL);
+        } else if (arg == "--profile" && hasValue) {
+            if (!EncodingProfile::find(argv[++i], profile)) {
+                showUsage();
+                return -1;
+            }
+        } else if (arg == "--replaygain") {
+            replayGain = true;
+        } else if (arg == "--bitrates" && hasValue) {
+            bitratesList = argv[++i];
+            char *p = &bitratesList[0];
+            while (*p) {
+                char *end = NULL;
+                long kbps = strtol(p, &end, 10);
+                if (end == p || kbps < 8 || kbps > 320 || (*end && *end != ',')) {
+                    showUsage();
+                    return -1;
+                }
+                bitrates.push_back(static_cast<int>(kbps));
+                p = *end ? end + 1 : end;
+            }
+        } else if (arg == "--placement" && hasValue) {
+            std::string list = argv[++i];
+            size_t start = 0;
+            while (start <= list.length()) {
+                size_t end = list.find(',', start);
+                if (end == std::string::npos)
+                    end = list.length();
+                CpuPlacement::Policy policy;
+                if (!CpuPlacement::parsePolicy(list.substr(start, end - start), policy)) {
+                    showUsage();
+                    return -1;
+                }
+                placements.push_back(policy);
+                start = end + 1;
+            }
+        } else if (arg == "--dispatch" && hasValue) {
+            dispatchTasks = strtoul(argv[++i], NULL, 10);
+        } else if ((arg == "-o" || arg == "--report") && hasValue) {
+            reportPath = argv[++i];
+        } else if (arg == "--reader" && hasValue) {
+            std::string name = argv[++i];
+            if (name == "stdio") {
+                readerType = WaveReaderStdio;
+            } else if (name == "mmap") {
+                readerType = WaveReaderMmap;
+            } else if (name == "mmap-huge") {
+                readerType = WaveReaderMmapHugePages;
+            } else {
+                showUsage();
+                return -1;
+            }
+        } else if (arg == "--io" && hasValue) {
+            std::string name = argv[++i];
+            if (name == "sync") {
+                ioBackend = IoBackendSync;
+            } else if (name == "uring") {
+                ioBackend = IoBackendUring;
+            } else {
+                showUsage();
+                return -1;
+            }
+        } else if (arg == "--unpack" && hasValue) {
+            std::string name = argv[++i];
+            if (name == "scalar") {
+                unpackKernels = PcmUnpack::KernelScalar;
+            } else if (name == "sse2") {
+                unpackKernels = PcmUnpack::KernelSse2;
+            } else if (name == "avx2") {
+                unpackKernels = PcmUnpack::KernelAvx2;
+            } else {
+                showUsage();
+                return -1;
+            }
+        } else {
+            showUsage();
+            return -1;
+        }
+    }
+
+    if (!maxThreads || !repeat || scale <= 0.0) {
+        showUsage();
+        return -1;
+    }
+    if (placements.empty())
+        placements.push_back(CpuPlacement::PolicyNone);
+
+    std::vector<std::string> corpusNames;
+    if (corpusName == "all") {
+        corpusNames.push_back("tiny");
+        corpusNames.push_back("huge");
+        corpusNames.push_back("mixed");
+    } else {
+        corpusNames.push_back(corpusName);
+    }
+
+    PcmUnpack::selectKernels(unpackKernels);
+
+    BenchReport report;
+    report.setCpuCount(CpuCount::detect());
+    CpuPlacement topology;
+    if (topology.plan(CpuPlacement::PolicyCompact, 1))
+        report.setNumaNodes(topology.nodesCount());
+    report.setUnpackKernels(PcmUnpack::kernelSetName());
+    profile.replayGain = replayGain;
+    std::string profileName = std::string(profile.name) + (replayGain ? "+replaygain" : "");
+    if (!bitrates.empty())
+        profileName += " cbr " + bitratesList;
+    report.setProfile(profileName);
+
+    BenchDriver driver;
+    driver.setReaderType(readerType);
+    driver.setIoBackend(ioBackend);
+    driver.setProfile(profile);
+    driver.setBitrates(bitrates);
+
+    std::string outDir = workDir + "/out";
+    for (size_t c = 0; c < corpusNames.size(); c++) {
+        Corpus corpus;
+        if (!CorpusGenerator::planCorpus(corpusNames[c], scale, corpus)) {
+            GMP3ENC_LOGGER_ERROR("Unknown corpus: %s", corpusNames[c].c_str());
+            return -1;
+        }
+
+        GMP3ENC_LOGGER_INFO(
+                    "Generating corpus %s: %zu files, %.1f MB",
+                    corpus.name.c_str(),
+                    corpus.files.size(),
+                    corpus.dataSize / (1024.0 * 1024.0));
+        if (!CorpusGenerator::generate(workDir, corpus))
+            return -1;
+        makeDir(outDir);
+        report.addCorpus(corpus);
+
+        for (size_t p = 0; p < placements.size(); p++) {
+            const char *placement = CpuPlacement::policyName(placements[p]);
+            driver.setPlacement(placements[p]);
+
+            double baseSeconds = 0.0;
+            for (size_t t = 1; t <= maxThreads; t++) {
+                EncodingRun run;
+                for (size_t r = 0; r < repeat; r++) {
+                    EncodingRun next;
+                    if (!driver.runEncoding(corpus, outDir, t, next)) {
+                        GMP3ENC_LOGGER_ERROR(
+                                    "Failed to run encoding with %zu threads, placement %s",
+                                    t,
+                                    placement);
+                        return -1;
+                    }
+                    if (!r || next.seconds < run.seconds)
+                        run = next;
+                }
+                if (t == 1)
+                    baseSeconds = run.seconds;
+                if (run.seconds > 0.0) {
+                    run.speedup = baseSeconds / run.seconds;
+                    run.efficiency = run.speedup / t;
+                }
+
+                GMP3ENC_LOGGER_INFO(
+                            "%s, %zu threads, placement %s: %.3f s, %.1fx realtime",
+                            corpus.name.c_str(),
+                            t,
+                            placement,
+                            run.seconds,
+                            run.realtimeFactor);
+                report.addEncodingRun(run);
+            }
+        }
+    }
+
+    if (dispatchTasks) {
+        const char *queues[] = { "message_queue", "scheduler" };
+        for (size_t q = 0; q < 2; q++) {
+            for (size_t t = 1; t <= maxThreads; t++) {
+                DispatchRun run;
+                for (size_t r = 0; r < repeat; r++) {
+                    DispatchRun next;
+                    if (!BenchDriver::runDispatch(queues[q], t, dispatchTasks, next)) {
+                        GMP3ENC_LOGGER_ERROR("Failed to run dispatch benchmark");
+                        return -1;
+                    }
+                    if (!r || next.seconds < run.seconds)
+                        run = next;
+                }
+                report.addDispatchRun(run);
+            }
+        }
+    }
+
+    FILE *f = stdout;
+    if (!reportPath.empty()) {
+        f = fopen(reportPath.c_str(), "w");
+        if (!f) {
+            GMP3ENC_LOGGER_ERROR("Could not open report file: %s", reportPath.c_str());
+            return -1;
+        }
+    }
+
+    bool isok = report.write(f);
+    if (f != stdout && fclose(f) != 0)
+        isok = false;
+
+    return isok ? 0 : -1;
+}
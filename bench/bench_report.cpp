@@ -0,0 +1,107 @@
+#include "bench_report.h"
+
+#include <lame/lame.h>
+#include <gmp3enc_version_no.h>
+
+using namespace GMp3Enc;
+
+BenchReport::BenchReport()
+    : cpuCount_(0)
+    , numaNodes_(1)
+{
+}
+
+void BenchReport::addCorpus(const Corpus &corpus)
+{
+    corpora_.push_back(corpus);
+}
+
+void BenchReport::addEncodingRun(const EncodingRun &run)
+{
+    encodingRuns_.push_back(run);
+}
+
+void BenchReport::addDispatchRun(const DispatchRun &run)
+{
+    dispatchRuns_.push_back(run);
+}
+
+bool BenchReport::write(FILE *f) const
+{
+    fprintf(f, "{\n");
+    fprintf(f, "  \"gmp3enc_version\": \"%s\",\n", PRODUCTVERSTR_DOT);
+    fprintf(f, "  \"lame_version\": \"%s\",\n", get_lame_version());
+    fprintf(f, "  \"cpu_count\": %zu,\n", cpuCount_);
+    fprintf(f, "  \"numa_nodes\": %zu,\n", numaNodes_);
+    fprintf(f, "  \"unpack_kernels\": \"%s\",\n", escape(unpackKernels_).c_str());
+    fprintf(f, "  \"profile\": \"%s\",\n", escape(profile_).c_str());
+
+    fprintf(f, "  \"corpora\": [");
+    for (size_t i = 0; i < corpora_.size(); i++) {
+        const Corpus &c = corpora_[i];
+        fprintf(f, "%s\n    {\"name\": \"%s\", \"files\": %zu, \"bytes\": %llu, "
+                "\"audio_seconds\": %.3f}",
+                i ? "," : "",
+                escape(c.name).c_str(),
+                c.files.size(),
+                c.dataSize,
+                c.audioSeconds);
+    }
+    fprintf(f, "%s],\n", corpora_.empty() ? "" : "\n  ");
+
+    fprintf(f, "  \"encoding\": [");
+    for (size_t i = 0; i < encodingRuns_.size(); i++) {
+        const EncodingRun &r = encodingRuns_[i];
+        fprintf(f, "%s\n    {\"corpus\": \"%s\", \"placement\": \"%s\", \"threads\": %zu, \"files\": %zu, "
+                "\"failed\": %zu, \"seconds\": %.4f, \"files_per_sec\": %.3f, "
+                "\"mb_per_sec\": %.3f, \"realtime_factor\": %.3f, \"speedup\": %.3f, "
+                "\"efficiency\": %.3f, \"peak_rss_kb\": %ld, \"output_bytes\": %llu, "
+                "\"output_kbps\": %.1f}",
+                i ? "," : "",
+                escape(r.corpus).c_str(),
+                escape(r.placement).c_str(),
+                r.threads,
+                r.files,
+                r.failed,
+                r.seconds,
+                r.filesPerSec,
+                r.mbPerSec,
+                r.realtimeFactor,
+                r.speedup,
+                r.efficiency,
+                r.peakRssKb,
+                r.outputBytes,
+                r.outputKbps);
+    }
+    fprintf(f, "%s],\n", encodingRuns_.empty() ? "" : "\n  ");
+
+    fprintf(f, "  \"dispatch\": [");
+    for (size_t i = 0; i < dispatchRuns_.size(); i++) {
+        const DispatchRun &r = dispatchRuns_[i];
+        fprintf(f, "%s\n    {\"queue\": \"%s\", \"threads\": %zu, \"tasks\": %zu, "
+                "\"seconds\": %.4f, \"tasks_per_sec\": %.1f}",
+                i ? "," : "",
+                escape(r.queue).c_str(),
+                r.threads,
+                r.tasks,
+                r.seconds,
+                r.tasksPerSec);
+    }
+    fprintf(f, "%s]\n", dispatchRuns_.empty() ? "" : "\n  ");
+    fprintf(f, "}\n");
+
+    return !ferror(f);
+}
+
+std::string BenchReport::escape(const std::string &s)
+{
+    std::string r;
+    for (size_t i = 0; i < s.size(); i++) {
+        char c = s[i];
+        if (c == '"' || c == '\\')
+            r += '\\';
+        if (static_cast<unsigned char>(c) >= 0x20)
+            r += c;
+    }
+    return r;
+}
@@ -0,0 +1,44 @@
+#ifndef GMP3ENC_BENCH_REPORT_
+#define GMP3ENC_BENCH_REPORT_
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "bench_driver.h"
+#include "corpus_generator.h"
+
+namespace GMp3Enc {
+
+// Collects benchmark results and writes them as JSON.
+class BenchReport
+{
+public:
+    BenchReport();
+
+    inline void setCpuCount(size_t n) { cpuCount_ = n; }
+    inline void setNumaNodes(size_t n) { numaNodes_ = n; }
+    inline void setUnpackKernels(const std::string &name) { unpackKernels_ = name; }
+    inline void setProfile(const std::string &name) { profile_ = name; }
+
+    void addCorpus(const Corpus &corpus);
+    void addEncodingRun(const EncodingRun &run);
+    void addDispatchRun(const DispatchRun &run);
+
+    bool write(FILE *f) const;
+
+private:
+    static std::string escape(const std::string &s);
+
+    size_t cpuCount_;
+    size_t numaNodes_;
+    std::string unpackKernels_;
+    std::string profile_;
+    std::vector<Corpus> corpora_;
+    std::vector<EncodingRun> encodingRuns_;
+    std::vector<DispatchRun> dispatchRuns_;
+};
+
+}
+
+#endif
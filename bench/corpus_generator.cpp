@@ -0,0 +1,210 @@
+#include "corpus_generator.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
+#include <sstream>
+#include <vector>
+
+#include "logging_utils.h"
+
+using namespace GMp3Enc;
+
+static const double BENCH_PI = 3.14159265358979323846;
+
+static const int BENCH_BITS[] = { 8, 16, 24, 32 };
+static const int BENCH_CHANNELS[] = { 1, 2 };
+static const int BENCH_RATES[] = { 8000, 11025, 16000, 22050, 32000, 44100, 48000, 96000 };
+
+static const size_t BENCH_BITS_COUNT = sizeof(BENCH_BITS) / sizeof(BENCH_BITS[0]);
+static const size_t BENCH_CHANNELS_COUNT = sizeof(BENCH_CHANNELS) / sizeof(BENCH_CHANNELS[0]);
+static const size_t BENCH_RATES_COUNT = sizeof(BENCH_RATES) / sizeof(BENCH_RATES[0]);
+
+static void put_le(uint8_t *p, uint32_t v, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        p[i] = (v >> (8 * i)) & 0xff;
+}
+
+static bool make_dir(const std::string &dir)
+{
+#ifdef _WIN32
+    _mkdir(dir.c_str());
+#else
+    mkdir(dir.c_str(), 0755);
+#endif
+    struct stat st;
+    return stat(dir.c_str(), &st) == 0 && (st.st_mode & S_IFDIR);
+}
+
+static long long file_size(const std::string &path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return -1;
+    return st.st_size;
+}
+
+bool CorpusGenerator::planCorpus(const std::string &name, double scale, Corpus &corpus)
+{
+    corpus = Corpus();
+    corpus.name = name;
+
+    if (name == "tiny") {
+        for (int n = 0; n < 4; n++) {
+            for (size_t b = 0; b < BENCH_BITS_COUNT; b++) {
+                for (size_t c = 0; c < BENCH_CHANNELS_COUNT; c++) {
+                    for (size_t r = 0; r < BENCH_RATES_COUNT; r++) {
+                        addFile(corpus, BENCH_CHANNELS[c], BENCH_BITS[b],
+                                BENCH_RATES[r], 0.5 * scale);
+                    }
+                }
+            }
+        }
+    } else if (name == "huge") {
+        for (int n = 0; n < 4; n++)
+            addFile(corpus, 2, 16, 44100, 300.0 * scale);
+    } else if (name == "mixed") {
+        for (size_t b = 0; b < BENCH_BITS_COUNT; b++) {
+            for (size_t c = 0; c < BENCH_CHANNELS_COUNT; c++) {
+                for (size_t r = 0; r < BENCH_RATES_COUNT; r++) {
+                    addFile(corpus, BENCH_CHANNELS[c], BENCH_BITS[b],
+                            BENCH_RATES[r], 10.0 * scale);
+                }
+            }
+        }
+        addFile(corpus, 2, 16, 44100, 120.0 * scale);
+        addFile(corpus, 2, 24, 48000, 120.0 * scale);
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+bool CorpusGenerator::generate(const std::string &dir, Corpus &corpus)
+{
+    std::string corpusDir = dir + "/" + corpus.name;
+    if (!make_dir(dir) || !make_dir(corpusDir)) {
+        GMP3ENC_LOGGER_ERROR("Could not create corpus dir: %s", corpusDir.c_str());
+        return false;
+    }
+
+    for (size_t i = 0; i < corpus.files.size(); i++) {
+        CorpusFile &f = corpus.files[i];
+        std::ostringstream ss;
+        ss << corpusDir << "/" << i << "_" << f.channels << "ch_"
+           << f.bitsPerSample << "bit_" << f.samplesPerSec << ".wav";
+        f.path = ss.str();
+
+        // 44 bytes of the canonical header:
+        if (file_size(f.path) == static_cast<long long>(f.dataSize + 44))
+            continue;
+        if (!writeWave(f)) {
+            GMP3ENC_LOGGER_ERROR("Could not write corpus file: %s", f.path.c_str());
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool CorpusGenerator::writeWave(const CorpusFile &file)
+{
+    FILE *f = fopen(file.path.c_str(), "wb");
+    if (!f)
+        return false;
+
+    int bytesPerSample = file.bitsPerSample / 8;
+    int blockAlign = file.channels * bytesPerSample;
+
+    uint8_t header[44];
+    memcpy(header, "RIFF", 4);
+    put_le(header + 4, static_cast<uint32_t>(file.dataSize + 36), 4);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    put_le(header + 16, 16, 4);
+    put_le(header + 20, 1, 2);
+    put_le(header + 22, file.channels, 2);
+    put_le(header + 24, file.samplesPerSec, 4);
+    put_le(header + 28, file.samplesPerSec * blockAlign, 4);
+    put_le(header + 32, blockAlign, 2);
+    put_le(header + 34, file.bitsPerSample, 2);
+    memcpy(header + 36, "data", 4);
+    put_le(header + 40, static_cast<uint32_t>(file.dataSize), 4);
+
+    bool isok = fwrite(header, 1, sizeof(header), f) == sizeof(header);
+
+    const size_t blocksPerChunk = 4096;
+    std::vector<uint8_t> chunk(blocksPerChunk * blockAlign);
+    unsigned long long numSamples = file.dataSize / blockAlign;
+    unsigned long long n = 0;
+    uint32_t seed = 22222;
+    double phase[2] = { 0.0, 0.0 };
+
+    while (isok && n < numSamples) {
+        size_t count = blocksPerChunk;
+        if (numSamples - n < count)
+            count = static_cast<size_t>(numSamples - n);
+
+        uint8_t *p = &chunk[0];
+        for (size_t i = 0; i < count; i++, n++) {
+            double t = static_cast<double>(n) / file.samplesPerSec;
+            for (int c = 0; c < file.channels; c++) {
+                // Sweep between 110 Hz and ~1.9 kHz, channels differ:
+                double freq = 110.0 * (c + 1) * (1.0 + 8.0 * fabs(sin(0.05 * t)));
+                phase[c] += 2.0 * BENCH_PI * freq / file.samplesPerSec;
+                if (phase[c] > 2.0 * BENCH_PI)
+                    phase[c] -= 2.0 * BENCH_PI;
+
+                seed = seed * 1103515245u + 12345u;
+                double noise = (static_cast<double>(seed >> 16) / 65536.0 - 0.5) * 0.02;
+                double v = 0.5 * sin(phase[c]) + noise;
+                int32_t s = static_cast<int32_t>(v * 2147483647.0);
+
+                if (bytesPerSample == 1)
+                    *p = static_cast<uint8_t>((s >> 24) + 128);
+                else
+                    put_le(p, static_cast<uint32_t>(s) >> (32 - file.bitsPerSample),
+                           bytesPerSample);
+                p += bytesPerSample;
+            }
+        }
+
+        size_t size = count * blockAlign;
+        isok = fwrite(&chunk[0], 1, size, f) == size;
+    }
+
+    if (fclose(f) != 0)
+        isok = false;
+    return isok;
+}
+
+void CorpusGenerator::addFile(
+        Corpus &corpus,
+        int channels,
+        int bitsPerSample,
+        int samplesPerSec,
+        double seconds)
+{
+    CorpusFile f;
+    f.channels = channels;
+    f.bitsPerSample = bitsPerSample;
+    f.samplesPerSec = samplesPerSec;
+
+    unsigned long long numSamples =
+            static_cast<unsigned long long>(seconds * samplesPerSec);
+    if (!numSamples)
+        numSamples = 1;
+    f.seconds = static_cast<double>(numSamples) / samplesPerSec;
+    f.dataSize = numSamples * channels * (bitsPerSample / 8);
+
+    corpus.files.push_back(f);
+    corpus.dataSize += f.dataSize;
+    corpus.audioSeconds += f.seconds;
+}
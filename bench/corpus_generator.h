@@ -0,0 +1,62 @@
+#ifndef GMP3ENC_BENCH_CORPUS_GENERATOR_
+#define GMP3ENC_BENCH_CORPUS_GENERATOR_
+
+#include <string>
+#include <vector>
+
+namespace GMp3Enc {
+
+struct CorpusFile
+{
+    std::string path;
+    int channels;
+    int bitsPerSample;
+    int samplesPerSec;
+    double seconds;
+    unsigned long long dataSize;
+};
+
+struct Corpus
+{
+    Corpus()
+        : dataSize(0)
+        , audioSeconds(0.0)
+    {
+    }
+
+    std::string name;
+    std::vector<CorpusFile> files;
+    unsigned long long dataSize;
+    double audioSeconds;
+};
+
+// Writes synthetic wave corpora. Content is a deterministic tone sweep
+// with a little noise, so lame has to do real work on every frame.
+class CorpusGenerator
+{
+public:
+    // Known corpora:
+    //   tiny  - many short files of all supported formats;
+    //   huge  - a few long CD quality files;
+    //   mixed - all formats of medium length plus two long files.
+    // Durations are multiplied by scale.
+    static bool planCorpus(const std::string &name, double scale, Corpus &corpus);
+
+    // Writes files of the planned corpus into dir. Existing files of
+    // the expected size are kept.
+    static bool generate(const std::string &dir, Corpus &corpus);
+
+    static bool writeWave(const CorpusFile &file);
+
+private:
+    static void addFile(
+            Corpus &corpus,
+            int channels,
+            int bitsPerSample,
+            int samplesPerSec,
+            double seconds);
+};
+
+}
+
+#endif
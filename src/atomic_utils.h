@@ -0,0 +1,148 @@
+#ifndef GMP3ENC_ATOMIC_UTILS_
+#define GMP3ENC_ATOMIC_UTILS_
+
+#include <stddef.h>
+#ifdef _MSC_VER
+#include <Windows.h>
+#include <intrin.h>
+#endif
+
+// C++03 has no atomics, so compiler intrinsics are used.
+// Only long and pointer sized values are supported, long long values
+// can be loaded and stored.
+
+namespace GMp3Enc {
+
+#if defined(__GNUC__)
+
+template <typename T>
+inline T atomicLoadRelaxed(const volatile T *p)
+{
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+template <typename T>
+inline T atomicLoadAcquire(const volatile T *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+template <typename T>
+inline void atomicStoreRelaxed(volatile T *p, T v)
+{
+    __atomic_store_n(p, v, __ATOMIC_RELAXED);
+}
+
+template <typename T>
+inline void atomicStoreRelease(volatile T *p, T v)
+{
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+inline bool atomicCompareExchange(volatile long *p, long expected, long desired)
+{
+    return __atomic_compare_exchange_n(
+                p, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+inline long atomicFetchAdd(volatile long *p, long v)
+{
+    return __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST);
+}
+
+inline long atomicExchange(volatile long *p, long v)
+{
+    return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+inline void atomicFenceRelease()
+{
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+inline void atomicFenceSeqCst()
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+#elif defined(_MSC_VER)
+
+// MSVC gives acquire/release semantics to volatile accesses on x86/x64.
+
+template <typename T>
+inline T atomicLoadRelaxed(const volatile T *p)
+{
+    return *p;
+}
+
+template <typename T>
+inline T atomicLoadAcquire(const volatile T *p)
+{
+    return *p;
+}
+
+template <typename T>
+inline void atomicStoreRelaxed(volatile T *p, T v)
+{
+    *p = v;
+}
+
+template <typename T>
+inline void atomicStoreRelease(volatile T *p, T v)
+{
+    *p = v;
+}
+
+// 64-bit values are not loaded and stored atomically by 32-bit code:
+inline long long atomicLoadRelaxed(const volatile long long *p)
+{
+    return InterlockedCompareExchange64(const_cast<volatile long long*>(p), 0, 0);
+}
+
+inline void atomicStoreRelaxed(volatile long long *p, long long v)
+{
+    InterlockedExchange64(p, v);
+}
+
+inline bool atomicCompareExchange(volatile long *p, long expected, long desired)
+{
+    return InterlockedCompareExchange(p, desired, expected) == expected;
+}
+
+inline long atomicFetchAdd(volatile long *p, long v)
+{
+    return InterlockedExchangeAdd(p, v);
+}
+
+inline long atomicExchange(volatile long *p, long v)
+{
+    return InterlockedExchange(p, v);
+}
+
+inline void atomicFenceRelease()
+{
+    _ReadWriteBarrier();
+}
+
+inline void atomicFenceSeqCst()
+{
+    MemoryBarrier();
+}
+
+#else
+#error "Atomic operations are not implemented for this compiler"
+#endif
+
+// Capacity of lock-free rings and deques, indexes are masked
+// instead of taken modulo:
+inline size_t roundUpPowerOfTwo(size_t v)
+{
+    size_t r = 1;
+    while (r < v)
+        r <<= 1;
+    return r;
+}
+
+}
+
+#endif
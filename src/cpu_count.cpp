@@ -0,0 +1,310 @@
+#include "cpu_count.h"
+
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <errno.h>
+#elif defined(_WIN32)
+#include <Windows.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+
+using namespace GMp3Enc;
+
+namespace {
+
+const size_t DEFAULT_CPU_COUNT = 4;
+
+#ifdef __linux__
+
+bool readLines(const char *path, std::vector<std::string> &lines)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return false;
+
+    char buf[4096];
+    std::string line;
+    while (fgets(buf, sizeof(buf), f)) {
+        line += buf;
+        if (line[line.length() - 1] != '\n' && !feof(f))
+            continue;
+        if (line[line.length() - 1] == '\n')
+            line.erase(line.length() - 1);
+        lines.push_back(line);
+        line.clear();
+    }
+    fclose(f);
+    return true;
+}
+
+void split(const std::string &s, char separator, std::vector<std::string> &fields)
+{
+    size_t start = 0;
+    while (true) {
+        size_t end = s.find(separator, start);
+        if (end == std::string::npos) {
+            fields.push_back(s.substr(start));
+            break;
+        }
+        fields.push_back(s.substr(start, end - start));
+        start = end + 1;
+    }
+}
+
+bool hasItem(const std::string &list, const char *item)
+{
+    std::vector<std::string> items;
+    split(list, ',', items);
+    for (size_t i = 0; i < items.size(); i++) {
+        if (items[i] == item)
+            return true;
+    }
+    return false;
+}
+
+#endif
+
+}
+
+size_t CpuCount::detect()
+{
+    Source source;
+    std::string description;
+    return detect(source, description);
+}
+
+size_t CpuCount::detect(Source &source, std::string &description)
+{
+    size_t count = 0;
+    source = SourceDefault;
+    char quota[64] = "";
+
+#ifdef __linux__
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    if (online > 0) {
+        count = online;
+        source = SourceOnline;
+    }
+
+    // taskset, cpuset cgroups and container runtimes restrict the mask:
+    std::vector<int> affinity;
+    if (readAffinity(affinity) && !affinity.empty() && (!count || affinity.size() < count)) {
+        count = affinity.size();
+        source = SourceAffinity;
+    }
+
+    // Quota limits CPU time, not CPUs. Workers beyond it are throttled
+    // by the scheduler. Hybrid hosts may have the cpu controller only
+    // in the v1 hierarchy, so both are checked:
+    for (int v = 0; v < 2; v++) {
+        bool isV2 = v == 1;
+        double cpus = 0.0;
+        if (!readCgroupQuota(isV2, cpus))
+            continue;
+        size_t n = static_cast<size_t>(ceil(cpus));
+        if (n < 1)
+            n = 1;
+        if (!count || n < count) {
+            count = n;
+            source = isV2 ? SourceCgroupV2 : SourceCgroupV1;
+            snprintf(quota, sizeof(quota), " %.2f CPUs", cpus);
+        }
+    }
+#elif defined(_WIN32)
+    SYSTEM_INFO sysinfo;
+    GetSystemInfo(&sysinfo);
+    if (sysinfo.dwNumberOfProcessors > 0) {
+        count = sysinfo.dwNumberOfProcessors;
+        source = SourceOnline;
+    }
+
+    DWORD_PTR processMask;
+    DWORD_PTR systemMask;
+    if (GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask)) {
+        size_t affinity = 0;
+        for (; processMask; processMask &= processMask - 1)
+            affinity++;
+        if (affinity > 0 && (!count || affinity < count)) {
+            count = affinity;
+            source = SourceAffinity;
+        }
+    }
+#endif
+
+    if (!count) {
+        count = DEFAULT_CPU_COUNT;
+        source = SourceDefault;
+    }
+    description = std::string(sourceName(source)) + quota;
+    return count;
+}
+
+const char* CpuCount::sourceName(Source source)
+{
+    switch (source) {
+    case SourceOnline:
+        return "online CPUs";
+    case SourceAffinity:
+        return "CPU affinity mask";
+    case SourceCgroupV1:
+        return "cgroup v1 CPU quota";
+    case SourceCgroupV2:
+        return "cgroup v2 CPU quota";
+    default:
+        return "default";
+    }
+}
+
+#ifdef __linux__
+
+bool CpuCount::readAffinity(std::vector<int> &cpus)
+{
+    // cpu_set_t holds only 1024 CPUs, bigger masks are allocated
+    // until the kernel accepts the size:
+    long configured = sysconf(_SC_NPROCESSORS_CONF);
+    int count = configured > CPU_SETSIZE ? static_cast<int>(configured) : CPU_SETSIZE;
+    for (; count <= MAX_AFFINITY_CPUS; count *= 2) {
+        cpu_set_t *set = CPU_ALLOC(count);
+        if (!set)
+            return false;
+        size_t size = CPU_ALLOC_SIZE(count);
+        CPU_ZERO_S(size, set);
+        if (sched_getaffinity(0, size, set) == 0) {
+            for (int i = 0; i < count; i++) {
+                if (CPU_ISSET_S(i, size, set))
+                    cpus.push_back(i);
+            }
+            CPU_FREE(set);
+            return true;
+        }
+        CPU_FREE(set);
+        if (errno != EINVAL)
+            return false;
+    }
+    return false;
+}
+
+bool CpuCount::readCgroupQuota(bool isV2, double &cpus)
+{
+    std::string dir;
+    std::string mountPoint;
+    if (!findCgroupDir(isV2, dir, mountPoint))
+        return false;
+
+    // Limit of any ancestor applies to the process as well:
+    bool isFound = false;
+    while (true) {
+        double dirCpus;
+        if (readQuotaFile(dir, isV2, dirCpus) && (!isFound || dirCpus < cpus)) {
+            cpus = dirCpus;
+            isFound = true;
+        }
+        if (dir.length() <= mountPoint.length())
+            break;
+        dir.erase(dir.rfind('/'));
+    }
+    return isFound;
+}
+
+bool CpuCount::readQuotaFile(const std::string &dir, bool isV2, double &cpus)
+{
+    long long quota = -1;
+    long long period = 0;
+    if (isV2) {
+        // "max 100000" or "<quota> <period>":
+        std::vector<std::string> lines;
+        if (!readLines((dir + "/cpu.max").c_str(), lines) || lines.empty())
+            return false;
+        std::vector<std::string> fields;
+        split(lines[0], ' ', fields);
+        if (fields.size() != 2 || fields[0] == "max")
+            return false;
+        quota = atoll(fields[0].c_str());
+        period = atoll(fields[1].c_str());
+    } else {
+        std::vector<std::string> quotaLines;
+        std::vector<std::string> periodLines;
+        if (!readLines((dir + "/cpu.cfs_quota_us").c_str(), quotaLines) || quotaLines.empty() ||
+            !readLines((dir + "/cpu.cfs_period_us").c_str(), periodLines) || periodLines.empty())
+            return false;
+        quota = atoll(quotaLines[0].c_str());
+        period = atoll(periodLines[0].c_str());
+    }
+
+    // -1 is no limit in v1:
+    if (quota <= 0 || period <= 0)
+        return false;
+    cpus = static_cast<double>(quota) / period;
+    return true;
+}
+
+bool CpuCount::findCgroupDir(bool isV2, std::string &dir, std::string &mountPoint)
+{
+    // Lines are "<id>:<controllers>:<path>", the v2 one is "0::<path>":
+    std::vector<std::string> lines;
+    if (!readLines("/proc/self/cgroup", lines))
+        return false;
+
+    std::string path;
+    bool isFound = false;
+    for (size_t i = 0; i < lines.size() && !isFound; i++) {
+        size_t first = lines[i].find(':');
+        size_t second = first == std::string::npos ? first : lines[i].find(':', first + 1);
+        if (second == std::string::npos)
+            continue;
+        std::string id = lines[i].substr(0, first);
+        std::string controllers = lines[i].substr(first + 1, second - first - 1);
+        if (isV2 ? (id == "0" && controllers.empty()) : hasItem(controllers, "cpu")) {
+            path = lines[i].substr(second + 1);
+            isFound = true;
+        }
+    }
+    if (!isFound)
+        return false;
+
+    // Mount lines are "<id> <parent> <dev> <root> <mount point> <options>
+    // [<optional fields>] - <fs type> <source> <super options>":
+    lines.clear();
+    if (!readLines("/proc/self/mountinfo", lines))
+        return false;
+
+    for (size_t i = 0; i < lines.size(); i++) {
+        size_t separator = lines[i].find(" - ");
+        if (separator == std::string::npos)
+            continue;
+        std::vector<std::string> fields;
+        std::vector<std::string> fsFields;
+        split(lines[i].substr(0, separator), ' ', fields);
+        split(lines[i].substr(separator + 3), ' ', fsFields);
+        if (fields.size() < 5 || fsFields.size() < 3)
+            continue;
+        if (isV2 ? fsFields[0] != "cgroup2" : (fsFields[0] != "cgroup" || !hasItem(fsFields[2], "cpu")))
+            continue;
+
+        // Container sees only a subtree of the hierarchy, its cgroup
+        // path may be outside of the mounted root:
+        const std::string &root = fields[3];
+        std::string relative = path;
+        if (root != "/") {
+            if (path.compare(0, root.length(), root) == 0 &&
+                (path.length() == root.length() || path[root.length()] == '/'))
+                relative = path.substr(root.length());
+            else
+                relative.clear();
+        }
+        if (relative == "/")
+            relative.clear();
+
+        mountPoint = fields[4];
+        dir = mountPoint + relative;
+        return true;
+    }
+    return false;
+}
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef GMP3ENC_CPU_COUNT_
+#define GMP3ENC_CPU_COUNT_
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+namespace GMp3Enc {
+
+// Number of CPUs the process can actually use, the default number of
+// worker threads.
+class CpuCount
+{
+public:
+    enum Source
+    {
+        SourceDefault,   // Nothing could be detected.
+        SourceOnline,    // Online CPUs of the system.
+        SourceAffinity,  // CPU affinity mask of the process.
+        SourceCgroupV1,  // CFS quota of the cgroup v1 cpu controller.
+        SourceCgroupV2   // cpu.max of the cgroup v2.
+    };
+
+    // The smallest of online CPUs, the affinity mask and the cgroup
+    // CPU quota of the process (rounded up), at least 1. description
+    // tells where the number comes from, e.g. "cgroup v2 quota 2.50".
+    static size_t detect(Source &source, std::string &description);
+    static size_t detect();
+
+    static const char* sourceName(Source source);
+
+#ifdef __linux__
+    // Larger masks are not read, CPU lists beyond it are rejected.
+    static const int MAX_AFFINITY_CPUS = 1 << 16;
+
+    // CPUs in the affinity mask of the process, in ascending order.
+    static bool readAffinity(std::vector<int> &cpus);
+#endif
+
+private:
+#ifdef __linux__
+    static bool readCgroupQuota(bool isV2, double &cpus);
+    static bool readQuotaFile(const std::string &dir, bool isV2, double &cpus);
+    static bool findCgroupDir(bool isV2, std::string &dir, std::string &mountPoint);
+#endif
+};
+
+}
+
+#endif
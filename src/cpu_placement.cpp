@@ -0,0 +1,231 @@
+#include "cpu_placement.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+
+#include "cpu_count.h"
+#include "logging_utils.h"
+
+using namespace GMp3Enc;
+
+namespace {
+
+#ifdef __linux__
+
+bool readFirstLine(const std::string &path, std::string &line)
+{
+    FILE *f = fopen(path.c_str(), "r");
+    if (!f)
+        return false;
+
+    char buf[4096];
+    bool isok = fgets(buf, sizeof(buf), f) != NULL;
+    fclose(f);
+    if (!isok)
+        return false;
+
+    line = buf;
+    while (!line.empty() && (line[line.length() - 1] == '\n' || line[line.length() - 1] == ' '))
+        line.erase(line.length() - 1);
+    return true;
+}
+
+#endif
+
+}
+
+CpuPlacement::CpuPlacement()
+    : policy_(PolicyNone)
+{
+}
+
+bool CpuPlacement::parsePolicy(const std::string &name, Policy &policy)
+{
+    if (name == "none")
+        policy = PolicyNone;
+    else if (name == "compact")
+        policy = PolicyCompact;
+    else if (name == "scatter")
+        policy = PolicyScatter;
+    else if (name == "nodes")
+        policy = PolicyNodes;
+    else
+        return false;
+    return true;
+}
+
+const char* CpuPlacement::policyName(Policy policy)
+{
+    switch (policy) {
+    case PolicyCompact:
+        return "compact";
+    case PolicyScatter:
+        return "scatter";
+    case PolicyNodes:
+        return "nodes";
+    default:
+        return "none";
+    }
+}
+
+bool CpuPlacement::plan(Policy policy, size_t workersCount)
+{
+    policy_ = PolicyNone;
+    nodes_.clear();
+    workerCpus_.clear();
+    workerNodes_.clear();
+    if (policy == PolicyNone)
+        return true;
+
+#ifdef __linux__
+    if (!readTopology() || nodes_.empty())
+        return false;
+
+    std::vector<int> cpus;
+    std::vector<int> cpuNodes;
+    for (size_t n = 0; n < nodes_.size(); n++) {
+        for (size_t c = 0; c < nodes_[n].cpus.size(); c++) {
+            cpus.push_back(nodes_[n].cpus[c]);
+            cpuNodes.push_back(static_cast<int>(n));
+        }
+    }
+
+    workerCpus_.resize(workersCount);
+    workerNodes_.resize(workersCount);
+    for (size_t i = 0; i < workersCount; i++) {
+        size_t n = 0;
+        if (policy == PolicyCompact) {
+            // More workers than CPUs wrap around:
+            size_t c = i % cpus.size();
+            n = cpuNodes[c];
+            workerCpus_[i].push_back(cpus[c]);
+        } else if (policy == PolicyScatter) {
+            n = i % nodes_.size();
+            const std::vector<int> &nodeCpus = nodes_[n].cpus;
+            workerCpus_[i].push_back(nodeCpus[(i / nodes_.size()) % nodeCpus.size()]);
+        } else {
+            // Contiguous ranges of workers, so pools differ by one at most:
+            n = i * nodes_.size() / workersCount;
+            workerCpus_[i] = nodes_[n].cpus;
+        }
+        workerNodes_[i] = nodes_[n].id;
+    }
+
+    policy_ = policy;
+    return true;
+#else
+    (void)workersCount;
+    return false;
+#endif
+}
+
+int CpuPlacement::workerNode(size_t worker) const
+{
+    if (worker >= workerNodes_.size())
+        return -1;
+    return workerNodes_[worker];
+}
+
+bool CpuPlacement::apply(size_t worker) const
+{
+    if (worker >= workerCpus_.size())
+        return true;
+
+#ifdef __linux__
+    const std::vector<int> &cpus = workerCpus_[worker];
+    int maxCpu = *std::max_element(cpus.begin(), cpus.end());
+    cpu_set_t *set = CPU_ALLOC(maxCpu + 1);
+    if (!set)
+        return false;
+    size_t size = CPU_ALLOC_SIZE(maxCpu + 1);
+    CPU_ZERO_S(size, set);
+    for (size_t i = 0; i < cpus.size(); i++)
+        CPU_SET_S(cpus[i], size, set);
+
+    int r = pthread_setaffinity_np(pthread_self(), size, set);
+    CPU_FREE(set);
+    if (r) {
+        GMP3ENC_LOGGER_ERROR("Failed to set affinity of worker %zu: %d", worker, r);
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+#ifdef __linux__
+
+bool CpuPlacement::readTopology()
+{
+    std::vector<int> allowed;
+    if (!CpuCount::readAffinity(allowed))
+        return false;
+
+    // Kernels without NUMA support have no node directories, all CPUs
+    // are on one node then:
+    std::string line;
+    std::vector<int> ids;
+    if (!readFirstLine("/sys/devices/system/node/online", line) || !parseCpuList(line, ids)) {
+        Node node;
+        node.id = 0;
+        node.cpus = allowed;
+        nodes_.push_back(node);
+        return true;
+    }
+
+    for (size_t i = 0; i < ids.size(); i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", ids[i]);
+        std::vector<int> nodeCpus;
+        if (!readFirstLine(path, line) || !parseCpuList(line, nodeCpus))
+            continue;
+
+        // Memory-only nodes and nodes outside of the mask get no workers:
+        Node node;
+        node.id = ids[i];
+        for (size_t c = 0; c < nodeCpus.size(); c++) {
+            if (std::binary_search(allowed.begin(), allowed.end(), nodeCpus[c]))
+                node.cpus.push_back(nodeCpus[c]);
+        }
+        if (!node.cpus.empty())
+            nodes_.push_back(node);
+    }
+    return true;
+}
+
+bool CpuPlacement::parseCpuList(const std::string &list, std::vector<int> &cpus)
+{
+    // "0-3,8-11,16":
+    const char *p = list.c_str();
+    while (*p) {
+        char *end = NULL;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0)
+            return false;
+        long last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+                return false;
+        }
+        if (last >= CpuCount::MAX_AFFINITY_CPUS)
+            return false;
+        for (long i = first; i <= last; i++)
+            cpus.push_back(static_cast<int>(i));
+        if (*end && *end != ',')
+            return false;
+        p = *end ? end + 1 : end;
+    }
+    return !cpus.empty();
+}
+
+#endif
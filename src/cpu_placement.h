@@ -0,0 +1,65 @@
+#ifndef GMP3ENC_CPU_PLACEMENT_
+#define GMP3ENC_CPU_PLACEMENT_
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+namespace GMp3Enc {
+
+// Placement of worker threads on CPUs and NUMA nodes. Workers allocate
+// their buffers and lame contexts after they are placed, so the memory
+// is taken from the local node (first-touch).
+class CpuPlacement
+{
+public:
+    enum Policy
+    {
+        PolicyNone,     // Threads float over all allowed CPUs.
+        PolicyCompact,  // One CPU per worker, nodes are filled one by one.
+        PolicyScatter,  // One CPU per worker, nodes in round-robin order.
+        PolicyNodes     // Workers are split into per-node pools, every pool
+                        // floats over CPUs of its node and steals tasks
+                        // from the same node first.
+    };
+
+    CpuPlacement();
+
+    static bool parsePolicy(const std::string &name, Policy &policy);
+    static const char* policyName(Policy policy);
+
+    // Reads NUMA topology and the affinity mask, assigns CPUs to workers.
+    // Returns false if the policy is not supported, workers are
+    // left unplaced then.
+    bool plan(Policy policy, size_t workersCount);
+
+    inline Policy policy() const { return policy_; }
+    inline size_t nodesCount() const { return nodes_.size(); }
+
+    // NUMA node of the worker, -1 if it is not placed.
+    int workerNode(size_t worker) const;
+
+    // Binds the calling thread to CPUs of the worker.
+    bool apply(size_t worker) const;
+
+private:
+    struct Node
+    {
+        int id;
+        std::vector<int> cpus;  // Only CPUs allowed for the process.
+    };
+
+#ifdef __linux__
+    bool readTopology();
+    static bool parseCpuList(const std::string &list, std::vector<int> &cpus);
+#endif
+
+    Policy policy_;
+    std::vector<Node> nodes_;
+    std::vector<std::vector<int> > workerCpus_;
+    std::vector<int> workerNodes_;
+};
+
+}
+
+#endif
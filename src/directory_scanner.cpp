@@ -0,0 +1,385 @@
+#include "directory_scanner.h"
+
+#ifdef __linux__
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#elif defined(_WIN32)
+#include <Windows.h>
+#endif
+#include <string.h>
+
+#include "atomic_utils.h"
+#include "logging_utils.h"
+#include "manifest.h"
+
+using namespace GMp3Enc;
+
+DirectoryScanner::DirectoryScanner(size_t threadsCount, int maxDepth, int details)
+    : threadsCount_(threadsCount ? threadsCount : 1)
+    , maxDepth_(maxDepth)
+    , details_(details)
+#ifdef __linux__
+    , rootFd_(-1)
+#endif
+    , runningThreads_(0)
+    , busyThreads_(0)
+    , isStopped_(0)
+    , isInitialized_(false)
+    , queuedBatches_(0)
+{
+}
+
+DirectoryScanner::~DirectoryScanner()
+{
+    stop();
+
+    // Batches which were not read by the receiver:
+    std::list<ScanMessage> msgs;
+    results_.recvAll(msgs, false);
+    std::list<ScanMessage>::iterator it;
+    for (it = msgs.begin(); it != msgs.end(); ++it)
+        delete it->files;
+
+#ifdef __linux__
+    if (rootFd_ != -1)
+        close(rootFd_);
+#endif
+    if (isInitialized_) {
+        pthread_cond_destroy(&queueCondv_);
+        pthread_cond_destroy(&condv_);
+        pthread_mutex_destroy(&mutex_);
+    }
+}
+
+bool DirectoryScanner::start(const std::string &root)
+{
+    if (isInitialized_ || root.empty())
+        return false;
+
+    root_ = root;
+    rootSep_ = root_[root_.length() - 1] == '/' ? "" : "/";
+
+#ifdef __linux__
+    // Subdirectories are opened relative to the root, so the root
+    // path is resolved only once:
+    rootFd_ = open(root_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (rootFd_ == -1) {
+        GMP3ENC_LOGGER_ERROR("Could not open dir: %s", root_.c_str());
+        return false;
+    }
+#endif
+
+    if (!results_.init())
+        return false;
+#ifdef __linux__
+    if (!results_.enableEventFd())
+        return false;
+#endif
+
+    int r = pthread_mutex_init(&mutex_, NULL);
+    if (r)
+        return false;
+    r = pthread_cond_init(&condv_, NULL);
+    if (r) {
+        pthread_mutex_destroy(&mutex_);
+        return false;
+    }
+    r = pthread_cond_init(&queueCondv_, NULL);
+    if (r) {
+        pthread_cond_destroy(&condv_);
+        pthread_mutex_destroy(&mutex_);
+        return false;
+    }
+    isInitialized_ = true;
+
+    Directory dir;
+    dir.depth = 0;
+    dirs_.push_back(dir);
+
+    MutexGuard g(&mutex_);
+    for (size_t i = 0; i < threadsCount_; i++) {
+        pthread_t t;
+        r = pthread_create(&t, NULL, &threadFunc, reinterpret_cast<void*>(this));
+        if (r)
+            break;
+        threads_.push_back(t);
+        runningThreads_++;
+    }
+
+    return !threads_.empty();
+}
+
+void DirectoryScanner::stop()
+{
+    if (!isInitialized_)
+        return;
+
+    {
+        MutexGuard g(&mutex_);
+        atomicStoreRelease(&isStopped_, 1L);
+        pthread_cond_broadcast(&condv_);
+        pthread_cond_broadcast(&queueCondv_);
+    }
+
+    for (size_t i = 0; i < threads_.size(); i++)
+        pthread_join(threads_[i], NULL);
+    threads_.clear();
+}
+
+void DirectoryScanner::readResults(std::list<ScannedFile> &files, bool &isFinished, size_t maxFiles)
+{
+    isFinished = false;
+
+#ifdef __linux__
+    results_.clearEvent();
+#endif
+    size_t count = 0;
+    size_t batches = 0;
+    ScanMessage msg;
+    while (count < maxFiles && results_.recv(msg, false) == MsgQResSuccess) {
+        if (msg.files) {
+            count += msg.files->size();
+            files.insert(files.end(), msg.files->begin(), msg.files->end());
+            delete msg.files;
+            batches++;
+        }
+        if (msg.isFinished)
+            isFinished = true;
+    }
+
+    if (batches) {
+        MutexGuard g(&mutex_);
+        queuedBatches_ -= batches;
+        pthread_cond_broadcast(&queueCondv_);
+    }
+}
+
+void* DirectoryScanner::threadFunc(void *h)
+{
+    DirectoryScanner *scanner = reinterpret_cast<DirectoryScanner*>(h);
+    scanner->exec();
+    return NULL;
+}
+
+void DirectoryScanner::exec()
+{
+    Directory dir;
+    while (takeDirectory(dir)) {
+        scanDirectory(dir);
+        finishDirectory();
+    }
+
+    // The last thread reports the end of the scan:
+    MutexGuard g(&mutex_);
+    if (--runningThreads_ == 0) {
+        ScanMessage msg;
+        msg.isFinished = true;
+        results_.send(msg);
+    }
+}
+
+bool DirectoryScanner::takeDirectory(Directory &dir)
+{
+    MutexGuard g(&mutex_);
+    while (true) {
+        if (isStopped())
+            return false;
+        if (!dirs_.empty())
+            break;
+        // Nothing to take and nobody can add more:
+        if (busyThreads_ == 0) {
+            pthread_cond_broadcast(&condv_);
+            return false;
+        }
+        pthread_cond_wait(&condv_, &mutex_);
+    }
+
+    // Depth-first order keeps the queue short:
+    dir = dirs_.back();
+    dirs_.pop_back();
+    busyThreads_++;
+    return true;
+}
+
+void DirectoryScanner::addDirectory(const Directory &dir)
+{
+    MutexGuard g(&mutex_);
+    dirs_.push_back(dir);
+    pthread_cond_signal(&condv_);
+}
+
+void DirectoryScanner::finishDirectory()
+{
+    MutexGuard g(&mutex_);
+    busyThreads_--;
+    if (busyThreads_ == 0 && dirs_.empty())
+        pthread_cond_broadcast(&condv_);
+}
+
+void DirectoryScanner::scanDirectory(const Directory &dir)
+{
+    std::vector<ScannedFile> *batch = NULL;
+    std::string prefix = dir.relativePath.empty() ? "" : dir.relativePath + "/";
+    bool canDescend = maxDepth_ < 0 || dir.depth < maxDepth_;
+
+#ifdef __linux__
+    int fd;
+    if (dir.relativePath.empty()) {
+        fd = dup(rootFd_);
+    } else {
+        fd = openat(
+                    rootFd_,
+                    dir.relativePath.c_str(),
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    }
+    DIR *dp = fd != -1 ? fdopendir(fd) : NULL;
+    if (!dp) {
+        GMP3ENC_LOGGER_ERROR(
+                    "Could not open dir: %s%s%s",
+                    root_.c_str(),
+                    rootSep_.c_str(),
+                    dir.relativePath.c_str());
+        if (fd != -1)
+            close(fd);
+        return;
+    }
+
+    dirent *dirp;
+    while ((dirp = readdir(dp)) != NULL && !isStopped()) {
+        const char *name = dirp->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+
+        // Most file systems report the type in the entry, stat is
+        // needed only for unknown types and symbolic links:
+        unsigned char type = dirp->d_type;
+        bool hasStat = false;
+        struct stat statbuf;
+        if (type == DT_UNKNOWN) {
+            if (fstatat(dirfd(dp), name, &statbuf, AT_SYMLINK_NOFOLLOW) < 0) {
+                GMP3ENC_LOGGER_ERROR("Could not stat file: %s%s", prefix.c_str(), name);
+                continue;
+            }
+            if (S_ISDIR(statbuf.st_mode))
+                type = DT_DIR;
+            else if (S_ISREG(statbuf.st_mode))
+                type = DT_REG;
+            else if (S_ISLNK(statbuf.st_mode))
+                type = DT_LNK;
+            hasStat = type == DT_REG;
+        }
+        if (type == DT_LNK && isWaveFileName(name)) {
+            if (fstatat(dirfd(dp), name, &statbuf, 0) == 0 && S_ISREG(statbuf.st_mode)) {
+                type = DT_REG;
+                hasStat = true;
+            }
+        }
+
+        if (type == DT_DIR && canDescend) {
+            Directory sub;
+            sub.relativePath = prefix + name;
+            sub.depth = dir.depth + 1;
+            addDirectory(sub);
+        } else if (type == DT_REG && isWaveFileName(name)) {
+            if (!hasStat && details_)
+                hasStat = fstatat(dirfd(dp), name, &statbuf, 0) == 0;
+
+            ScannedFile f;
+            f.relativePath = prefix + name;
+            if (hasStat) {
+                f.size = statbuf.st_size;
+                f.mtimeNs = statbuf.st_mtim.tv_sec * 1000000000LL + statbuf.st_mtim.tv_nsec;
+                f.inode = statbuf.st_ino;
+            }
+            addFile(f, batch);
+        }
+    }
+
+    closedir(dp);
+#elif defined(_WIN32)
+    WIN32_FIND_DATA data;
+    std::string pat = root_ + rootSep_ + prefix + "*";
+    HANDLE hFind = FindFirstFile(pat.c_str(), &data);
+    if (hFind != INVALID_HANDLE_VALUE) {
+        do {
+            const char *name = data.cFileName;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+                continue;
+
+            bool isDir = (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+            bool isLink = (data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0;
+            if (isDir && !isLink && canDescend) {
+                Directory sub;
+                sub.relativePath = prefix + name;
+                sub.depth = dir.depth + 1;
+                addDirectory(sub);
+            } else if (!isDir && isWaveFileName(name)) {
+                // FILETIME is in 100 ns units:
+                ScannedFile f;
+                f.relativePath = prefix + name;
+                f.size = (static_cast<long long>(data.nFileSizeHigh) << 32) |
+                        data.nFileSizeLow;
+                f.mtimeNs = ((static_cast<long long>(data.ftLastWriteTime.dwHighDateTime) << 32) |
+                        data.ftLastWriteTime.dwLowDateTime) * 100;
+                addFile(f, batch);
+            }
+        } while (!isStopped() && FindNextFile(hFind, &data));
+        FindClose(hFind);
+    }
+#endif
+
+    flush(batch);
+}
+
+void DirectoryScanner::addFile(const ScannedFile &file, std::vector<ScannedFile> *&batch)
+{
+    if (!batch) {
+        batch = new std::vector<ScannedFile>();
+        batch->reserve(BATCH_SIZE);
+    }
+
+    batch->push_back(file);
+    ScannedFile &f = batch->back();
+    f.path = root_ + rootSep_ + f.relativePath;
+
+    // Hashing is done here, so it runs on all scanner threads:
+    uint64_t hash = 0;
+    if ((details_ & ScanContentHash) && f.size >= 0 && Manifest::hashContent(f.path, f.size, hash))
+        f.contentHash = hash;
+
+    if (batch->size() >= BATCH_SIZE)
+        flush(batch);
+}
+
+void DirectoryScanner::flush(std::vector<ScannedFile> *&batch)
+{
+    if (!batch)
+        return;
+
+    {
+        MutexGuard g(&mutex_);
+        while (queuedBatches_ >= MAX_QUEUED_BATCHES && !isStopped())
+            pthread_cond_wait(&queueCondv_, &mutex_);
+        queuedBatches_++;
+    }
+
+    ScanMessage msg;
+    msg.files = batch;
+    results_.send(msg);
+    batch = NULL;
+}
+
+bool DirectoryScanner::isStopped() const
+{
+    return atomicLoadAcquire(&isStopped_) != 0;
+}
+
+bool DirectoryScanner::isWaveFileName(const char *name)
+{
+    size_t len = strlen(name);
+    return len > 4 && strcmp(name + len - 4, ".wav") == 0;
+}
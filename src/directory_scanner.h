@@ -0,0 +1,131 @@
+#ifndef GMP3ENC_DIRECTORY_SCANNER_
+#define GMP3ENC_DIRECTORY_SCANNER_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <deque>
+#include <list>
+#include <string>
+#include <vector>
+
+#include "message_queue.h"
+
+namespace GMp3Enc {
+
+struct ScannedFile
+{
+    ScannedFile()
+        : size(-1)
+        , mtimeNs(0)
+        , inode(0)
+        , contentHash(0)
+    {
+    }
+
+    std::string path;          // Path to open.
+    std::string relativePath;  // Path relative to the scanned root, '/' separated.
+    long long size;            // -1 if unknown.
+    long long mtimeNs;         // Filled with ScanFileInfo.
+    unsigned long long inode;
+    unsigned long long contentHash;  // Filled with ScanContentHash.
+};
+
+// Files are passed to the receiver in small batches, so it can start
+// encoding before the whole tree is scanned.
+struct ScanMessage
+{
+    ScanMessage()
+        : files(NULL)
+        , isFinished(false)
+    {
+    }
+
+    std::vector<ScannedFile> *files;
+    bool isFinished;
+};
+
+// Recursively looks for .wav files under the root directory. Several
+// threads can scan subdirectories in parallel. Symbolic links to files
+// are accepted, links to directories are not followed.
+class DirectoryScanner
+{
+public:
+    static const size_t BATCH_SIZE = 32;
+
+    // Scanner threads wait when the receiver has not taken this many
+    // batches yet, so memory of a huge tree is bounded.
+    static const size_t MAX_QUEUED_BATCHES = 256;
+
+    // Optional details of found files. They cost a stat call per file
+    // on Linux, content hash reads the file.
+    enum Details
+    {
+        ScanSize = 0x01,
+        ScanFileInfo = 0x02,     // Size, mtime and inode.
+        ScanContentHash = 0x04
+    };
+
+    // maxDepth < 0 - no limit, 0 - only the root directory.
+    DirectoryScanner(size_t threadsCount, int maxDepth, int details);
+    ~DirectoryScanner();
+
+    bool start(const std::string &root);
+    void stop();
+
+#ifdef __linux__
+    // Readable when new files are found or the scan is finished.
+    inline int eventFd() const { return results_.eventFd(); }
+#endif
+
+    // Non-blocking. Appends files found since the last call, whole
+    // batches until there are at least maxFiles of them. Rest of the
+    // batches are left for the next call, the event is not signaled
+    // for them again.
+    void readResults(std::list<ScannedFile> &files, bool &isFinished, size_t maxFiles);
+
+private:
+    DirectoryScanner(const DirectoryScanner&);
+    DirectoryScanner& operator=(const DirectoryScanner&);
+
+    struct Directory
+    {
+        std::string relativePath;  // Empty for the root.
+        int depth;
+    };
+
+    static void* threadFunc(void *h);
+    void exec();
+    bool takeDirectory(Directory &dir);
+    void addDirectory(const Directory &dir);
+    void finishDirectory();
+    void scanDirectory(const Directory &dir);
+    void addFile(const ScannedFile &file, std::vector<ScannedFile> *&batch);
+    void flush(std::vector<ScannedFile> *&batch);
+    bool isStopped() const;
+
+    static bool isWaveFileName(const char *name);
+
+    size_t threadsCount_;
+    int maxDepth_;
+    int details_;
+    std::string root_;
+    std::string rootSep_;
+#ifdef __linux__
+    int rootFd_;
+#endif
+    std::vector<pthread_t> threads_;
+    size_t runningThreads_;
+    std::deque<Directory> dirs_;
+    size_t busyThreads_;
+    volatile long isStopped_;
+    bool isInitialized_;
+    pthread_mutex_t mutex_;
+    pthread_cond_t condv_;
+    pthread_cond_t queueCondv_;  // Signaled when batches are taken.
+    size_t queuedBatches_;
+    MessageQueue<ScanMessage> results_;
+};
+
+}
+
+#endif
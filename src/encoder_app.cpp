@@ -5,6 +5,7 @@
 #ifdef __linux__
 #include <sys/signalfd.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 #include <signal.h>
 #include <dirent.h>
@@ -12,52 +13,89 @@
 #include <errno.h>
 #elif defined(_WIN32)
 #include <Windows.h>
+#include <io.h>
+#include <fcntl.h>
+#include <errno.h>
 #endif
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <algorithm>
 
 #include <lame/lame.h>
 #include <gmp3enc_version_no.h>
 
 #include "logging_utils.h"
+#include "shared_pcm_source.h"
 
 
 using namespace GMp3Enc;
 
 
 EncoderApp::EncoderApp(int argc, char *argv[])
-    : inactiveTimeoutMs_(150)
+    : threadPool_(NULL)
+    , threadsCount_(0)
+    , placementPolicy_(CpuPlacement::PolicyNone)
+    , inactiveTimeoutMs_(150)
+    , taskTimeoutMs_(0)
     , scanDirs_(false)
+    , splitSegments_(false)
+    , readerType_(WaveReaderMmap)
+    , ioBackend_(IoBackendSync)
+    , unpackKernels_(PcmUnpack::KernelAvx2)
+    , ordering_(new LargestFirstOrdering())
+    , scanThreads_(1)
+    , maxDepth_(-1)
+    , showProgress_(false)
+    , progressIntervalMs_(1000)
+    , metricsJson_(false)
+    , metricsIntervalMs_(0)
+    , tasksSubmitted_(0)
+    , tasksCompleted_(0)
+    , tasksFailed_(0)
+    , scanner_(NULL)
+    , isScanFinished_(false)
+    , pendingSeq_(0)
+    , manifestHash_(false)
+    , manifest_(NULL)
+    , skippedFiles_(0)
+#ifdef __linux__
+    , jobServer_(NULL)
+#endif
+    , jobList_(NULL)
+    , results_(NULL)
+    , isJobListFinished_(false)
+    , jobsServed_(0)
+    , jobsFailed_(0)
 {
     // First element in the cmd args array is always
     // called program name.
     for (int i = 1; i < argc; i++)
         cmdOpts_.push_back(std::string(argv[i]));
-
-    // Detect cpu cores:
-    int numCpu = 4;
-#ifdef __linux__
-    numCpu = sysconf(_SC_NPROCESSORS_ONLN);
-    if (numCpu > 100)
-        numCpu = 4;
-#elif defined(_WIN32)
-    SYSTEM_INFO sysinfo;
-    GetSystemInfo(&sysinfo);
-    numCpu = sysinfo.dwNumberOfProcessors;
-#endif
-
-    threadPool_ = new ThreadPool(numCpu);
 }
 
 EncoderApp::~EncoderApp()
 {
+    delete scanner_;
+    delete manifest_;
+#ifdef __linux__
+    delete jobServer_;
+#endif
+    delete jobList_;
+    if (results_)
+        fclose(results_);
     delete threadPool_;
-    std::list<EncodingTask*>::iterator it;
-    for (it = tasks_.begin(); it != tasks_.end(); ++it) {
-        EncodingTask *t = *it;
-        delete t;
+    delete ordering_;
+    for (size_t i = 0; i < segmentTasks_.size(); i++) {
+        activeTasks_.erase(segmentTasks_[i]);
+        delete segmentTasks_[i];
     }
+    std::set<EncodingTask*>::iterator it;
+    for (it = activeTasks_.begin(); it != activeTasks_.end(); ++it)
+        delete *it;
+    std::map<PendingKey, EncodingTask*>::iterator pit;
+    for (pit = pendingTasks_.begin(); pit != pendingTasks_.end(); ++pit)
+        delete pit->second;
 }
 
 int EncoderApp::exec()
@@ -67,6 +105,35 @@ int EncoderApp::exec()
     if (!needLoop)
         return r;
 
+    // Workers are created when the options are known:
+    if (threadsCount_) {
+        GMP3ENC_LOGGER_INFO("Using %zu worker threads (-j)", threadsCount_);
+    } else {
+        CpuCount::Source source;
+        std::string description;
+        threadsCount_ = CpuCount::detect(source, description);
+        GMP3ENC_LOGGER_INFO("Using %zu worker threads (%s)", threadsCount_, description.c_str());
+    }
+    threadPool_ = new ThreadPool(threadsCount_);
+    if (placementPolicy_ != CpuPlacement::PolicyNone) {
+        const char *name = CpuPlacement::policyName(placementPolicy_);
+        if (threadPool_->setPlacement(placementPolicy_)) {
+            GMP3ENC_LOGGER_INFO(
+                        "Workers are placed %s on %zu NUMA nodes",
+                        name,
+                        threadPool_->placement().nodesCount());
+        } else {
+            GMP3ENC_LOGGER_ERROR("Placement %s is not supported, workers are not pinned", name);
+        }
+    }
+    if (ioBackend_ != IoBackendSync) {
+        if (threadPool_->setIoBackend(ioBackend_)) {
+            GMP3ENC_LOGGER_INFO("Using %s i/o backend", IoRing::backendName(ioBackend_));
+        } else {
+            GMP3ENC_LOGGER_ERROR("io_uring is not available, using synchronous i/o");
+        }
+    }
+
 #ifdef __linux__
     // We must set up a signal mask before running of
     // worker threads.
@@ -76,11 +143,17 @@ int EncoderApp::exec()
         return -1;
 #endif
 
+    // Unpack kernels are selected once for all workers:
+    PcmUnpack::selectKernels(unpackKernels_);
+    GMP3ENC_LOGGER_DEBUG("PCM unpack kernels: %s", PcmUnpack::kernelSetName());
+
+    threadPool_->setTaskTimeoutMs(taskTimeoutMs_);
     if (!threadPool_->runThreads()) {
         GMP3ENC_LOGGER_ERROR("Thread pool error");
         return -1;
     }
 
+    progress_.start();
     if (!executeTasks()) {
         threadPool_->stopThreads();
         GMP3ENC_LOGGER_ERROR("Nothing to run");
@@ -89,7 +162,34 @@ int EncoderApp::exec()
 
     r = eventLoop();
 
+    if (scanner_)
+        scanner_->stop();
     threadPool_->stopThreads();
+    if (isJobMode()) {
+        GMP3ENC_LOGGER_INFO("Finished %lu jobs, %lu failed", jobsServed_, jobsFailed_);
+    } else {
+        progress_.summary(activeTasks_, tasksSubmitted_, tasksCompleted_, tasksFailed_);
+    }
+    if (results_) {
+        if (fclose(results_) != 0)
+            GMP3ENC_LOGGER_ERROR("Could not write results file: %s", resultsPath_.c_str());
+        results_ = NULL;
+    }
+    if (manifest_) {
+        GMP3ENC_LOGGER_INFO("Skipped %zu up-to-date files", skippedFiles_);
+        manifest_->save();
+    }
+    if (!metricsFile_.empty())
+        dumpMetrics();
+
+    // Interrupted segmented encoding leaves only temporary files:
+    if (!segmentTasks_.empty())
+        finishSegments(false);
+
+    if (scanDirs_ && isScanFinished_ && !tasksSubmitted_ && !skippedFiles_) {
+        GMP3ENC_LOGGER_ERROR("Nothing to run");
+        return -1;
+    }
 
     return r;
 }
@@ -124,52 +224,162 @@ int EncoderApp::eventLoopEpoll()
         return -1;
     }
 
+    // Workers signal the eventfd on every message, so the loop sleeps
+    // until something happens:
+    int msgfd = threadPool_->messagesEventFd();
+    event.events = EPOLLIN;
+    event.data.fd = msgfd;
+    r = epoll_ctl(epollfd, EPOLL_CTL_ADD, msgfd, &event);
+    if (r == -1) {
+        GMP3ENC_LOGGER_ERROR("epoll_ctl failed: %s.", strerror(errno));
+        close(epollfd);
+        close(appsigfd);
+        return -1;
+    }
+
+    // Files are submitted as soon as the directory scanner finds them:
+    int scanfd = scanner_ ? scanner_->eventFd() : -1;
+    if (scanfd != -1) {
+        event.events = EPOLLIN;
+        event.data.fd = scanfd;
+        r = epoll_ctl(epollfd, EPOLL_CTL_ADD, scanfd, &event);
+        if (r == -1) {
+            GMP3ENC_LOGGER_ERROR("epoll_ctl failed: %s.", strerror(errno));
+            close(epollfd);
+            close(appsigfd);
+            return -1;
+        }
+    }
+
+    // Jobs are submitted by clients of the daemon socket:
+    int jobfd = jobServer_ ? jobServer_->eventFd() : -1;
+    if (jobfd != -1) {
+        event.events = EPOLLIN;
+        event.data.fd = jobfd;
+        r = epoll_ctl(epollfd, EPOLL_CTL_ADD, jobfd, &event);
+        if (r == -1) {
+            GMP3ENC_LOGGER_ERROR("epoll_ctl failed: %s.", strerror(errno));
+            close(epollfd);
+            close(appsigfd);
+            return -1;
+        }
+    }
+
+    // Progress and metrics are reported by timers:
+    int progressfd = showProgress_ ? addEpollTimer(epollfd, progressIntervalMs_) : -1;
+    int metricsfd = metricsIntervalMs_ > 0 ? addEpollTimer(epollfd, metricsIntervalMs_) : -1;
+
     while (true) {
         r = epoll_wait(
                     epollfd,
                     events,
                     gmp3enc_epoll_events_size,
-                    inactiveTimeoutMs_);
+                    -1);
 
-        if (r == -1)
+        if (r == -1) {
+            if (errno == EINTR)
+                continue;
             break;
+        }
 
         bool needExit = false;
+        bool hasMessages = false;
         for (int i = 0; i < r; i++) {
-            if (events[i].data.fd = appsigfd) {
-                if (readInterruptionSignal(appsigfd)) {
+            if (events[i].data.fd == appsigfd) {
+                bool needDump = false;
+                readSignals(appsigfd, needExit, needDump);
+                if (needDump)
+                    dumpMetrics();
+                if (needExit) {
                     GMP3ENC_LOGGER_INFO("Received interuption signal. Exiting...");
-                    needExit = true;
                     break;
                 }
+            } else if (events[i].data.fd == msgfd) {
+                hasMessages = true;
+            } else if (events[i].data.fd == scanfd) {
+                processScanEvents();
+                hasMessages = true;
+            } else if (events[i].data.fd == jobfd) {
+                processJobRequests();
+            } else if (events[i].data.fd == progressfd) {
+                uint64_t expirations;
+                if (read(progressfd, &expirations, sizeof(expirations)) > 0)
+                    progress_.report(activeTasks_, inProgressTasks_);
+            } else if (events[i].data.fd == metricsfd) {
+                uint64_t expirations;
+                if (read(metricsfd, &expirations, sizeof(expirations)) > 0)
+                    dumpMetrics();
             }
         }
         if (needExit)
             break;
 
         // Checking queue;
-        if (!processThreadPoolEvents()) {
+        if (hasMessages && !processThreadPoolEvents()) {
             GMP3ENC_LOGGER_INFO("All tasks completed. Exiting...");
             break;
         }
     }
 
+    if (progressfd != -1)
+        close(progressfd);
+    if (metricsfd != -1)
+        close(metricsfd);
     close(epollfd);
     close(appsigfd);
     return 0;
 }
+
+int EncoderApp::addEpollTimer(int epollfd, int intervalMs)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd == -1) {
+        GMP3ENC_LOGGER_ERROR("timerfd_create failed: %s.", strerror(errno));
+        return -1;
+    }
+
+    itimerspec its;
+    its.it_interval.tv_sec = intervalMs / 1000;
+    its.it_interval.tv_nsec = (intervalMs % 1000) * 1000000L;
+    its.it_value = its.it_interval;
+
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (timerfd_settime(fd, 0, &its, NULL) == -1 ||
+        epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        GMP3ENC_LOGGER_ERROR("Failed to set up timer: %s.", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
 #endif
 
 #ifdef _WIN32
 int EncoderApp::eventLoopWinApi()
 {
+    double nextReport = ProgressReporter::now() + progressIntervalMs_ / 1000.0;
+    double nextDump = ProgressReporter::now() + metricsIntervalMs_ / 1000.0;
     while(true) {
         Sleep(inactiveTimeoutMs_);
+        if (scanner_)
+            processScanEvents();
         // Checking queue;
         if (!processThreadPoolEvents()) {
             GMP3ENC_LOGGER_INFO("All tasks completed. Exiting...");
             break;
         }
+
+        if (showProgress_ && ProgressReporter::now() >= nextReport) {
+            progress_.report(activeTasks_, inProgressTasks_);
+            nextReport += progressIntervalMs_ / 1000.0;
+        }
+        if (metricsIntervalMs_ > 0 && ProgressReporter::now() >= nextDump) {
+            dumpMetrics();
+            nextDump += metricsIntervalMs_ / 1000.0;
+        }
     }
 
     return 0;
@@ -192,6 +402,7 @@ bool EncoderApp::setSignalMask()
     sigemptyset(&sigmask_);
     sigaddset(&sigmask_, SIGTERM);
     sigaddset(&sigmask_, SIGINT);
+    sigaddset(&sigmask_, SIGUSR1);
 
     int r = sigprocmask(SIG_BLOCK, &sigmask_, 0);
     if (r == -1) {
@@ -204,106 +415,601 @@ bool EncoderApp::setSignalMask()
 #endif
 
 #ifdef __linux__
-bool EncoderApp::readInterruptionSignal(int fd)
+void EncoderApp::readSignals(int fd, bool &interrupted, bool &dumpMetrics)
 {
     const int signals_max_size = 10;
     static signalfd_siginfo siginfo[signals_max_size];
 
+    interrupted = false;
+    dumpMetrics = false;
+
     int n = read(
                 fd,
                 reinterpret_cast<void*>(siginfo),
                 sizeof(signalfd_siginfo) * signals_max_size);
 
     if (n != -1) {
-        int  recvsig = n / sizeof(signals_max_size);
+        int recvsig = n / sizeof(signalfd_siginfo);
         for (int i =0; i < recvsig; i++) {
             if ((siginfo[i].ssi_signo == SIGINT) || (siginfo[i].ssi_signo == SIGTERM))
-                return true;
+                interrupted = true;
+            else if (siginfo[i].ssi_signo == SIGUSR1)
+                dumpMetrics = true;
         }
     }
-
-    return false;
 }
 #endif
 
-bool EncoderApp::processThreadPoolEvents()
+void EncoderApp::dumpMetrics()
 {
-    std::list<EncodingTask*> startedTasks;
-    std::list<EncodingTask*> finishedTasks;
+    const MetricsRegistry &metrics = threadPool_->metrics();
+    std::string text = metricsJson_ ? metrics.json() : metrics.prometheusText();
 
-    threadPool_->readThreadMessages(startedTasks, finishedTasks);
+    if (metricsFile_.empty()) {
+        fputs(text.c_str(), stderr);
+        return;
+    }
 
-    std::list<EncodingTask*>::iterator it;
+    // Readers never see a partially written file:
+    std::string tmp = metricsFile_ + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (!f) {
+        GMP3ENC_LOGGER_ERROR("Could not open metrics file: %s", tmp.c_str());
+        return;
+    }
+    bool isok = fputs(text.c_str(), f) >= 0;
+    if (fclose(f) != 0)
+        isok = false;
+    if (!isok || rename(tmp.c_str(), metricsFile_.c_str()) != 0) {
+        GMP3ENC_LOGGER_ERROR("Could not write metrics file: %s", metricsFile_.c_str());
+        remove(tmp.c_str());
+    }
+}
 
-    for (it = finishedTasks.begin(); it != finishedTasks.end(); ++it) {
-        std::list<EncodingTask*>::iterator eit = std::find(
-                    inProgressTasks_.begin(),
-                    inProgressTasks_.end(),
-                    *it);
-        if (eit != inProgressTasks_.end())
-            inProgressTasks_.erase(eit);
+bool EncoderApp::processThreadPoolEvents()
+{
+    threadPool_->readThreadMessages(startedTasks_, finishedTasks_);
+
+    // Started messages of a batch are sent before the finished ones,
+    // finished tasks are deleted below:
+    std::vector<EncodingTask*>::iterator it;
+    for (it = startedTasks_.begin(); it != startedTasks_.end(); ++it) {
+        if (!(*it)->segment().isSegment())
+            GMP3ENC_LOGGER_INFO("Started %s", taskName(*it).c_str());
+        EncodingTask *t = *it;
+        inProgressTasks_.insert(t);
+        progress_.taskStarted(t);
+    }
 
-        if ((*it)->result() == EncodingTask::EncodingSuccess) {
-            GMP3ENC_LOGGER_INFO("Completed %s", (*it)->sourceFilePath().c_str());
+    for (it = finishedTasks_.begin(); it != finishedTasks_.end(); ++it) {
+        inProgressTasks_.erase(*it);
+
+        // Canceled task doesn't leave a truncated mp3, the file is
+        // already closed when the result is received:
+        if ((*it)->result() == EncodingTask::EncodingCanceled &&
+            !(*it)->segment().isSegment() &&
+            (*it)->mp3Destination() != "-")
+            remove((*it)->mp3Destination().c_str());
+
+        if ((*it)->segment().isSegment()) {
+            if ((*it)->result() == EncodingTask::EncodingSuccess) {
+                GMP3ENC_LOGGER_INFO(
+                            "Completed segment %d/%d of %s",
+                            (*it)->segment().index + 1,
+                            (*it)->segment().count,
+                            (*it)->sourceFilePath().c_str());
+            } else {
+                GMP3ENC_LOGGER_INFO(
+                            "Error during encoding segment %d of %s. Error: %s",
+                            (*it)->segment().index + 1,
+                            (*it)->sourceFilePath().c_str(),
+                            (*it)->errorStr().c_str());
+            }
+        } else if ((*it)->result() == EncodingTask::EncodingSuccess) {
+            GMP3ENC_LOGGER_INFO("Completed %s", taskName(*it).c_str());
         } else {
             GMP3ENC_LOGGER_INFO(
                         "Error during encoding %s. Error: %s",
-                        (*it)->sourceFilePath().c_str(),
+                        taskName(*it).c_str(),
                         (*it)->errorStr().c_str());
         }
 
         EncodingTask *t = *it;
-        completedTasks_.push_back(t);
+        tasksCompleted_++;
+        if (t->result() != EncodingTask::EncodingSuccess)
+            tasksFailed_++;
+        if (isJobMode()) {
+            finishJob(t);
+            continue;
+        }
+        if (manifest_)
+            updateManifest(t);
+        retireTask(t);
     }
 
-    for (it = startedTasks.begin(); it != startedTasks.end(); ++it) {
-        std::list<EncodingTask*>::iterator eit = std::find(
-                    finishedTasks.begin(),
-                    finishedTasks.end(),
-                    *it);
-        if (eit != finishedTasks.end())
-            continue;
+    // Results of the scanner wait while enough tasks are pending:
+    if (scanner_ && !isScanFinished_ && pendingTasks_.size() < MAX_PENDING_TASKS / 2)
+        processScanEvents();
 
-        GMP3ENC_LOGGER_INFO("Started %s", (*it)->sourceFilePath().c_str());
-        EncodingTask *t = *it;
-        inProgressTasks_.push_back(t);
-    }
+    dispatchPending();
+    if (jobList_)
+        readJobList();
+
+#ifdef __linux__
+    // Daemon runs until it is interrupted:
+    if (jobServer_)
+        return true;
+#endif
+    if (jobList_)
+        return !isJobListFinished_ || !activeTasks_.empty();
+    if (tasksCompleted_ < tasksSubmitted_)
+        return true;
+    if (scanner_ && (!isScanFinished_ || !pendingTasks_.empty()))
+        return true;
+
+    if (!segmentTasks_.empty())
+        finishSegments(true);
 
-    return completedTasks_.size() < tasks_.size();
+    return false;
 }
 
 bool EncoderApp::executeTasks()
 {
+#ifdef __linux__
+    if (!daemonSocket_.empty()) {
+        jobServer_ = new JobServer();
+        if (!jobServer_->listen(daemonSocket_))
+            return false;
+        GMP3ENC_LOGGER_INFO("Waiting for jobs on %s", daemonSocket_.c_str());
+        return true;
+    }
+#endif
+
+    if (!jobListPath_.empty()) {
+        jobList_ = new JobListReader();
+        if (!jobList_->open(jobListPath_))
+            return false;
+        if (!resultsPath_.empty()) {
+            results_ = fopen(resultsPath_.c_str(), "w");
+            if (!results_) {
+                GMP3ENC_LOGGER_ERROR("Could not open results file: %s", resultsPath_.c_str());
+                return false;
+            }
+        }
+        readJobList();
+        return !activeTasks_.empty();
+    }
+
     if (!scanDirs_) {
-        RiffWave wave(inf_);
-        if (wave.isValid()) {
+        RiffWave wave;
+        if (inf_ == "-") {
+#ifdef _WIN32
+            _setmode(_fileno(stdin), _O_BINARY);
+#endif
+            wave.readWaveStream(stdin, "<stdin>");
+        } else {
+            wave.readWave(inf_);
+            wave.setReaderType(readerType_);
+        }
+
+        // Segments are joined in the destination file, standard output
+        // and input stream are encoded as a whole:
+        bool canSplit = splitSegments_ && !wave.isStream() && outf_ != "-";
+        if (wave.isValid() && canSplit && executeSegmentedTask(wave)) {
+            GMP3ENC_LOGGER_INFO(
+                        "Encoding %s in %zu segments",
+                        inf_.c_str(),
+                        segmentTasks_.size());
+        } else if (wave.isValid() && outputsCount() > 1) {
+            executeSharedTasks(wave);
+            GMP3ENC_LOGGER_INFO(
+                        "Encoding %s into %zu outputs",
+                        inf_.c_str(),
+                        tasksSubmitted_);
+        } else if (wave.isValid()) {
             EncodingTask *task = EncodingTask::create(wave, outf_, 0);
-            threadPool_->executeAsyncTask(task);
-            tasks_.push_back(task);
+            task->setProfile(profile_);
+            submitTask(task);
         } else {
             GMP3ENC_LOGGER_INFO("Not a valid riff wave file: %s", inf_.c_str());
         }
 
     } else {
-        std::list<std::string> wavFiles;
-        std::list<std::string>::iterator it;
-
-        listDirectory(inf_, wavFiles);
-
-        for (it = wavFiles.begin(); it != wavFiles.end(); ++it) {
-            RiffWave wave(*it);
-            if (wave.isValid()) {
-                std::string outFileName = generateOutFileName(*it);
-                EncodingTask *task = EncodingTask::create(wave, outFileName, 0);
-                threadPool_->executeAsyncTask(task);
-                tasks_.push_back(task);
+        int details = ordering_->usesWorkload() ? DirectoryScanner::ScanSize : 0;
+        if (!manifestPath_.empty()) {
+            manifest_ = new Manifest();
+            if (!manifest_->load(manifestPath_))
+                return false;
+            GMP3ENC_LOGGER_DEBUG("Manifest %s: %zu records", manifestPath_.c_str(), manifest_->size());
+            details |= DirectoryScanner::ScanFileInfo;
+            if (manifestHash_)
+                details |= DirectoryScanner::ScanContentHash;
+        }
+
+        // Tasks are submitted by the event loop while the tree
+        // is being scanned:
+        scanner_ = new DirectoryScanner(scanThreads_, maxDepth_, details);
+        return scanner_->start(inf_);
+    }
+
+    return tasksSubmitted_ > 0;
+}
+
+void EncoderApp::processScanEvents()
+{
+    // Unread results keep scanner threads waiting, they are read
+    // when workers take pending tasks:
+    size_t maxFiles = pendingTasks_.size() < MAX_PENDING_TASKS ?
+                MAX_PENDING_TASKS - pendingTasks_.size() : 0;
+    std::list<ScannedFile> files;
+    bool isFinished = false;
+    scanner_->readResults(files, isFinished, maxFiles);
+    if (isFinished)
+        isScanFinished_ = true;
+
+    // Headers are parsed by workers, invalid files are reported
+    // as failed tasks:
+    size_t outputs = outputsCount();
+    std::vector<uint64_t> settingsHashes(outputs);
+    for (size_t i = 0; i < outputs; i++)
+        settingsHashes[i] = Manifest::hash(outputProfile(i).settingsId());
+
+    std::list<ScannedFile>::iterator it;
+    for (it = files.begin(); it != files.end(); ++it) {
+        std::string mp3Name = generateOutFileName(it->relativePath);
+
+        // Outputs which have to be encoded:
+        std::vector<size_t> indexes;
+        std::vector<ManifestRecord> records;
+        for (size_t i = 0; i < outputs; i++) {
+            std::string outFileName = outputFileName(mp3Name, i);
+            ManifestRecord record;
+            if (manifest_) {
+                std::string key = it->relativePath;
+                if (!bitrates_.empty()) {
+                    char suffix[16];
+                    snprintf(suffix, sizeof(suffix), "@%d", bitrates_[i]);
+                    key += suffix;
+                }
+                record.pathHash = Manifest::hash(key);
+                record.outputHash = Manifest::hash(outFileName);
+                record.settingsHash = settingsHashes[i];
+                record.contentHash = it->contentHash;
+                record.sourceSize = it->size;
+                record.sourceMtimeNs = it->mtimeNs;
+                record.sourceInode = it->inode;
+                record.outputSize = -1;
+                if (isUpToDate(record, outFileName)) {
+                    GMP3ENC_LOGGER_DEBUG("Up to date: %s", outFileName.c_str());
+                    skippedFiles_++;
+                    continue;
+                }
+            }
+            indexes.push_back(i);
+            records.push_back(record);
+        }
+
+        if (indexes.empty() || !makeOutputDirs(it->relativePath))
+            continue;
+
+        // Several outputs read and unpack the source once:
+        SharedPcmSource *source = NULL;
+        if (indexes.size() > 1)
+            source = SharedPcmSource::createDeferred(it->path, readerType_, indexes.size());
+
+        for (size_t i = 0; i < indexes.size(); i++) {
+            std::string outFileName = outputFileName(mp3Name, indexes[i]);
+            EncodingTask *task;
+            if (source) {
+                task = EncodingTask::createShared(source, it->size, outFileName, 0);
             } else {
-                GMP3ENC_LOGGER_INFO("Not a valid riff wave file: %s", (*it).c_str());
+                task = EncodingTask::createDeferred(
+                            it->path,
+                            it->size,
+                            readerType_,
+                            outFileName,
+                            0);
             }
+            task->setProfile(outputProfile(indexes[i]));
+            if (manifest_)
+                manifestRecords_[task] = records[i];
+            PendingKey key(ordering_->key(task), pendingSeq_++);
+            pendingTasks_.insert(std::make_pair(key, task));
+        }
+
+        if (source)
+            source->release();
+    }
+
+    dispatchPending();
+}
+
+#ifdef __linux__
+void EncoderApp::processJobRequests()
+{
+    std::list<JobRequest> requests;
+    jobServer_->processEvents(requests);
+
+    std::list<JobRequest>::iterator it;
+    for (it = requests.begin(); it != requests.end(); ++it) {
+        if (it->isCancel) {
+            cancelJob(*it);
+            continue;
+        }
+        std::string error;
+        if (!submitJob(*it, error))
+            reportJob(*it, error);
+    }
+}
+
+void EncoderApp::cancelJob(const JobRequest &request)
+{
+    // Only jobs of the same client can be canceled:
+    std::map<std::pair<unsigned long, std::string>, EncodingTask*>::iterator it =
+            jobIds_.find(std::make_pair(request.clientId, request.jobId));
+    if (it == jobIds_.end()) {
+        jobServer_->reply(request.clientId, "error\t" + request.jobId + "\tunknown job");
+        return;
+    }
+    it->second->cancel();
+    jobServer_->reply(request.clientId, "canceled\t" + request.jobId);
+}
+#endif
+
+void EncoderApp::readJobList()
+{
+    // Only a couple of jobs per worker are queued, the rest of the list
+    // is read as they complete:
+    size_t window = 2 * threadPool_->threadsCount();
+    while (!isJobListFinished_ && activeTasks_.size() - inProgressTasks_.size() < window) {
+        JobRequest request;
+        std::string error;
+        if (!jobList_->next(request, error)) {
+            isJobListFinished_ = true;
+            break;
+        }
+        if (!error.empty() || !submitJob(request, error)) {
+            GMP3ENC_LOGGER_INFO("Job at line %s failed: %s", request.jobId.c_str(), error.c_str());
+            reportJob(request, error);
+        }
+    }
+}
+
+bool EncoderApp::submitJob(const JobRequest &request, std::string &error)
+{
+    EncodingProfile profile = profile_;
+    if (!request.profile.empty() && !EncodingProfile::find(request.profile, profile)) {
+        error = "unknown profile";
+        return false;
+    }
+    profile.replayGain = profile_.replayGain;
+
+    // Headers are parsed by workers like in directory mode:
+    EncodingTask *task = EncodingTask::createDeferred(
+                request.input,
+                -1,
+                readerType_,
+                request.output,
+                0);
+    task->setProfile(profile);
+    if (request.timeoutMs > 0)
+        task->setDeadlineUs(MetricsRegistry::nowUs() + request.timeoutMs * 1000LL);
+    if (!submitTask(task)) {
+        delete task;
+        error = "not accepted";
+        return false;
+    }
+    jobs_[task] = request;
+    jobIds_.insert(std::make_pair(std::make_pair(request.clientId, request.jobId), task));
+    return true;
+}
+
+void EncoderApp::finishJob(EncodingTask *task)
+{
+    std::map<EncodingTask*, JobRequest>::iterator it = jobs_.find(task);
+    if (it != jobs_.end()) {
+        bool isok = task->result() == EncodingTask::EncodingSuccess;
+        reportJob(it->second, isok ? std::string() : task->errorStr());
+        std::map<std::pair<unsigned long, std::string>, EncodingTask*>::iterator iit =
+                jobIds_.find(std::make_pair(it->second.clientId, it->second.jobId));
+        if (iit != jobIds_.end() && iit->second == task)
+            jobIds_.erase(iit);
+        jobs_.erase(it);
+    }
+
+    retireTask(task);
+}
+
+void EncoderApp::reportJob(const JobRequest &request, const std::string &error)
+{
+    jobsServed_++;
+    if (!error.empty())
+        jobsFailed_++;
+
+    // Daemon clients and the results file get the same lines:
+    std::string line = error.empty() ?
+                "ok\t" + request.jobId :
+                "error\t" + request.jobId + "\t" + error;
+#ifdef __linux__
+    if (request.clientId) {
+        jobServer_->reply(request.clientId, line);
+        return;
+    }
+#endif
+    if (results_)
+        fprintf(results_, "%s\n", line.c_str());
+}
+
+bool EncoderApp::isJobMode() const
+{
+#ifdef __linux__
+    if (jobServer_)
+        return true;
+#endif
+    return jobList_ != NULL;
+}
+
+bool EncoderApp::isUpToDate(const ManifestRecord &record, const std::string &outFileName)
+{
+    const ManifestRecord *r = manifest_->find(record.pathHash);
+    if (!r || record.sourceSize < 0)
+        return false;
+
+    if (r->outputHash != record.outputHash ||
+        r->settingsHash != record.settingsHash ||
+        r->sourceSize != record.sourceSize ||
+        r->sourceMtimeNs != record.sourceMtimeNs ||
+        r->sourceInode != record.sourceInode)
+        return false;
+    if (record.contentHash && r->contentHash != record.contentHash)
+        return false;
+
+    // Output could be removed or truncated since the last run:
+    struct stat statbuf;
+    if (stat(outFileName.c_str(), &statbuf) != 0)
+        return false;
+    return statbuf.st_size == r->outputSize;
+}
+
+void EncoderApp::updateManifest(EncodingTask *task)
+{
+    std::map<EncodingTask*, ManifestRecord>::iterator it = manifestRecords_.find(task);
+    if (it == manifestRecords_.end())
+        return;
+
+    ManifestRecord &record = it->second;
+    struct stat statbuf;
+    if (task->result() == EncodingTask::EncodingSuccess &&
+        stat(task->mp3Destination().c_str(), &statbuf) == 0) {
+        record.outputSize = statbuf.st_size;
+        manifest_->update(record);
+    } else {
+        manifest_->remove(record.pathHash);
+    }
+    manifestRecords_.erase(it);
+}
+
+void EncoderApp::dispatchPending()
+{
+    // Only a couple of tasks per worker are queued, the rest are kept
+    // pending, so a large file found late still overtakes small ones:
+    size_t window = 2 * threadPool_->threadsCount();
+    size_t queued = activeTasks_.size() - inProgressTasks_.size();
+    while (!pendingTasks_.empty() && queued < window) {
+        EncodingTask *task = pendingTasks_.begin()->second;
+        pendingTasks_.erase(pendingTasks_.begin());
+        submitTask(task);
+        queued++;
+    }
+}
+
+bool EncoderApp::submitTask(EncodingTask *task)
+{
+    if (!threadPool_->executeAsyncTask(task))
+        return false;
+    activeTasks_.insert(task);
+    tasksSubmitted_++;
+    return true;
+}
+
+void EncoderApp::retireTask(EncodingTask *task)
+{
+    progress_.taskFinished(task);
+    activeTasks_.erase(task);
+
+    // Segments are deleted after they are joined:
+    if (!task->segment().isSegment())
+        delete task;
+}
+
+bool EncoderApp::executeSegmentedTask(const RiffWave &wave)
+{
+    std::vector<EncodingSegment> segments;
+    if (!Mp3SegmentFilter::planSegments(wave, threadPool_->threadsCount(), segments))
+        return false;
+
+    // Joined stream has no Info tag, so its duration and seek points
+    // are known to players only for CBR:
+    EncodingProfile profile = profile_;
+    if (profile.mode == EncodingProfile::ModeVbr)
+        profile = profile.withBitrate(profile.nominalBitrate);
+
+    // The first segment is written directly into the destination,
+    // rest of them are appended after all segments are encoded.
+    for (size_t i = 0; i < segments.size(); i++) {
+        std::string dest = i ? Mp3SegmentFilter::segmentFileName(outf_, i) : outf_;
+        EncodingTask *task = EncodingTask::createSegment(wave, dest, i, segments[i]);
+        if (!task) {
+            for (size_t j = 0; j < segmentTasks_.size(); j++)
+                delete segmentTasks_[j];
+            segmentTasks_.clear();
+            return false;
         }
+        task->setProfile(profile);
+        segmentTasks_.push_back(task);
     }
 
-    return !tasks_.empty();
+    for (size_t i = 0; i < segmentTasks_.size(); i++)
+        submitTask(segmentTasks_[i]);
+
+    return true;
+}
+
+void EncoderApp::executeSharedTasks(const RiffWave &wave)
+{
+    SharedPcmSource *source = SharedPcmSource::create(wave, outputsCount());
+    if (!source)
+        return;
+
+    for (size_t i = 0; i < outputsCount(); i++) {
+        EncodingTask *task = EncodingTask::createShared(source, -1, outputFileName(outf_, i), i);
+        task->setProfile(outputProfile(i));
+        submitTask(task);
+    }
+
+    source->release();
+}
+
+void EncoderApp::finishSegments(bool join)
+{
+    for (size_t i = 0; i < segmentTasks_.size(); i++) {
+        if (segmentTasks_[i]->result() != EncodingTask::EncodingSuccess)
+            join = false;
+    }
+
+    FILE *outf = NULL;
+    if (join) {
+        outf = fopen(outf_.c_str(), "ab");
+        if (!outf) {
+            GMP3ENC_LOGGER_ERROR("Could not open destination file: %s", outf_.c_str());
+            join = false;
+        }
+    }
+
+    for (size_t i = 1; i < segmentTasks_.size(); i++) {
+        std::string part = segmentTasks_[i]->mp3Destination();
+        if (join && !Mp3SegmentFilter::appendSegmentFile(outf, part)) {
+            GMP3ENC_LOGGER_ERROR("Failed to join segment: %s", part.c_str());
+            join = false;
+        }
+        remove(part.c_str());
+    }
+
+    if (outf)
+        fclose(outf);
+
+    for (size_t i = 0; i < segmentTasks_.size(); i++) {
+        activeTasks_.erase(segmentTasks_[i]);
+        delete segmentTasks_[i];
+    }
+
+    if (join) {
+        GMP3ENC_LOGGER_INFO("Completed %s", inf_.c_str());
+    } else {
+        GMP3ENC_LOGGER_INFO("Segmented encoding of %s failed", inf_.c_str());
+    }
+
+    segmentTasks_.clear();
 }
 
 void EncoderApp::showVersion()
@@ -321,9 +1027,61 @@ void EncoderApp::showUsage()
            "Required:\n"
            "\t-i --in: Path to input wav file or directory with wav files (for directory mode).\n"
            "\t-o --out: Path for generated mp3 file or path to directory (for directory mode).\n"
+           "\t\t'-' for <input> or <output> reads wave from stdin or writes mp3 to stdout.\n"
            "Optional:\n"
            "\t-d --directories: Directory mode. Process all wav files in a directory <input> and\n"
            "\t\tsave generated mp3 into files in <output> directory.\n"
+           "\t-s --segments: Split single input file into segments, encode them in\n"
+           "\t\tparallel and join into one mp3 stream. VBR profiles are encoded as CBR\n"
+           "\t\tat their nominal bitrate.\n"
+           "\t--profile <name>: Encoding profile: fast-cbr (CBR 128 kbps, fast search),\n"
+           "\t\tstandard-vbr (default, VBR -V2) or archival (CBR 320 kbps, best quality).\n"
+           "\t--replaygain: Run ReplayGain analysis and store the result in the Info tag.\n"
+           "\t\tNot available for standard output and segments, they have no Info tag.\n"
+           "\t-b --bitrates <list>: Encode every source into several CBR outputs, e.g. 128,192,320\n"
+           "\t\t(kbps). The source is read once for all of them, outputs are named\n"
+           "\t\t<name>-<kbps>k.mp3 (a single file output keeps the -o name). Algorithm\n"
+           "\t\tquality is taken from the profile.\n"
+           "\t-j --threads <n>: Number of worker threads. By default it is the number of CPUs\n"
+           "\t\tavailable to the process: online CPUs limited by the affinity mask and\n"
+           "\t\tthe cgroup CPU quota.\n"
+           "\t--placement <policy>: Pin workers to CPUs: none (default), compact - fill NUMA\n"
+           "\t\tnodes one by one, scatter - spread over nodes, nodes - per-node pools\n"
+           "\t\tfloating over CPUs of their node. Workers allocate memory on own node.\n"
+           "\t-r --reader <type>: Wave data reader: mmap (default), mmap-huge (mmap with\n"
+           "\t\thuge pages hint) or stdio.\n"
+           "\t--io <backend>: I/O backend: sync (default) or uring - every worker keeps\n"
+           "\t\tlarge reads in flight ahead of the encoder and output writes are batched\n"
+           "\t\tthrough io_uring. Falls back to sync on kernels without io_uring.\n"
+           "\t--unpack <kernels>: Most advanced PCM unpack kernels to be used: avx2 (default),\n"
+           "\t\tsse2 or scalar. Kernels are selected according to CPU features.\n"
+           "\t-p --progress: Periodically report per-file and overall progress, realtime\n"
+           "\t\tfactor, MB/s and ETA.\n"
+           "\t--progress-interval <ms>: Progress report interval (default 1000).\n"
+           "\t--metrics-format <format>: Format of runtime metrics: prometheus (default)\n"
+           "\t\tor json. On Linux metrics are dumped on SIGUSR1.\n"
+           "\t--metrics-file <path>: Write metrics into the file instead of stderr.\n"
+           "\t--metrics-interval <ms>: Also write metrics into the file periodically.\n"
+           "\t--order <policy>: Order of files in directory mode: lpt - largest first\n"
+           "\t\t(default), spt - smallest first, fifo - as found in directory.\n"
+           "\t--max-depth <n>: Directory mode recursion depth, 0 - only <input> directory\n"
+           "\t\t(default is unlimited). Subdirectories are mirrored in <output>.\n"
+           "\t--scan-threads <n>: Threads scanning subdirectories in parallel (default 1).\n"
+           "\t--manifest <path>: Directory mode manifest. Files whose sources, settings and\n"
+           "\t\toutputs did not change since the previous run are skipped.\n"
+           "\t--manifest-hash: Also compare hashes of the first and last 64 KB of sources.\n"
+           "\t--timeout <ms>: Cancel tasks which are not done in time since they were queued,\n"
+           "\t\ttheir outputs are removed.\n"
+           "\t--jobs <file>: Encode jobs listed in the file, one per line:\n"
+           "\t\tinput<TAB>output[<TAB>profile[<TAB>timeout-ms]]. The list is read as workers\n"
+           "\t\ttake the jobs.\n"
+           "\t--results <file>: Write ok<TAB>line or error<TAB>line<TAB>message for every job.\n"
+#ifdef __linux__
+           "\t--daemon <socket>: Keep worker threads running and encode jobs submitted to\n"
+           "\t\tthe Unix socket, one per line: encode<TAB>id<TAB>input<TAB>output[<TAB>profile\n"
+           "\t\t[<TAB>timeout-ms]]. Replies ok<TAB>id or error<TAB>id<TAB>message are sent\n"
+           "\t\twhen jobs are done. cancel<TAB>id stops the job.\n"
+#endif
            "Help:\n"
            "\t-v: show version\n"
            "\t-h --help: show this message\n");
@@ -369,78 +1127,359 @@ int EncoderApp::parseCmdOpt(bool &needLoop)
             inf_ = *it;
         } else if (arg == "d" || arg == "directories") {
             scanDirs_ = true;
+        } else if (arg == "s" || arg == "segments") {
+            splitSegments_ = true;
+        } else if (arg == "r" || arg == "reader") {
+            ++it;
+            if (it == cmdOpts_.end())
+                break;
+            if (!parseReaderType(*it)) {
+                showUsage();
+                return -1;
+            }
+        } else if (arg == "io") {
+            ++it;
+            if (it == cmdOpts_.end())
+                break;
+            if (!parseIoBackend(*it)) {
+                showUsage();
+                return -1;
+            }
+        } else if (arg == "j" || arg == "threads") {
+            ++it;
+            if (it == cmdOpts_.end())
+                break;
+            int n = atoi((*it).c_str());
+            if (n <= 0) {
+                showUsage();
+                return -1;
+            }
+            threadsCount_ = n;
+        } else if (arg == "placement") {
+            ++it;
+            if (it == cmdOpts_.end())
+                break;
+            if (!CpuPlacement::parsePolicy(*it, placementPolicy_)) {
+                showUsage();
+                return -1;
+            }
+        } else if (arg == "p" || arg == "progress") {
+            showProgress_ = true;
+        } else if (arg == "progress-interval") {
+            ++it;
+            if (it == cmdOpts_.end())
+                break;
+            progressIntervalMs_ = atoi((*it).c_str());
+            if (progressIntervalMs_ <= 0) {
+                showUsage();
+                return -1;
+            }
+            showProgress_ = true;
+        } else if (arg == "metrics-format") {
+            ++it;
+            if (it == cmdOpts_.end())
+                break;
+            if (*it == "json") {
+                metricsJson_ = true;
+            } else if (*it == "prometheus") {
+                metricsJson_ = false;
+            } else {
+                showUsage();
+                return -1;
+            }
+        } else if (arg == "metrics-file") {
+            ++it;
+            if (it == cmdOpts_.end())
+                break;
+            metricsFile_ = *it;
+        } else if (arg == "metrics-interval") {
+            ++it;
+            if (it == cmdOpts_.end())
+                break;
+            metricsIntervalMs_ = atoi((*it).c_str());
+            if (metricsIntervalMs_ <= 0) {
+                showUsage();
+                return -1;
+            }
+        } else if (arg == "order") {
+            ++it;
+            if (it == cmdOpts_.end())
+                break;
+            TaskOrderingPolicy *ordering = TaskOrderingPolicy::create(*it);
+            if (!ordering) {
+                showUsage();
+                return -1;
+            }
+            delete ordering_;
+            ordering_ = ordering;
+        } else if (arg == "max-depth") {
+            ++it;
+            if (it == cmdOpts_.end())
+                break;
+            maxDepth_ = atoi((*it).c_str());
+        } else if (arg == "scan-threads") {
+            ++it;
+            if (it == cmdOpts_.end())
+                break;
+            int n = atoi((*it).c_str());
+            if (n <= 0) {
+                showUsage();
+                return -1;
+            }
+            scanThreads_ = n;
+        } else if (arg == "profile") {
+            ++it;
+            if (it == cmdOpts_.end())
+                break;
+            bool replayGain = profile_.replayGain;
+            if (!EncodingProfile::find(*it, profile_)) {
+                showUsage();
+                return -1;
+            }
+            profile_.replayGain = replayGain;
+        } else if (arg == "replaygain") {
+            profile_.replayGain = true;
+        } else if (arg == "b" || arg == "bitrates") {
+            ++it;
+            if (it == cmdOpts_.end())
+                break;
+            if (!parseBitrates(*it)) {
+                showUsage();
+                return -1;
+            }
+        } else if (arg == "manifest") {
+            ++it;
+            if (it == cmdOpts_.end())
+                break;
+            manifestPath_ = *it;
+        } else if (arg == "manifest-hash") {
+            manifestHash_ = true;
+        } else if (arg == "timeout") {
+            ++it;
+            if (it == cmdOpts_.end())
+                break;
+            taskTimeoutMs_ = atol((*it).c_str());
+            if (taskTimeoutMs_ <= 0) {
+                showUsage();
+                return -1;
+            }
+        } else if (arg == "jobs") {
+            ++it;
+            if (it == cmdOpts_.end())
+                break;
+            jobListPath_ = *it;
+        } else if (arg == "results") {
+            ++it;
+            if (it == cmdOpts_.end())
+                break;
+            resultsPath_ = *it;
+#ifdef __linux__
+        } else if (arg == "daemon") {
+            ++it;
+            if (it == cmdOpts_.end())
+                break;
+            daemonSocket_ = *it;
+#endif
+        } else if (arg == "unpack") {
+            ++it;
+            if (it == cmdOpts_.end())
+                break;
+            if (!parseUnpackKernels(*it)) {
+                showUsage();
+                return -1;
+            }
         }
     }
 
+    // Every job names its input and output:
+    bool hasJobs = !jobListPath_.empty();
+#ifdef __linux__
+    if (!daemonSocket_.empty()) {
+        if (hasJobs) {
+            showUsage();
+            return -1;
+        }
+        hasJobs = true;
+    }
+#endif
+    if (!resultsPath_.empty() && jobListPath_.empty()) {
+        showUsage();
+        return -1;
+    }
+    if (hasJobs) {
+        if (!inf_.empty() || !outf_.empty() || scanDirs_ || splitSegments_ ||
+            !bitrates_.empty() || !manifestPath_.empty()) {
+            showUsage();
+            return -1;
+        }
+        if (metricsIntervalMs_ > 0 && metricsFile_.empty()) {
+            showUsage();
+            return -1;
+        }
+        needLoop = true;
+        return 0;
+    }
+
     if (inf_.empty() || outf_.empty()) {
         showUsage();
         return -1;
     }
 
+    // Periodic metrics are written only into a file:
+    if (metricsIntervalMs_ > 0 && metricsFile_.empty()) {
+        showUsage();
+        return -1;
+    }
+
+    // Standard streams can't be used in directory mode:
+    if (scanDirs_ && (inf_ == "-" || outf_ == "-")) {
+        showUsage();
+        return -1;
+    }
+
+    // ReplayGain is stored in the Info tag, which is not written into
+    // the standard output and joined segments:
+    if (profile_.replayGain && (outf_ == "-" || splitSegments_)) {
+        showUsage();
+        return -1;
+    }
+
+    // Every output of a shared source is a separate file, segments
+    // are planned for one output:
+    if (outputsCount() > 1 && (inf_ == "-" || outf_ == "-" || splitSegments_)) {
+        showUsage();
+        return -1;
+    }
+
+    // Single output is encoded as usual, even in segments. Its name
+    // is given explicitly by -o, so "-" stays the standard output:
+    if (!scanDirs_ && bitrates_.size() == 1) {
+        profile_ = outputProfile(0);
+        bitrates_.clear();
+    }
+
     needLoop = true;
     return 0;
 }
 
-void EncoderApp::listDirectory(std::string &dir, std::list<std::string> &wavFiles)
+bool EncoderApp::parseReaderType(const std::string &name)
 {
-#ifdef __linux__
-    struct stat statbuf;
-    std::string sep = dir[dir.length() - 1] == '/' ? "" : "/";
-    DIR *dp = opendir(dir.c_str());
-    if (!dp) {
-        GMP3ENC_LOGGER_ERROR("Could not open dir: %s", dir.c_str());
-        return;
-    }
-    dirent *dirp;
-    while ((dirp = readdir(dp)) != NULL) {
-        if (strcmp(dirp->d_name, ".") == 0 ||
-            strcmp(dirp->d_name, "..") == 0)
-            continue;
+    if (name == "stdio")
+        readerType_ = WaveReaderStdio;
+    else if (name == "mmap")
+        readerType_ = WaveReaderMmap;
+    else if (name == "mmap-huge")
+        readerType_ = WaveReaderMmapHugePages;
+    else
+        return false;
+    return true;
+}
 
-        std::string item = dir + sep + std::string(dirp->d_name);
-        if (lstat(item.c_str(), &statbuf) < 0) {
-            GMP3ENC_LOGGER_ERROR("Could not lstat file: %s", item.c_str());
-            continue;
-        }
+bool EncoderApp::parseIoBackend(const std::string &name)
+{
+    if (name == "sync")
+        ioBackend_ = IoBackendSync;
+    else if (name == "uring")
+        ioBackend_ = IoBackendUring;
+    else
+        return false;
+    return true;
+}
 
-        if (S_ISDIR(statbuf.st_mode))
-            continue;
+bool EncoderApp::parseBitrates(const std::string &list)
+{
+    bitrates_.clear();
+    std::size_t pos = 0;
+    while (pos <= list.length()) {
+        std::size_t end = list.find(',', pos);
+        if (end == std::string::npos)
+            end = list.length();
+        int kbps = atoi(list.substr(pos, end - pos).c_str());
+        if (kbps < 8 || kbps > 320)
+            return false;
+        if (std::find(bitrates_.begin(), bitrates_.end(), kbps) == bitrates_.end())
+            bitrates_.push_back(kbps);
+        pos = end + 1;
+    }
+    return !bitrates_.empty();
+}
 
-        std::size_t pos = item.find(".wav");
-        if (pos != (item.length() - 4))
+bool EncoderApp::parseUnpackKernels(const std::string &name)
+{
+    if (name == "scalar")
+        unpackKernels_ = PcmUnpack::KernelScalar;
+    else if (name == "sse2")
+        unpackKernels_ = PcmUnpack::KernelSse2;
+    else if (name == "avx2")
+        unpackKernels_ = PcmUnpack::KernelAvx2;
+    else
+        return false;
+    return true;
+}
+
+bool EncoderApp::makeOutputDirs(const std::string &relativePath)
+{
+    std::string sep = outf_[outf_.length() - 1] == '/' ? "" : "/";
+    std::size_t pos = 0;
+    while ((pos = relativePath.find('/', pos)) != std::string::npos) {
+        std::string dir = outf_ + sep + relativePath.substr(0, pos);
+        pos++;
+        if (createdDirs_.count(dir))
             continue;
 
-        wavFiles.push_back(item);
-    }
+#ifdef __linux__
+        int r = mkdir(dir.c_str(), 0755);
 #elif defined(_WIN32)
-    HANDLE hFind;
-    WIN32_FIND_DATA data;
-
-    std::string sep = dir[dir.length() - 1] == '/' ? "" : "/";
-    std::string pat = dir + sep + "*.wav";
-
-    hFind = FindFirstFile(pat.c_str(), &data);
-    if (hFind != INVALID_HANDLE_VALUE) {
-        do {
-            std::string item = dir + sep + std::string(data.cFileName);
-            wavFiles.push_back(item);
-        } while (FindNextFile(hFind, &data));
-        FindClose(hFind);
-    }
+        int r = CreateDirectory(dir.c_str(), NULL) ? 0 : -1;
+        if (r == -1 && GetLastError() == ERROR_ALREADY_EXISTS)
+            errno = EEXIST;
 #endif
+        if (r == -1 && errno != EEXIST) {
+            GMP3ENC_LOGGER_ERROR("Could not create dir: %s", dir.c_str());
+            return false;
+        }
+        createdDirs_.insert(dir);
+    }
+
+    return true;
 }
 
-std::string EncoderApp::generateOutFileName(std::string &inFileName)
+std::string EncoderApp::generateOutFileName(const std::string &relativePath)
 {
     std::string sep = outf_[outf_.length() - 1] == '/' ? "" : "/";
-    std::size_t pos = inFileName.rfind("/");
-    if (pos == std::string::npos)
-        pos = 0;
-    if (inFileName[pos] == '/')
-        pos++;
-    std::string ret = outf_ + sep + inFileName.substr(pos);
+    std::string ret = outf_ + sep + relativePath;
     ret[ret.length() - 3] = 'm';
     ret[ret.length() - 2] = 'p';
     ret[ret.length() - 1] = '3';
     return ret;
 }
+
+size_t EncoderApp::outputsCount() const
+{
+    return bitrates_.empty() ? 1 : bitrates_.size();
+}
+
+EncodingProfile EncoderApp::outputProfile(size_t index) const
+{
+    return bitrates_.empty() ? profile_ : profile_.withBitrate(bitrates_[index]);
+}
+
+std::string EncoderApp::outputFileName(const std::string &mp3Name, size_t index) const
+{
+    if (bitrates_.empty())
+        return mp3Name;
+
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "-%dk", bitrates_[index]);
+    std::size_t len = mp3Name.length();
+    if (len > 4 && mp3Name.compare(len - 4, 4, ".mp3") == 0)
+        return mp3Name.substr(0, len - 4) + suffix + ".mp3";
+    return mp3Name + suffix;
+}
+
+std::string EncoderApp::taskName(EncodingTask *task) const
+{
+    if (bitrates_.empty())
+        return task->sourceFilePath();
+    return task->sourceFilePath() + " -> " + task->mp3Destination();
+}
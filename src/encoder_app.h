@@ -4,7 +4,21 @@
 #ifdef __linux__
 #include <signal.h>
 #endif
+#include <map>
+#include <set>
+#include <utility>
+#include <vector>
+
 #include "thread_pool.h"
+#include "cpu_count.h"
+#include "pcm_unpack.h"
+#include "encoding_profile.h"
+#include "directory_scanner.h"
+#include "manifest.h"
+#include "task_ordering.h"
+#include "progress_reporter.h"
+#include "job_list.h"
+#include "job_server.h"
 
 namespace GMp3Enc {
 
@@ -19,8 +33,9 @@ public:
 private:
 #ifdef __linux__
     bool setSignalMask();
-    bool readInterruptionSignal(int fd);
+    void readSignals(int fd, bool &interrupted, bool &dumpMetrics);
     int eventLoopEpoll();
+    int addEpollTimer(int epollfd, int intervalMs);
 #elif defined(_WIN32)
     int eventLoopWinApi();
 #endif
@@ -28,26 +43,119 @@ private:
     int eventLoop();
 
     bool processThreadPoolEvents();
+    void processScanEvents();
+#ifdef __linux__
+    void processJobRequests();
+    void cancelJob(const JobRequest &request);
+#endif
+    void readJobList();
+    bool submitJob(const JobRequest &request, std::string &error);
+    void finishJob(EncodingTask *task);
+    void reportJob(const JobRequest &request, const std::string &error);
+    bool isJobMode() const;
+    void dispatchPending();
+    bool submitTask(EncodingTask *task);
+    void retireTask(EncodingTask *task);
+    bool isUpToDate(const ManifestRecord &record, const std::string &outFileName);
+    void updateManifest(EncodingTask *task);
+    void dumpMetrics();
     bool executeTasks();
+    bool executeSegmentedTask(const RiffWave &wave);
+    void executeSharedTasks(const RiffWave &wave);
+    bool parseReaderType(const std::string &name);
+    bool parseIoBackend(const std::string &name);
+    bool parseBitrates(const std::string &list);
+    bool parseUnpackKernels(const std::string &name);
+    void finishSegments(bool join);
 
     void showVersion();
     void showUsage();
     std::string getCmdOptName(const std::string &os);
     int parseCmdOpt(bool &needLoop);
-    void listDirectory(std::string &dir, std::list<std::string> &wavFiles);
-    std::string generateOutFileName(std::string &inFileName);
+    bool makeOutputDirs(const std::string &relativePath);
+    std::string generateOutFileName(const std::string &relativePath);
+
+    // Every source is encoded into one output per bitrate, or into one
+    // output with the profile settings if bitrates are not given.
+    size_t outputsCount() const;
+    EncodingProfile outputProfile(size_t index) const;
+    std::string outputFileName(const std::string &mp3Name, size_t index) const;
+    std::string taskName(EncodingTask *task) const;
+
+    ThreadPool *threadPool_;
+    size_t threadsCount_;  // 0 - detected by CpuCount.
+    CpuPlacement::Policy placementPolicy_;
+    int inactiveTimeoutMs_;
+    long taskTimeoutMs_;
 
     std::list<std::string> cmdOpts_;
     std::string inf_;
     std::string outf_;
     bool scanDirs_;
+    bool splitSegments_;
+    WaveReaderType readerType_;
+    IoBackend ioBackend_;
+    PcmUnpack::KernelSet unpackKernels_;
+    TaskOrderingPolicy *ordering_;
+    EncodingProfile profile_;
+    std::vector<int> bitrates_;
+    size_t scanThreads_;
+    int maxDepth_;
+    bool showProgress_;
+    int progressIntervalMs_;
+    ProgressReporter progress_;
+    bool metricsJson_;
+    std::string metricsFile_;
+    int metricsIntervalMs_;
 
-    std::list<EncodingTask*> tasks_;
-    std::list<EncodingTask*> inProgressTasks_;
-    std::list<EncodingTask*> completedTasks_;
+    // Submitted tasks are kept until their results are recorded, then
+    // they are retired, so only the in-flight window is in memory.
+    // Segments are also kept in segmentTasks_ until they are joined.
+    std::set<EncodingTask*> activeTasks_;
+    std::set<EncodingTask*> inProgressTasks_;
+    std::vector<EncodingTask*> startedTasks_;   // Reused by every poll.
+    std::vector<EncodingTask*> finishedTasks_;
+    size_t tasksSubmitted_;
+    size_t tasksCompleted_;
+    size_t tasksFailed_;
+    std::vector<EncodingTask*> segmentTasks_;
+
+    // Directory mode: found files wait here in the policy order until
+    // workers are ready to take them. Scanner results are read only
+    // while there are less than MAX_PENDING_TASKS of them.
+    static const size_t MAX_PENDING_TASKS = 16384;
+    typedef std::pair<long long, unsigned long> PendingKey;
+    DirectoryScanner *scanner_;
+    bool isScanFinished_;
+    std::map<PendingKey, EncodingTask*> pendingTasks_;
+    unsigned long pendingSeq_;
+    std::set<std::string> createdDirs_;
+
+    // Incremental runs: files with unchanged sources and outputs are
+    // skipped, records of queued tasks are committed when they succeed.
+    std::string manifestPath_;
+    bool manifestHash_;
+    Manifest *manifest_;
+    std::map<EncodingTask*, ManifestRecord> manifestRecords_;
+    size_t skippedFiles_;
+
+    // Job modes: jobs come from the daemon socket or from a job list,
+    // finished tasks are reported and deleted, so only queued and
+    // running jobs are kept.
+#ifdef __linux__
+    std::string daemonSocket_;
+    JobServer *jobServer_;
+#endif
+    std::string jobListPath_;
+    std::string resultsPath_;
+    JobListReader *jobList_;
+    FILE *results_;
+    bool isJobListFinished_;
+    std::map<EncodingTask*, JobRequest> jobs_;
+    std::map<std::pair<unsigned long, std::string>, EncodingTask*> jobIds_;  // For cancel.
+    unsigned long jobsServed_;
+    unsigned long jobsFailed_;
 
-    ThreadPool *threadPool_;
-    int inactiveTimeoutMs_;
 #ifdef __linux__
     sigset_t sigmask_;
 #endif
@@ -0,0 +1,90 @@
+#include "encoding_profile.h"
+
+#include <string.h>
+#include <sstream>
+#include <lame/lame.h>
+
+using namespace GMp3Enc;
+
+namespace {
+
+struct ProfileSpec
+{
+    const char *name;
+    EncodingProfile::BitrateMode mode;
+    int bitrate;
+    int vbrQuality;
+    int quality;
+    int nominalBitrate;
+};
+
+const ProfileSpec PROFILES[] = {
+    // Throughput oriented, voice and previews:
+    { "fast-cbr", EncodingProfile::ModeCbr, 128, 0, 7, 128 },
+    // lame -V2 with its default algorithm quality:
+    { "standard-vbr", EncodingProfile::ModeVbr, 0, 2, 3, 190 },
+    // Maximal bitrate and the slowest search:
+    { "archival", EncodingProfile::ModeCbr, 320, 0, 0, 320 }
+};
+
+const size_t PROFILES_COUNT = sizeof(PROFILES) / sizeof(PROFILES[0]);
+
+void apply(const ProfileSpec &spec, EncodingProfile &profile)
+{
+    profile.name = spec.name;
+    profile.mode = spec.mode;
+    profile.bitrate = spec.bitrate;
+    profile.vbrQuality = spec.vbrQuality;
+    profile.quality = spec.quality;
+    profile.nominalBitrate = spec.nominalBitrate;
+}
+
+}
+
+EncodingProfile::EncodingProfile()
+    : replayGain(false)
+{
+    apply(PROFILES[1], *this);
+}
+
+bool EncodingProfile::find(const std::string &name, EncodingProfile &profile)
+{
+    for (size_t i = 0; i < PROFILES_COUNT; i++) {
+        if (name == PROFILES[i].name) {
+            apply(PROFILES[i], profile);
+            return true;
+        }
+    }
+    return false;
+}
+
+EncodingProfile EncodingProfile::withBitrate(int kbps) const
+{
+    EncodingProfile profile = *this;
+    profile.mode = ModeCbr;
+    profile.bitrate = kbps;
+    profile.nominalBitrate = kbps;
+    return profile;
+}
+
+bool EncodingProfile::operator==(const EncodingProfile &other) const
+{
+    return strcmp(name, other.name) == 0 &&
+            mode == other.mode &&
+            bitrate == other.bitrate &&
+            vbrQuality == other.vbrQuality &&
+            quality == other.quality &&
+            replayGain == other.replayGain;
+}
+
+std::string EncodingProfile::settingsId() const
+{
+    std::ostringstream ss;
+    ss << "lame " << get_lame_version() << "; " << name;
+    if (mode == ModeCbr)
+        ss << "; cbr " << bitrate;
+    else
+        ss << "; vbr " << vbrQuality;
+    ss << "; q " << quality << "; replaygain " << (replayGain ? 1 : 0);
+    return ss.str();
+}
@@ -0,0 +1,43 @@
+#ifndef GMP3ENC_ENCODING_PROFILE_
+#define GMP3ENC_ENCODING_PROFILE_
+
+#include <string>
+
+namespace GMp3Enc {
+
+// Named set of lame settings, a trade-off between encoding speed,
+// quality and size. The default one is standard-vbr.
+struct EncodingProfile
+{
+    enum BitrateMode
+    {
+        ModeCbr,
+        ModeVbr
+    };
+
+    EncodingProfile();
+
+    // Known profiles: fast-cbr, standard-vbr, archival.
+    static bool find(const std::string &name, EncodingProfile &profile);
+
+    // CBR variant of the profile with the same algorithm quality, for
+    // sources published at several bitrates.
+    EncodingProfile withBitrate(int kbps) const;
+
+    bool operator==(const EncodingProfile &other) const;
+
+    // Identifies settings which affect the output.
+    std::string settingsId() const;
+
+    const char *name;
+    BitrateMode mode;
+    int bitrate;      // kbps, CBR only.
+    int vbrQuality;   // 0 (best) - 9, VBR only.
+    int quality;      // lame algorithm quality, 0 (best) - 9 (fastest).
+    int nominalBitrate; // kbps, expected average for output size estimation.
+    bool replayGain;  // Adds ReplayGain analysis, costs a few percents.
+};
+
+}
+
+#endif
@@ -4,14 +4,18 @@
 #include <vector>
 #include <lame/lame.h>
 
+#include "atomic_utils.h"
 #include "worker_thread.h"
+#include "output_writer.h"
+#include "shared_pcm_source.h"
 
 using namespace GMp3Enc;
 
 EncodingTask::EncodingTask(
         const RiffWave &wave,
         const std::string &mp3Destination,
-        size_t taskId)
+        size_t taskId,
+        const EncodingSegment &segment)
     : wave_(wave)
     , sourceFilePath_(wave.riffWavePath())
     , mp3Destination_(mp3Destination)
@@ -20,11 +24,30 @@ EncodingTask::EncodingTask(
     , executor_(NULL)
     , taskBuffer_(NULL)
     , r_(EncodingSuccess)
+    , segment_(segment)
+    , outputFile_(new OutputFile)
+    , samplesEncoded_(0)
+    , bytesWritten_(0)
+    , submitTimeUs_(0)
+    , isPrepared_(wave.isValid() ? 1 : 0)
+    , sourceSize_(-1)
+    , readerType_(WaveReaderStdio)
+    , source_(NULL)
+    , frameSize_(LAME_DEFAULR_FRAME_SIZE)
+    , isCanceled_(0)
+    , cancelTimeUs_(0)
+    , deadlineUs_(0)
 {
 }
 
 EncodingTask::~EncodingTask()
 {
+    // Adopted output of an interrupted shared source:
+    if (lame_)
+        lame_close(lame_);
+    if (source_)
+        source_->release();
+    delete outputFile_;
     if (taskBuffer_)
         delete[] taskBuffer_;
 }
@@ -36,121 +59,228 @@ EncodingTask* EncodingTask::create(
 {
     if (!wave.isValid())
         return NULL;
-    return new EncodingTask(wave, mp3Destination, taskId);
+    return new EncodingTask(wave, mp3Destination, taskId, EncodingSegment());
+}
+
+EncodingTask* EncodingTask::createDeferred(
+        const std::string &sourcePath,
+        long long sourceSize,
+        WaveReaderType readerType,
+        const std::string &mp3Destination,
+        size_t taskId)
+{
+    EncodingTask *task = new EncodingTask(RiffWave(), mp3Destination, taskId, EncodingSegment());
+    task->sourceFilePath_ = sourcePath;
+    task->sourceSize_ = sourceSize;
+    task->readerType_ = readerType;
+    return task;
+}
+
+EncodingTask* EncodingTask::createShared(
+        SharedPcmSource *source,
+        long long sourceSize,
+        const std::string &mp3Destination,
+        size_t taskId)
+{
+    if (!source)
+        return NULL;
+
+    EncodingTask *task = new EncodingTask(RiffWave(), mp3Destination, taskId, EncodingSegment());
+    source->retain();
+    source->addOutput(task);
+    task->source_ = source;
+    task->sourceFilePath_ = source->path();
+    task->sourceSize_ = sourceSize;
+    return task;
+}
+
+EncodingTask* EncodingTask::createSegment(
+        const RiffWave &wave,
+        const std::string &mp3Destination,
+        size_t taskId,
+        const EncodingSegment &segment)
+{
+    if (!wave.isValid() || !segment.isSegment())
+        return NULL;
+
+    EncodingTask *task = new EncodingTask(wave, mp3Destination, taskId, segment);
+    if (!task->wave_.setReadRange(segment.firstSample, segment.numSamples)) {
+        delete task;
+        return NULL;
+    }
+    return task;
 }
 
 
 EncodingTask::EncodingResult EncodingTask::encode()
 {
-    r_ = EncodingSuccess;
+    // Result is not reset, output of a shared source could be already
+    // finished by another task.
 
     uint8_t* mp3Buffer = NULL;
-    int32_t* pcmBuffer = NULL;
+    uint8_t* readBuffer = NULL;
     int32_t* pcmBufferLeft = NULL;
     int32_t* pcmBufferRight = NULL;
 
-    FILE *outf = fopen(mp3Destination_.c_str(), "wb");
-    if (!outf) {
-        errorStr_ = "Could not open destination file";
-        r_ = EncodingBadDestination;
+    if (!allocateBuffers(&mp3Buffer, &readBuffer, &pcmBufferLeft, &pcmBufferRight)) {
+        errorStr_ = "Failed to allocate buffers";
+        r_ = EncodingSystemError;
         return r_;
     }
 
-    if (!initLame()) {
-        fclose(outf);
-        r_ = EncodingSystemError;
+    // Samples are read by the source, the task could also encode
+    // outputs of other tasks:
+    if (source_) {
+        source_->encode(this, executor_, mp3Buffer);
         return r_;
     }
 
-    int frameSize = lame_get_framesize(lame_);
-    if (frameSize <= 0) {
-        errorStr_ = "Bad lame frame size";
-        fclose(outf);
-        lame_close(lame_);
-        lame_ = NULL;
-        r_ = EncodingSystemError;
+    // Canceled or expired in the queue:
+    if (checkInterrupt(executor_))
         return r_;
 
-    } else if (frameSize > LAME_MAX_FRAME_SIZE) {
-        frameSize = LAME_MAX_FRAME_SIZE;
-    }
-
-    if (!allocateBuffers(&mp3Buffer, &pcmBuffer, &pcmBufferLeft, &pcmBufferRight, frameSize)) {
-        errorStr_ = "Failed to allocate buffers";
-        fclose(outf);
-        lame_close(lame_);
-        lame_ = NULL;
-        r_ = EncodingSystemError;
+    if (!beginEncoding(executor_, true))
         return r_;
-    }
 
-    int wb = 0;
-    int i = 0;
+    // Reads ahead go to the ring of this worker, all of them are
+    // completed before the task leaves it:
+    if (executor_)
+        wave_.setIoRing(executor_->ioRing());
+    wave_.setReadInterrupt(this);
+
     while (true) {
         size_t readSamples = 0;
-        int numSamples = 0;
         bool isok = false;
 
-        int *bufl = NULL;
-        int *bufr = NULL;
-
-        i++;
-#ifdef __linux__
-        if (i % 10 == 0) {
-            if (executor_ && executor_->checkCancelationSignal()) {
-                break;
-            }
-        }
-#endif
+        // Flags are checked on every frame, it costs a couple of loads
+        // and a clock read against several hundred microseconds of lame:
+        if (checkInterrupt(executor_))
+            break;
 
-        isok = wave_.unpackReadSamples(pcmBuffer, frameSize * wave_.channelsNumber(), readSamples);
+        isok = wave_.unpackReadSamples(
+                    pcmBufferLeft,
+                    pcmBufferRight,
+                    readBuffer,
+                    frameSize_,
+                    readSamples);
+        // Interrupted stream read has already set the result:
         if (!isok) {
-            errorStr_ = "Failed to read PCM source";
-            r_ = EncodingBadSource;
+            if (r_ != EncodingCanceled)
+                setSourceError();
             break;
         }
 
         if (!readSamples)
             break;
 
-        numSamples = readSamples / wave_.channelsNumber();
-        if (wave_.channelsNumber() == 2) {
-            int32_t *p = pcmBuffer + readSamples;
-            for (int j = numSamples; --j >= 0;) {
-                pcmBufferLeft[j] = *--p;
-                pcmBufferRight[j] = *--p;
-            }
-            bufl = pcmBufferLeft;
-            bufr = pcmBufferRight;
+        if (!encodeSamples(pcmBufferLeft, pcmBufferRight, readSamples, mp3Buffer))
+            break;
+    }
+
+    finishEncoding(mp3Buffer);
+    wave_.closeReader();
+    return r_;
+}
+
+bool EncodingTask::beginEncoding(WorkerThread *executor, bool writeBehind)
+{
+    // Invalid source doesn't leave an empty destination:
+    if (!prepare())
+        return false;
+
+    OutputWriter *writer = executor && writeBehind ? executor->outputWriter() : NULL;
+    if (!outputFile_->open(mp3Destination_, writer)) {
+        errorStr_ = "Could not open destination file";
+        r_ = EncodingBadDestination;
+        return false;
+    }
+
+    if (!initLame(executor)) {
+        closeOutput();
+        r_ = EncodingSystemError;
+        return false;
+    }
 
-        } else {
-            bufl = pcmBuffer;
+    int frameSize = lame_get_framesize(lame_);
+    if (frameSize <= 0) {
+        errorStr_ = "Bad lame frame size";
+        closeOutput();
+        lame_close(lame_);
+        lame_ = NULL;
+        r_ = EncodingSystemError;
+        return false;
+
+    } else if (frameSize > LAME_MAX_FRAME_SIZE) {
+        frameSize = LAME_MAX_FRAME_SIZE;
+    }
+
+    if (segment_.isSegment()) {
+        // Segments are cut by mp3 frames, encoder must produce the same
+        // frames as it was expected by planning:
+        if (frameSize != segment_.frameSize) {
+            errorStr_ = "Unexpected lame frame size for segment";
+            closeOutput();
+            lame_close(lame_);
+            lame_ = NULL;
+            r_ = EncodingSystemError;
+            return false;
         }
+        segmentFilter_.reset(segment_);
+    }
+    frameSize_ = frameSize;
 
-        wb = lame_encode_buffer_int(
-                    lame_,
-                    bufl,
-                    bufr,
-                    numSamples,
-                    mp3Buffer,
+    // Rough size of the output, so the destination can be allocated at once:
+    long long numSamples = segment_.isSegment() ? segment_.numSamples : wave_.numSamples();
+    if (numSamples > 0) {
+        outputFile_->preallocate(
+                    numSamples * profile_.nominalBitrate * 125 / wave_.samplesPerSec() +
                     MP3_SIZE);
+    }
 
-        if (wb < 0) {
-            errorStr_ = "lame processing error: " + lameErrorCodeToStr(wb);
-            r_ = EncodingSystemError;
-            break;
-        } else if (wb > 0) {
-            size_t owb = fwrite(mp3Buffer, 1, wb, outf);
-            if (owb != wb) {
-                errorStr_ = "Failed to write into output file";
-                r_ = EncodingBadDestination;
-                break;
-            }
+    // Counters are published with plain relaxed stores, only the thread
+    // which encodes the task changes them:
+    atomicStoreRelaxed(&samplesEncoded_, 0L);
+    atomicStoreRelaxed(&bytesWritten_, 0L);
+    return true;
+}
+
+bool EncodingTask::encodeSamples(
+        const int32_t *left,
+        const int32_t *right,
+        size_t samples,
+        uint8_t *mp3Buffer)
+{
+    int wb = lame_encode_buffer_int(
+                lame_,
+                left,
+                wave_.channelsNumber() == 2 ? right : NULL,
+                samples,
+                mp3Buffer,
+                MP3_SIZE);
+
+    if (wb < 0) {
+        errorStr_ = "lame processing error: " + lameErrorCodeToStr(wb);
+        r_ = EncodingSystemError;
+        return false;
+    } else if (wb > 0) {
+        if (!writeOutput(mp3Buffer, wb)) {
+            errorStr_ = "Failed to write into output file";
+            r_ = EncodingBadDestination;
+            return false;
         }
+        atomicStoreRelaxed(&bytesWritten_, atomicLoadRelaxed(&bytesWritten_) + wb);
     }
 
+    atomicStoreRelaxed(
+                &samplesEncoded_,
+                atomicLoadRelaxed(&samplesEncoded_) + static_cast<long>(samples));
+    return true;
+}
+
+void EncodingTask::finishEncoding(uint8_t *mp3Buffer)
+{
     if (r_ == EncodingSuccess) {
-        wb = lame_encode_flush(
+        int wb = lame_encode_flush(
                     lame_,
                     mp3Buffer,
                     MP3_SIZE);
@@ -158,19 +288,66 @@ EncodingTask::EncodingResult EncodingTask::encode()
             errorStr_ = "lame processing error: " + lameErrorCodeToStr(wb);
             r_ = EncodingSystemError;
         } else if (wb > 0) {
-            size_t owb = fwrite(mp3Buffer, 1, wb, outf);
-            if (owb != wb) {
+            if (!writeOutput(mp3Buffer, wb)) {
                 errorStr_ = "Failed to write into output file";
                 r_ = EncodingBadDestination;
             }
+            atomicStoreRelaxed(&bytesWritten_, atomicLoadRelaxed(&bytesWritten_) + wb);
         }
     }
 
-    fclose(outf);
+    // lame has written an empty frame in place of the Info tag, the tag
+    // is complete only after the flush:
+    if (r_ == EncodingSuccess && lame_get_bWriteVbrTag(lame_)) {
+        size_t size = lame_get_lametag_frame(lame_, mp3Buffer, MP3_SIZE);
+        if (size > 0 && size <= static_cast<size_t>(MP3_SIZE))
+            outputFile_->setHeader(mp3Buffer, size);
+    }
+
+    if (!closeOutput() && r_ == EncodingSuccess) {
+        errorStr_ = "Failed to write into output file";
+        r_ = EncodingBadDestination;
+    }
     lame_close(lame_);
     lame_ = NULL;
+}
 
-    return r_;
+void EncodingTask::cancel()
+{
+    if (atomicLoadAcquire(&isCanceled_))
+        return;
+    atomicStoreRelaxed(&cancelTimeUs_, MetricsRegistry::nowUs());
+    atomicStoreRelease(&isCanceled_, 1L);
+}
+
+bool EncodingTask::checkInterrupt(WorkerThread *executor)
+{
+    long long sinceUs;
+    if (executor && executor->checkCancelationSignal()) {
+        errorStr_ = "Interrupted";
+        sinceUs = executor->cancelTimeUs();
+    } else if (atomicLoadAcquire(&isCanceled_)) {
+        errorStr_ = "Canceled";
+        sinceUs = atomicLoadRelaxed(&cancelTimeUs_);
+    } else if (deadlineUs_ && MetricsRegistry::nowUs() >= deadlineUs_) {
+        errorStr_ = "Deadline exceeded";
+        sinceUs = deadlineUs_;
+    } else {
+        return false;
+    }
+
+    // Stop latency is measured for tasks which have begun encoding:
+    if (executor && lame_) {
+        long long us = MetricsRegistry::nowUs() - sinceUs;
+        executor->metrics()->cancelLatency.record(us > 0 ? us : 0);
+    }
+    r_ = EncodingCanceled;
+    return true;
+}
+
+bool EncodingTask::isReadInterrupted()
+{
+    return checkInterrupt(executor_);
 }
 
 void EncodingTask::setExecutor(WorkerThread *executor)
@@ -178,40 +355,160 @@ void EncodingTask::setExecutor(WorkerThread *executor)
     executor_ = executor;
 }
 
+bool EncodingTask::prepare()
+{
+    if (isPrepared())
+        return true;
+
+    if (source_) {
+        if (!source_->prepare()) {
+            errorStr_ = "Not a valid riff wave file";
+            r_ = EncodingBadSource;
+            return false;
+        }
+        wave_ = source_->wave();
+    } else {
+        if (!wave_.readWave(sourceFilePath_)) {
+            errorStr_ = "Not a valid riff wave file";
+            r_ = EncodingBadSource;
+            return false;
+        }
+        wave_.setReaderType(readerType_);
+    }
+
+    atomicStoreRelease(&isPrepared_, 1L);
+    return true;
+}
+
+bool EncodingTask::isPrepared() const
+{
+    return atomicLoadAcquire(&isPrepared_) != 0;
+}
+
+unsigned long long EncodingTask::workload() const
+{
+    if (!isPrepared())
+        return sourceSize_ > 0 ? static_cast<unsigned long long>(sourceSize_) : 0;
+    return static_cast<unsigned long long>(totalSamples()) * wave_.channelsNumber();
+}
+
+long EncodingTask::samplesEncoded() const
+{
+    return atomicLoadRelaxed(&samplesEncoded_);
+}
+
+long EncodingTask::bytesWritten() const
+{
+    return atomicLoadRelaxed(&bytesWritten_);
+}
+
+unsigned long EncodingTask::totalSamples() const
+{
+    if (!isPrepared())
+        return 0;
+    return segment_.isSegment() ? segment_.numSamples : wave_.numSamples();
+}
+
+unsigned long EncodingTask::sourceSamplesEncoded() const
+{
+    unsigned long samples = static_cast<unsigned long>(samplesEncoded());
+    if (!segment_.isSegment())
+        return samples;
+
+    unsigned long priming = segment_.primingSamples();
+    samples = samples > priming ? samples - priming : 0;
+    return samples < segment_.ownSamples() ? samples : segment_.ownSamples();
+}
+
+unsigned long EncodingTask::sourceTotalSamples() const
+{
+    if (isPrepared() && segment_.isSegment())
+        return segment_.ownSamples();
+    return totalSamples();
+}
+
+size_t EncodingTask::sourceOutputsCount() const
+{
+    return source_ ? source_->outputsCount() : 1;
+}
+
+int EncodingTask::samplesPerSec() const
+{
+    return isPrepared() ? wave_.samplesPerSec() : 0;
+}
+
+int EncodingTask::inputBlockSize() const
+{
+    return isPrepared() ? wave_.blockSize() : 0;
+}
+
 std::string EncodingTask::sourceFilePath() const
 {
     return sourceFilePath_;
 }
 
-bool EncodingTask::initLame()
+bool EncodingTask::initLame(WorkerThread *executor)
 {
-    lame_ = lame_init();
+    LameContextKey key;
+    lameContextKey(key);
+
+    LameContextCache *cache = executor ? executor->lameCache() : NULL;
+    lame_ = cache ? cache->acquire(key) : LameContextCache::create(key);
     if (!lame_) {
         errorStr_ = "Failed to init lame encoder.";
         return false;
     }
 
-    lame_set_findReplayGain(lame_, 1);
-    lame_set_num_samples(lame_, wave_.numSamples());
-    lame_set_in_samplerate(lame_, wave_.samplesPerSec());
-    lame_set_brate(lame_, wave_.avgBytesPerSec());
-    if (wave_.channelsNumber() == 1) {
-        lame_set_num_channels(lame_, 1);
-        lame_set_mode(lame_, MONO);
-    } else {
-        lame_set_num_channels(lame_, wave_.channelsNumber());
-    }
-    //lame_set_VBR(lame_, vbr_mtrh);
-    lame_set_quality(lame_, 2); // high quality
+    // Used only for tags, so it is set after lame_init_params():
+    if (segment_.isSegment())
+        lame_set_num_samples(lame_, segment_.numSamples);
+    else if (wave_.isSizeKnown())
+        lame_set_num_samples(lame_, wave_.numSamples());
 
-    if (lame_init_params(lame_) < 0) {
-        errorStr_ = "Fatal error during lame initialization.";
+    return true;
+}
+
+bool EncodingTask::lameContextKey(LameContextKey &key) const
+{
+    if (!isPrepared())
         return false;
-    }
 
+    key.samplesPerSec = wave_.samplesPerSec();
+    key.channels = wave_.channelsNumber();
+    key.profile = profile_;
+    key.isSegment = segment_.isSegment();
+    // Info tag can't be updated in the stream and segments are joined:
+    key.writeVbrTag = !key.isSegment && !outputFile_->isStream();
     return true;
 }
 
+void EncodingTask::setOutputError()
+{
+    errorStr_ = "Failed to write into output file";
+    r_ = EncodingBadDestination;
+}
+
+void EncodingTask::setSourceError()
+{
+    errorStr_ = "Failed to read PCM source";
+    r_ = EncodingBadSource;
+}
+
+bool EncodingTask::writeOutput(const uint8_t *data, size_t size)
+{
+    if (segment_.isSegment())
+        return segmentFilter_.write(data, size, outputFile_);
+    return outputFile_->write(data, size);
+}
+
+bool EncodingTask::closeOutput()
+{
+    // Write-behind file is closed by the output writer thread:
+    if (outputFile_->isWriteBehind())
+        return true;
+    return outputFile_->close();
+}
+
 std::string EncodingTask::lameErrorCodeToStr(int r)
 {
     if (r >= 0)
@@ -233,9 +530,8 @@ std::string EncodingTask::lameErrorCodeToStr(int r)
     return std::string("unknown error");
 }
 
-bool EncodingTask::allocateBuffers(uint8_t **mp3Buffer, int32_t **pcmBuffer,
-        int32_t **pcmBufferLeft, int32_t **pcmBufferRight,
-        int frameSize)
+bool EncodingTask::allocateBuffers(uint8_t **mp3Buffer, uint8_t **readBuffer,
+        int32_t **pcmBufferLeft, int32_t **pcmBufferRight)
 {
     uint8_t *buf;
     if (executor_) {
@@ -259,15 +555,15 @@ bool EncodingTask::allocateBuffers(uint8_t **mp3Buffer, int32_t **pcmBuffer,
 
     *mp3Buffer = buf;
 
-    *pcmBuffer = reinterpret_cast<int32_t*>(
-                buf + MP3_SIZE);
+    // Raw samples are unpacked from the read buffer directly
+    // into the channel buffers:
+    *readBuffer = buf + MP3_SIZE;
 
     *pcmBufferLeft = reinterpret_cast<int32_t*>(
-                buf + MP3_SIZE + (frameSize * wave_.channelsNumber()) * sizeof(int32_t));
+                buf + MP3_SIZE + PCM_SIZE);
 
     *pcmBufferRight = reinterpret_cast<int32_t*>(
-                buf + MP3_SIZE + (frameSize * wave_.channelsNumber()) * sizeof(int32_t) +
-                frameSize * sizeof(int32_t));
+                buf + MP3_SIZE + PCM_SIZE + PCM_CHANNEL_SIZE);
 
     return true;
 }
@@ -5,16 +5,16 @@
 #include <stdio.h>
 
 #include "riff_wave.h"
-
-struct lame_global_struct;
-typedef struct lame_global_struct lame_global_flags;
-typedef lame_global_flags *lame_t;
+#include "mp3_segment.h"
+#include "lame_context_cache.h"
 
 namespace GMp3Enc {
 
 class WorkerThread;
+class OutputFile;
+class SharedPcmSource;
 
-class EncodingTask
+class EncodingTask : private ReadInterrupt
 {
 public:
     static const int LAME_DEFAULR_FRAME_SIZE = 1152;
@@ -32,7 +32,8 @@ public:
         EncodingSuccess,
         EncodingBadSource,
         EncodingBadDestination,
-        EncodingSystemError
+        EncodingSystemError,
+        EncodingCanceled
     };
 
     ~EncodingTask();
@@ -42,29 +43,125 @@ public:
             const std::string &mp3Destination,
             size_t taskId);
 
+    // The header is parsed by the worker when the task is executed.
+    // sourceSize is the file size in bytes (-1 if unknown), it estimates
+    // the workload until the header is parsed.
+    static EncodingTask* createDeferred(
+            const std::string &sourcePath,
+            long long sourceSize,
+            WaveReaderType readerType,
+            const std::string &mp3Destination,
+            size_t taskId);
+
+    // One of the outputs of a source encoded several times, the source
+    // is read once for all of them. The header is parsed by the worker.
+    static EncodingTask* createShared(
+            SharedPcmSource *source,
+            long long sourceSize,
+            const std::string &mp3Destination,
+            size_t taskId);
+
+    static EncodingTask* createSegment(
+            const RiffWave &wave,
+            const std::string &mp3Destination,
+            size_t taskId,
+            const EncodingSegment &segment);
+
     EncodingResult encode();
 
+    // Parses the header of a deferred task. Wave parameters are
+    // available to other threads after it has succeeded.
+    bool prepare();
+    bool isPrepared() const;
+
     void setExecutor(WorkerThread *executor);
+    inline void setProfile(const EncodingProfile &profile) { profile_ = profile; }
+    inline const EncodingProfile& profile() const { return profile_; }
+    void setOutputError();
+
+    // Cancellation token, can be set by any thread. The running task
+    // stops at the next frame, the queued one is not encoded.
+    void cancel();
+
+    // Absolute time in MetricsRegistry::nowUs() units, 0 - no deadline.
+    // Set before the task is submitted.
+    inline void setDeadlineUs(long long us) { deadlineUs_ = us; }
+    inline long long deadlineUs() const { return deadlineUs_; }
+
+    inline OutputFile* outputFile() { return outputFile_; }
 
     inline size_t taskId() const { return taskId_; }
     inline std::string errorStr() const { return errorStr_; }
     inline EncodingResult result() const { return r_; }
+    inline const EncodingSegment& segment() const { return segment_; }
+    inline std::string mp3Destination() const { return mp3Destination_; }
+
+    // Estimated amount of work: samples of all channels to be encoded,
+    // or the source file size if the header is not parsed yet.
+    unsigned long long workload() const;
+
+    // Progress counters, written by the worker and read by any thread.
+    long samplesEncoded() const;
+    long bytesWritten() const;
+
+    // Set by the thread pool when the task is submitted.
+    inline void setSubmitTimeUs(long long us) { submitTimeUs_ = us; }
+    inline long long submitTimeUs() const { return submitTimeUs_; }
+
+    // Samples per channel to be encoded, 0 if unknown (stream).
+    unsigned long totalSamples() const;
+
+    // The same counters in samples of the source file: overlap of
+    // a segment is excluded, so segments of a file add up to its length.
+    unsigned long sourceSamplesEncoded() const;
+    unsigned long sourceTotalSamples() const;
+
+    // Outputs which share reading of the source, 1 if it is not shared.
+    size_t sourceOutputsCount() const;
+    int samplesPerSec() const;
+    int inputBlockSize() const;
 
     std::string sourceFilePath() const;
 
+    // Encoder parameters of the task, known after the header is parsed.
+    bool lameContextKey(LameContextKey &key) const;
+
 private:
+    friend class SharedPcmSource;
+
     EncodingTask(
             const RiffWave &wave,
             const std::string &mp3Destination,
-            size_t taskId);
+            size_t taskId,
+            const EncodingSegment &segment);
     EncodingTask(const EncodingTask&) {}
     EncodingTask& operator=(const EncodingTask&) {}
-    bool initLame();
+    bool initLame(WorkerThread *executor);
+
+    // Steps of encoding. The shared source calls them for the outputs
+    // it encodes on other workers than their own.
+    bool beginEncoding(WorkerThread *executor, bool writeBehind);
+    bool encodeSamples(
+            const int32_t *left,
+            const int32_t *right,
+            size_t samples,
+            uint8_t *mp3Buffer);
+    void finishEncoding(uint8_t *mp3Buffer);
+    void setSourceError();
+
+    // Polled between frames. Sets the result if the task has to stop
+    // because of the pool shutdown, cancellation or deadline.
+    bool checkInterrupt(WorkerThread *executor);
+
+    // The same check made by a stream reader waiting for data.
+    bool isReadInterrupted();
+
+    bool writeOutput(const uint8_t *data, size_t size);
+    bool closeOutput();
     std::string lameErrorCodeToStr(int r);
 
-    bool allocateBuffers(uint8_t **mp3Buffer, int32_t **pcmBuffer,
-            int32_t **pcmBufferLeft, int32_t **pcmBufferRight,
-            int frameSize);
+    bool allocateBuffers(uint8_t **mp3Buffer, uint8_t **readBuffer,
+            int32_t **pcmBufferLeft, int32_t **pcmBufferRight);
 
     RiffWave wave_;
     std::string sourceFilePath_;
@@ -75,6 +172,21 @@ private:
     WorkerThread *executor_;
     uint8_t *taskBuffer_;
     EncodingResult r_;
+    EncodingSegment segment_;
+    Mp3SegmentFilter segmentFilter_;
+    OutputFile *outputFile_;
+    volatile long samplesEncoded_;
+    volatile long bytesWritten_;
+    long long submitTimeUs_;
+    volatile long isPrepared_;
+    long long sourceSize_;
+    WaveReaderType readerType_;
+    EncodingProfile profile_;
+    SharedPcmSource *source_;
+    int frameSize_;
+    volatile long isCanceled_;
+    volatile long long cancelTimeUs_;
+    long long deadlineUs_;
 };
 
 struct EncodingNotification
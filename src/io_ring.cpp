@@ -0,0 +1,282 @@
+#include "io_ring.h"
+
+#ifdef GMP3ENC_HAS_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#endif
+
+#include "atomic_utils.h"
+
+using namespace GMp3Enc;
+
+#ifdef GMP3ENC_HAS_IO_URING
+namespace {
+
+int ioUringSetup(unsigned entries, io_uring_params *params)
+{
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int ioUringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0));
+}
+
+int ioUringRegister(int fd, unsigned opcode, void *arg, unsigned count)
+{
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, count));
+}
+
+}
+#endif
+
+IoRing::IoRing()
+    : ringFd_(-1)
+    , entries_(0)
+    , queued_(0)
+    , inFlight_(0)
+    , sqRing_(NULL)
+    , sqRingSize_(0)
+    , cqRing_(NULL)
+    , cqRingSize_(0)
+    , sqes_(NULL)
+    , sqesSize_(0)
+    , sqTail_(NULL)
+    , sqMask_(0)
+    , sqArray_(NULL)
+    , cqHead_(NULL)
+    , cqTail_(NULL)
+    , cqMask_(0)
+    , cqes_(NULL)
+{
+}
+
+IoRing::~IoRing()
+{
+    destroy();
+}
+
+bool IoRing::init(unsigned entries)
+{
+    destroy();
+
+#ifdef GMP3ENC_HAS_IO_URING
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = ioUringSetup(entries, &p);
+    if (fd < 0)
+        return false;
+    ringFd_ = fd;
+
+    // Since 5.4 both rings are in one mapping:
+    sqRingSize_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqRingSize_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool isSingleMap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (isSingleMap && cqRingSize_ > sqRingSize_)
+        sqRingSize_ = cqRingSize_;
+
+    void *sq = mmap(NULL, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        sqRingSize_ = 0;
+        destroy();
+        return false;
+    }
+    sqRing_ = sq;
+
+    void *cq = sq;
+    if (!isSingleMap) {
+        cq = mmap(NULL, cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            cqRingSize_ = 0;
+            destroy();
+            return false;
+        }
+        cqRing_ = cq;
+    }
+
+    sqesSize_ = p.sq_entries * sizeof(io_uring_sqe);
+    void *sqes = mmap(NULL, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        sqesSize_ = 0;
+        destroy();
+        return false;
+    }
+    sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+    uint8_t *sqp = static_cast<uint8_t*>(sq);
+    uint8_t *cqp = static_cast<uint8_t*>(cq);
+    sqTail_ = reinterpret_cast<unsigned*>(sqp + p.sq_off.tail);
+    sqMask_ = *reinterpret_cast<unsigned*>(sqp + p.sq_off.ring_mask);
+    sqArray_ = reinterpret_cast<unsigned*>(sqp + p.sq_off.array);
+    cqHead_ = reinterpret_cast<unsigned*>(cqp + p.cq_off.head);
+    cqTail_ = reinterpret_cast<unsigned*>(cqp + p.cq_off.tail);
+    cqMask_ = *reinterpret_cast<unsigned*>(cqp + p.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cqp + p.cq_off.cqes);
+
+    // Completion ring is twice as large, it can't overflow while
+    // requests are limited by entries_:
+    entries_ = p.sq_entries;
+    return true;
+#else
+    (void)entries;
+    return false;
+#endif
+}
+
+void IoRing::destroy()
+{
+#ifdef GMP3ENC_HAS_IO_URING
+    if (sqes_)
+        munmap(sqes_, sqesSize_);
+    if (cqRing_)
+        munmap(cqRing_, cqRingSize_);
+    if (sqRing_)
+        munmap(sqRing_, sqRingSize_);
+    if (ringFd_ != -1)
+        close(ringFd_);
+#endif
+    ringFd_ = -1;
+    entries_ = 0;
+    queued_ = 0;
+    inFlight_ = 0;
+    sqRing_ = NULL;
+    sqRingSize_ = 0;
+    cqRing_ = NULL;
+    cqRingSize_ = 0;
+    sqes_ = NULL;
+    sqesSize_ = 0;
+}
+
+bool IoRing::prepareRead(int fd, void *buffer, size_t size, long long offset, void *userData)
+{
+#ifdef GMP3ENC_HAS_IO_URING
+    return prepare(IORING_OP_READ, fd, buffer, size, offset, userData);
+#else
+    (void)fd; (void)buffer; (void)size; (void)offset; (void)userData;
+    return false;
+#endif
+}
+
+bool IoRing::prepareWrite(int fd, const void *buffer, size_t size, long long offset, void *userData)
+{
+#ifdef GMP3ENC_HAS_IO_URING
+    return prepare(IORING_OP_WRITE, fd, buffer, size, offset, userData);
+#else
+    (void)fd; (void)buffer; (void)size; (void)offset; (void)userData;
+    return false;
+#endif
+}
+
+bool IoRing::prepare(int opcode, int fd, const void *buffer, size_t size, long long offset, void *userData)
+{
+#ifdef GMP3ENC_HAS_IO_URING
+    if (!isValid() || queued_ + inFlight_ >= entries_)
+        return false;
+
+    // Only this thread moves the tail, the kernel reads it:
+    unsigned tail = *sqTail_;
+    unsigned index = tail & sqMask_;
+    io_uring_sqe *sqe = &sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = static_cast<uint8_t>(opcode);
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uintptr_t>(buffer);
+    sqe->len = static_cast<unsigned>(size);
+    sqe->off = static_cast<uint64_t>(offset);
+    sqe->user_data = reinterpret_cast<uintptr_t>(userData);
+    sqArray_[index] = index;
+    atomicStoreRelease(sqTail_, tail + 1);
+    queued_++;
+    return true;
+#else
+    (void)opcode; (void)fd; (void)buffer; (void)size; (void)offset; (void)userData;
+    return false;
+#endif
+}
+
+bool IoRing::submit(unsigned waitCount)
+{
+#ifdef GMP3ENC_HAS_IO_URING
+    if (!isValid())
+        return false;
+
+    // Completions which are already there don't need a syscall:
+    unsigned ready = atomicLoadAcquire(cqTail_) - *cqHead_;
+    if (!queued_ && ready >= waitCount)
+        return true;
+
+    unsigned flags = waitCount ? IORING_ENTER_GETEVENTS : 0;
+    while (true) {
+        int r = ioUringEnter(ringFd_, queued_, waitCount, flags);
+        if (r >= 0) {
+            queued_ -= r;
+            inFlight_ += r;
+            return true;
+        }
+        if (errno != EINTR)
+            return false;
+    }
+#else
+    (void)waitCount;
+    return false;
+#endif
+}
+
+bool IoRing::popCompletion(void *&userData, int &result)
+{
+#ifdef GMP3ENC_HAS_IO_URING
+    if (!isValid())
+        return false;
+
+    unsigned head = *cqHead_;
+    if (head == atomicLoadAcquire(cqTail_))
+        return false;
+
+    const io_uring_cqe *cqe = &cqes_[head & cqMask_];
+    userData = reinterpret_cast<void*>(static_cast<uintptr_t>(cqe->user_data));
+    result = cqe->res;
+    atomicStoreRelease(cqHead_, head + 1);
+    inFlight_--;
+    return true;
+#else
+    (void)userData; (void)result;
+    return false;
+#endif
+}
+
+const char* IoRing::backendName(IoBackend backend)
+{
+    return backend == IoBackendUring ? "uring" : "sync";
+}
+
+bool IoRing::isSupported()
+{
+#ifdef GMP3ENC_HAS_IO_URING
+    IoRing ring;
+    if (!ring.init(2))
+        return false;
+
+    // IORING_OP_READ and IORING_OP_WRITE appeared in 5.6 together with
+    // the probe, older kernels fail to register it:
+    const unsigned opsCount = 256;
+    std::vector<uint8_t> buf(sizeof(io_uring_probe) + opsCount * sizeof(io_uring_probe_op));
+    io_uring_probe *probe = reinterpret_cast<io_uring_probe*>(&buf[0]);
+    if (ioUringRegister(ring.ringFd_, IORING_REGISTER_PROBE, probe, opsCount) < 0)
+        return false;
+    if (probe->last_op < IORING_OP_WRITE)
+        return false;
+    return (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+           (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,87 @@
+#ifndef GMP3ENC_IO_RING_
+#define GMP3ENC_IO_RING_
+
+#include <stddef.h>
+
+// Kernel headers without io_uring build the synchronous path only:
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define GMP3ENC_HAS_IO_URING
+#endif
+#endif
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace GMp3Enc {
+
+enum IoBackend
+{
+    IoBackendSync,   // Blocking stdio/mmap calls on the calling thread.
+    IoBackendUring   // Reads and write-behind writes are queued to io_uring.
+};
+
+// Minimal io_uring made with raw syscalls, so there is no liburing
+// dependency. The ring is used by one thread only. Requests are plain
+// reads and writes at explicit offsets, completions are matched by the
+// user data pointer.
+class IoRing
+{
+public:
+    IoRing();
+    ~IoRing();
+
+    // Returns false if the kernel has no io_uring (or it is disabled).
+    bool init(unsigned entries);
+    void destroy();
+
+    inline bool isValid() const { return ringFd_ != -1; }
+    inline unsigned inFlight() const { return inFlight_ + queued_; }
+
+    // Queue a request. False if the ring already has as many requests
+    // as entries, a completion must be taken first then.
+    bool prepareRead(int fd, void *buffer, size_t size, long long offset, void *userData);
+    bool prepareWrite(int fd, const void *buffer, size_t size, long long offset, void *userData);
+
+    // Submits queued requests and waits until at least waitCount
+    // completions can be taken.
+    bool submit(unsigned waitCount);
+
+    // Non-blocking. result is the read or written size or -errno.
+    bool popCompletion(void *&userData, int &result);
+
+    static const char* backendName(IoBackend backend);
+
+    // io_uring is available and supports plain reads and writes (5.6+).
+    static bool isSupported();
+
+private:
+    IoRing(const IoRing&);
+    IoRing& operator=(const IoRing&);
+
+    bool prepare(int opcode, int fd, const void *buffer, size_t size, long long offset, void *userData);
+
+    int ringFd_;
+    unsigned entries_;
+    unsigned queued_;    // Prepared, not submitted yet.
+    unsigned inFlight_;  // Submitted, not completed yet.
+
+    // Rings are shared with the kernel:
+    void *sqRing_;
+    size_t sqRingSize_;
+    void *cqRing_;
+    size_t cqRingSize_;
+    io_uring_sqe *sqes_;
+    size_t sqesSize_;
+    unsigned *sqTail_;
+    unsigned sqMask_;
+    unsigned *sqArray_;
+    unsigned *cqHead_;
+    unsigned *cqTail_;
+    unsigned cqMask_;
+    io_uring_cqe *cqes_;
+};
+
+}
+
+#endif
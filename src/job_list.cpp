@@ -0,0 +1,111 @@
+#include "job_list.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging_utils.h"
+
+using namespace GMp3Enc;
+
+JobListReader::JobListReader()
+    : file_(NULL)
+    , lineNumber_(0)
+    , buffer_(MAX_LINE_SIZE + 2)
+{
+}
+
+JobListReader::~JobListReader()
+{
+    if (file_)
+        fclose(file_);
+}
+
+bool JobListReader::open(const std::string &path)
+{
+    file_ = fopen(path.c_str(), "rb");
+    if (!file_) {
+        GMP3ENC_LOGGER_ERROR("Could not open job list: %s", path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool JobListReader::next(JobRequest &request, std::string &error)
+{
+    if (!file_)
+        return false;
+
+    while (fgets(&buffer_[0], buffer_.size(), file_)) {
+        lineNumber_++;
+        size_t length = strlen(&buffer_[0]);
+        bool isTooLong = (!length || buffer_[length - 1] != '\n') && !feof(file_);
+
+        // Rest of a long line is skipped:
+        if (isTooLong) {
+            int c;
+            while ((c = fgetc(file_)) != EOF && c != '\n')
+                ;
+        }
+
+        while (length && (buffer_[length - 1] == '\n' || buffer_[length - 1] == '\r'))
+            length--;
+        std::string line(&buffer_[0], length);
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        char id[32];
+        snprintf(id, sizeof(id), "%lu", lineNumber_);
+        request = JobRequest();
+        request.jobId = id;
+        error.clear();
+
+        if (isTooLong) {
+            error = "line is too long";
+            return true;
+        }
+
+        std::vector<std::string> fields;
+        splitFields(line, fields);
+        if (fields.size() < 2 || fields.size() > 4 || fields[0].empty() || fields[1].empty() ||
+            !parseJobOptions(fields, 2, request)) {
+            error = "bad job line";
+            return true;
+        }
+        request.input = fields[0];
+        request.output = fields[1];
+        return true;
+    }
+
+    return false;
+}
+
+bool JobListReader::parseJobOptions(
+        const std::vector<std::string> &fields,
+        size_t index,
+        JobRequest &request)
+{
+    if (fields.size() > index)
+        request.profile = fields[index];
+    if (fields.size() > index + 1) {
+        const char *s = fields[index + 1].c_str();
+        char *end = NULL;
+        long ms = strtol(s, &end, 10);
+        if (end == s || *end || ms <= 0)
+            return false;
+        request.timeoutMs = ms;
+    }
+    return true;
+}
+
+void JobListReader::splitFields(const std::string &line, std::vector<std::string> &fields)
+{
+    fields.clear();
+    size_t start = 0;
+    while (true) {
+        size_t end = line.find('\t', start);
+        fields.push_back(line.substr(start, end == std::string::npos ? end : end - start));
+        if (end == std::string::npos)
+            break;
+        start = end + 1;
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef GMP3ENC_JOB_LIST_
+#define GMP3ENC_JOB_LIST_
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+namespace GMp3Enc {
+
+// Encoding job submitted by a client of the daemon or read from
+// a job list.
+struct JobRequest
+{
+    JobRequest()
+        : clientId(0)
+        , timeoutMs(0)
+        , isCancel(false)
+    {
+    }
+
+    unsigned long clientId;  // 0 - the job list.
+    std::string jobId;       // Line number for the job list.
+    std::string input;
+    std::string output;
+    std::string profile;     // Empty - the default profile.
+    long timeoutMs;          // 0 - the default timeout.
+    bool isCancel;           // Daemon only, cancels the client's job.
+};
+
+// Reads a job list line by line, so lists of any length are fed to
+// workers in constant memory. Every line is a job with tab separated
+// fields:
+//
+//   <input.wav> <output.mp3> [<profile> [<timeout-ms>]]
+//
+// Empty profile field selects the default one. Empty lines and lines starting with '#' are skipped.
+class JobListReader
+{
+public:
+    static const size_t MAX_LINE_SIZE = 8192;
+
+    JobListReader();
+    ~JobListReader();
+
+    bool open(const std::string &path);
+
+    // Returns false at the end of the list. Malformed line is returned
+    // with the error, its job id is still set.
+    bool next(JobRequest &request, std::string &error);
+
+    static void splitFields(const std::string &line, std::vector<std::string> &fields);
+
+    // Optional profile and timeout fields starting at the index.
+    static bool parseJobOptions(
+            const std::vector<std::string> &fields,
+            size_t index,
+            JobRequest &request);
+
+private:
+    JobListReader(const JobListReader&);
+    JobListReader& operator=(const JobListReader&);
+
+    FILE *file_;
+    unsigned long lineNumber_;
+    std::vector<char> buffer_;
+};
+
+}
+
+#endif
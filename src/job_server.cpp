@@ -0,0 +1,319 @@
+#include "job_server.h"
+
+#ifdef __linux__
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <vector>
+
+#include "logging_utils.h"
+
+using namespace GMp3Enc;
+
+// Events are tagged with client ids, 0 is the listening socket:
+static const unsigned long LISTEN_ID = 0;
+
+JobServer::JobServer()
+    : listenFd_(-1)
+    , epollFd_(-1)
+    , nextClientId_(1)
+{
+}
+
+JobServer::~JobServer()
+{
+    while (!clients_.empty())
+        dropClient(clients_.begin()->first);
+    if (epollFd_ != -1)
+        close(epollFd_);
+    if (listenFd_ != -1) {
+        close(listenFd_);
+        unlink(path_.c_str());
+    }
+}
+
+bool JobServer::listen(const std::string &path)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.length() >= sizeof(addr.sun_path)) {
+        GMP3ENC_LOGGER_ERROR("Bad socket path: %s", path.c_str());
+        return false;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.length());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        GMP3ENC_LOGGER_ERROR("socket failed: %s.", strerror(errno));
+        return false;
+    }
+
+    // Socket file of a running daemon accepts connections, the one
+    // left by a killed daemon doesn't:
+    struct stat statbuf;
+    if (lstat(path.c_str(), &statbuf) == 0) {
+        if (!S_ISSOCK(statbuf.st_mode) ||
+            connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0 ||
+            errno == EAGAIN) {
+            GMP3ENC_LOGGER_ERROR("Socket path is in use: %s", path.c_str());
+            close(fd);
+            return false;
+        }
+        close(fd);
+        unlink(path.c_str());
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+            GMP3ENC_LOGGER_ERROR("socket failed: %s.", strerror(errno));
+            return false;
+        }
+    }
+
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1) {
+        GMP3ENC_LOGGER_ERROR("Could not bind %s: %s.", path.c_str(), strerror(errno));
+        close(fd);
+        return false;
+    }
+    path_ = path;
+    listenFd_ = fd;
+
+    // Jobs read and write files with the daemon's permissions:
+    chmod(path_.c_str(), S_IRUSR | S_IWUSR);
+
+    if (::listen(listenFd_, SOMAXCONN) == -1) {
+        GMP3ENC_LOGGER_ERROR("listen failed: %s.", strerror(errno));
+        return false;
+    }
+
+    epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd_ == -1) {
+        GMP3ENC_LOGGER_ERROR("epoll_create1 failed: %s.", strerror(errno));
+        return false;
+    }
+
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = LISTEN_ID;
+    if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, listenFd_, &event) == -1) {
+        GMP3ENC_LOGGER_ERROR("epoll_ctl failed: %s.", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+void JobServer::processEvents(std::list<JobRequest> &requests)
+{
+    const int job_server_events_size = 16;
+    epoll_event events[job_server_events_size];
+
+    // Level triggered, the rest is reported by the next call:
+    int n = epoll_wait(epollFd_, events, job_server_events_size, 0);
+    for (int i = 0; i < n; i++) {
+        unsigned long id = events[i].data.u64;
+        if (id == LISTEN_ID) {
+            acceptClients();
+            continue;
+        }
+
+        std::map<unsigned long, Client>::iterator it = clients_.find(id);
+        if (it == clients_.end())
+            continue;
+
+        Client &client = it->second;
+        bool isok = true;
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            isok = readClient(id, client, requests);
+        if (isok && (events[i].events & EPOLLOUT))
+            isok = flushClient(id, client);
+
+        // Connection is closed by the peer, replies can't be delivered:
+        if (events[i].events & (EPOLLHUP | EPOLLERR))
+            isok = false;
+        if (!isok)
+            dropClient(id);
+    }
+}
+
+void JobServer::reply(unsigned long clientId, const std::string &line)
+{
+    std::map<unsigned long, Client>::iterator it = clients_.find(clientId);
+    if (it == clients_.end())
+        return;
+
+    Client &client = it->second;
+    if (client.pending)
+        client.pending--;
+    client.out += line;
+    client.out += '\n';
+    if (!flushClient(clientId, client))
+        dropClient(clientId);
+}
+
+void JobServer::acceptClients()
+{
+    while (true) {
+        int fd = accept4(listenFd_, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                GMP3ENC_LOGGER_ERROR("accept failed: %s.", strerror(errno));
+            break;
+        }
+
+        unsigned long id = nextClientId_++;
+        epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = id;
+        if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &event) == -1) {
+            GMP3ENC_LOGGER_ERROR("epoll_ctl failed: %s.", strerror(errno));
+            close(fd);
+            continue;
+        }
+
+        Client &client = clients_[id];
+        client.fd = fd;
+        client.pending = 0;
+        client.isInputClosed = false;
+        client.isWaitingOut = false;
+    }
+}
+
+bool JobServer::readClient(unsigned long id, Client &client, std::list<JobRequest> &requests)
+{
+    char buf[4096];
+    bool isEof = false;
+    while (true) {
+        ssize_t r = read(client.fd, buf, sizeof(buf));
+        if (r > 0) {
+            client.in.append(buf, r);
+            continue;
+        }
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (r == -1)
+            return false;
+        isEof = true;
+        break;
+    }
+
+    size_t start = 0;
+    size_t end;
+    while ((end = client.in.find('\n', start)) != std::string::npos) {
+        std::string line = client.in.substr(start, end - start);
+        start = end + 1;
+        if (!line.empty() && line[line.length() - 1] == '\r')
+            line.erase(line.length() - 1);
+        if (line.empty())
+            continue;
+
+        JobRequest request;
+        std::string error;
+        if (parseRequest(line, request, error)) {
+            request.clientId = id;
+            client.pending++;
+            requests.push_back(request);
+        } else {
+            std::string jobId = request.jobId.empty() ? "-" : request.jobId;
+            client.out += "error\t" + jobId + "\t" + error + "\n";
+        }
+    }
+    client.in.erase(0, start);
+    if (client.in.size() > MAX_LINE_SIZE)
+        return false;
+
+    // Client which has sent all its requests still waits for replies:
+    if (isEof) {
+        client.isInputClosed = true;
+        client.in.clear();
+    }
+    return flushClient(id, client);
+}
+
+bool JobServer::parseRequest(const std::string &line, JobRequest &request, std::string &error) const
+{
+    std::vector<std::string> fields;
+    JobListReader::splitFields(line, fields);
+
+    if (fields.size() > 1)
+        request.jobId = fields[1];
+    if (fields[0] == "cancel") {
+        if (fields.size() != 2 || fields[1].empty()) {
+            error = "bad request";
+            return false;
+        }
+        request.isCancel = true;
+        return true;
+    }
+    if (fields[0] != "encode") {
+        error = "unknown command";
+        return false;
+    }
+    if (fields.size() < 4 || fields.size() > 6 ||
+        fields[1].empty() || fields[2].empty() || fields[3].empty() ||
+        !JobListReader::parseJobOptions(fields, 4, request)) {
+        error = "bad request";
+        return false;
+    }
+
+    request.input = fields[2];
+    request.output = fields[3];
+    return true;
+}
+
+bool JobServer::flushClient(unsigned long id, Client &client)
+{
+    while (!client.out.empty()) {
+        ssize_t r = send(client.fd, client.out.data(), client.out.size(), MSG_NOSIGNAL);
+        if (r > 0) {
+            client.out.erase(0, r);
+            continue;
+        }
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        return false;
+    }
+
+    if (client.isInputClosed && !client.pending && client.out.empty())
+        return false;
+
+    // Closed input would be reported as readable all the time:
+    bool needOut = !client.out.empty();
+    if (needOut != client.isWaitingOut || client.isInputClosed) {
+        epoll_event event;
+        event.events = 0;
+        if (!client.isInputClosed)
+            event.events |= EPOLLIN;
+        if (needOut)
+            event.events |= EPOLLOUT;
+        event.data.u64 = id;
+        if (epoll_ctl(epollFd_, EPOLL_CTL_MOD, client.fd, &event) == -1)
+            return false;
+        client.isWaitingOut = needOut;
+    }
+    return true;
+}
+
+void JobServer::dropClient(unsigned long id)
+{
+    std::map<unsigned long, Client>::iterator it = clients_.find(id);
+    if (it == clients_.end())
+        return;
+
+    epoll_ctl(epollFd_, EPOLL_CTL_DEL, it->second.fd, NULL);
+    close(it->second.fd);
+    clients_.erase(it);
+}
+
+#endif
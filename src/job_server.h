@@ -0,0 +1,89 @@
+#ifndef GMP3ENC_JOB_SERVER_
+#define GMP3ENC_JOB_SERVER_
+
+#ifdef __linux__
+
+#include <stddef.h>
+#include <list>
+#include <map>
+#include <string>
+
+#include "job_list.h"
+
+namespace GMp3Enc {
+
+// Local job submission socket of the daemon mode. Clients send one
+// request per line, fields are separated by tabs:
+//
+//   encode <job-id> <input.wav> <output.mp3> [<profile> [<timeout-ms>]]
+//   cancel <job-id>
+//
+// Replies are sent when jobs are done, in completion order:
+//
+//   ok <job-id>
+//   error <job-id> <message>
+//
+// Cancel is answered at once, the canceled job replies with an error
+// when it stops:
+//
+//   canceled <job-id>
+//   error <job-id> unknown job
+//
+// All sockets are non-blocking, the server is driven by the event
+// loop of the management thread.
+class JobServer
+{
+public:
+    static const size_t MAX_LINE_SIZE = 8192;
+
+    JobServer();
+    ~JobServer();
+
+    // Stale socket file left by a previous daemon is replaced.
+    bool listen(const std::string &path);
+
+    // Readable when a client connects, sends data or can take the rest
+    // of its replies.
+    inline int eventFd() const { return epollFd_; }
+
+    // Non-blocking. Appends requests received since the last call,
+    // malformed ones are answered by the server.
+    void processEvents(std::list<JobRequest> &requests);
+
+    // The reply is dropped if the client has disconnected.
+    void reply(unsigned long clientId, const std::string &line);
+
+    inline size_t clientsCount() const { return clients_.size(); }
+
+private:
+    JobServer(const JobServer&);
+    JobServer& operator=(const JobServer&);
+
+    struct Client
+    {
+        int fd;
+        std::string in;
+        std::string out;
+        size_t pending;      // Requests without replies.
+        bool isInputClosed;  // Only replies are expected.
+        bool isWaitingOut;   // EPOLLOUT is enabled.
+    };
+
+    void acceptClients();
+    bool readClient(unsigned long id, Client &client, std::list<JobRequest> &requests);
+    bool parseRequest(const std::string &line, JobRequest &request, std::string &error) const;
+    bool flushClient(unsigned long id, Client &client);
+    void dropClient(unsigned long id);
+
+    std::string path_;
+    int listenFd_;
+    int epollFd_;
+    unsigned long nextClientId_;
+    std::map<unsigned long, Client> clients_;
+};
+
+}
+
+#endif
+
+#endif
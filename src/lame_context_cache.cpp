@@ -0,0 +1,114 @@
+#include "lame_context_cache.h"
+
+#include <lame/lame.h>
+
+#include "metrics.h"
+
+using namespace GMp3Enc;
+
+bool LameContextKey::operator==(const LameContextKey &other) const
+{
+    return samplesPerSec == other.samplesPerSec &&
+            channels == other.channels &&
+            isSegment == other.isSegment &&
+            writeVbrTag == other.writeVbrTag &&
+            profile == other.profile;
+}
+
+LameContextCache::LameContextCache(WorkerMetrics *metrics)
+    : metrics_(metrics)
+    , isLastHit_(false)
+{
+    ready_.reserve(CAPACITY);
+}
+
+LameContextCache::~LameContextCache()
+{
+    for (size_t i = 0; i < ready_.size(); i++)
+        lame_close(ready_[i].lame);
+}
+
+lame_t LameContextCache::acquire(const LameContextKey &key)
+{
+    for (size_t i = 0; i < ready_.size(); i++) {
+        if (ready_[i].key == key) {
+            lame_t lame = ready_[i].lame;
+            ready_.erase(ready_.begin() + i);
+            isLastHit_ = true;
+            if (metrics_)
+                metricAdd(&metrics_->lameContextHits, 1);
+            return lame;
+        }
+    }
+
+    // Wrong guess, the oldest context is dropped, so contexts of
+    // formats which don't come back leave the cache:
+    isLastHit_ = false;
+    if (!ready_.empty()) {
+        lame_close(ready_.front().lame);
+        ready_.erase(ready_.begin());
+    }
+    if (metrics_)
+        metricAdd(&metrics_->lameContextMisses, 1);
+    return create(key);
+}
+
+void LameContextCache::prepare(const LameContextKey &key)
+{
+    for (size_t i = 0; i < ready_.size(); i++) {
+        if (ready_[i].key == key)
+            return;
+    }
+
+    Entry e;
+    e.key = key;
+    e.lame = create(key);
+    if (!e.lame)
+        return;
+
+    if (ready_.size() >= CAPACITY) {
+        lame_close(ready_.front().lame);
+        ready_.erase(ready_.begin());
+    }
+    ready_.push_back(e);
+}
+
+lame_t LameContextCache::create(const LameContextKey &key)
+{
+    lame_t lame = lame_init();
+    if (!lame)
+        return NULL;
+
+    const EncodingProfile &profile = key.profile;
+    lame_set_findReplayGain(lame, profile.replayGain ? 1 : 0);
+    if (key.isSegment) {
+        // Every frame must be self-contained to cut and join segments:
+        lame_set_disable_reservoir(lame, 1);
+        lame_set_write_id3tag_automatic(lame, 0);
+        lame_set_out_samplerate(lame, key.samplesPerSec);
+    }
+    if (!key.writeVbrTag)
+        lame_set_bWriteVbrTag(lame, 0);
+    lame_set_in_samplerate(lame, key.samplesPerSec);
+    if (profile.mode == EncodingProfile::ModeVbr) {
+        lame_set_VBR(lame, vbr_mtrh);
+        lame_set_VBR_q(lame, profile.vbrQuality);
+    } else {
+        lame_set_VBR(lame, vbr_off);
+        lame_set_brate(lame, profile.bitrate);
+    }
+    if (key.channels == 1) {
+        lame_set_num_channels(lame, 1);
+        lame_set_mode(lame, MONO);
+    } else {
+        lame_set_num_channels(lame, key.channels);
+    }
+    lame_set_quality(lame, profile.quality);
+
+    if (lame_init_params(lame) < 0) {
+        lame_close(lame);
+        return NULL;
+    }
+
+    return lame;
+}
@@ -0,0 +1,83 @@
+#ifndef GMP3ENC_LAME_CONTEXT_CACHE_
+#define GMP3ENC_LAME_CONTEXT_CACHE_
+
+#include <stddef.h>
+#include <vector>
+
+#include "encoding_profile.h"
+
+struct lame_global_struct;
+typedef struct lame_global_struct lame_global_flags;
+typedef lame_global_flags *lame_t;
+
+namespace GMp3Enc {
+
+struct WorkerMetrics;
+
+// Parameters passed to lame_init_params(). Per-file parameters, which
+// can be set later, are not part of the key.
+struct LameContextKey
+{
+    LameContextKey()
+        : samplesPerSec(0)
+        , channels(0)
+        , isSegment(false)
+        , writeVbrTag(true)
+    {
+    }
+
+    bool operator==(const LameContextKey &other) const;
+
+    int samplesPerSec;
+    int channels;
+    bool isSegment;
+    bool writeVbrTag;
+    EncodingProfile profile;
+};
+
+// Lame context can't be reused after flushing, so the worker creates
+// a context for the next task in advance, after the previous task has
+// been reported. Batches of short files with the same format find
+// a ready context. Mixed formats miss it, then nothing is prepared
+// until the guess is right again. Used only by the owner worker thread.
+class LameContextCache
+{
+public:
+    // Enough for the outputs of a shared source adopted by one worker.
+    static const size_t CAPACITY = 4;
+
+    explicit LameContextCache(WorkerMetrics *metrics);
+    ~LameContextCache();
+
+    // Takes a ready context or creates a new one. Returns NULL if lame
+    // could not be initialized.
+    lame_t acquire(const LameContextKey &key);
+
+    // The last acquire() has found its context ready, or there was
+    // nothing prepared (cold cache). Preparing is useful only then.
+    inline bool isPredictable() const { return isLastHit_ || ready_.empty(); }
+
+    // Makes sure a context with the key is ready. The oldest context
+    // is dropped when the cache is full.
+    void prepare(const LameContextKey &key);
+
+    static lame_t create(const LameContextKey &key);
+
+private:
+    LameContextCache(const LameContextCache&);
+    LameContextCache& operator=(const LameContextCache&);
+
+    struct Entry
+    {
+        LameContextKey key;
+        lame_t lame;
+    };
+
+    std::vector<Entry> ready_;
+    WorkerMetrics *metrics_;
+    bool isLastHit_;
+};
+
+}
+
+#endif
@@ -0,0 +1,278 @@
+#include "manifest.h"
+
+#ifdef __linux__
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+
+#include "logging_utils.h"
+
+using namespace GMp3Enc;
+
+namespace {
+
+const char MANIFEST_MAGIC[8] = { 'G', 'M', 'P', '3', 'M', 'N', 'F', 'T' };
+const uint32_t MANIFEST_VERSION = 1;
+
+// Records are stored in the host byte order, a manifest written on
+// a machine with other byte order fails the version check:
+struct ManifestHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t count;
+    uint64_t reserved;
+};
+
+const size_t CONTENT_BLOCK_SIZE = 64 * 1024;
+
+uint64_t fnv1a(uint64_t h, const uint8_t *data, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        h ^= data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+const uint64_t FNV_OFFSET = 14695981039346656037ULL;
+
+}
+
+Manifest::Manifest()
+    : records_(NULL)
+    , count_(0)
+#ifdef __linux__
+    , map_(NULL)
+    , mapSize_(0)
+#endif
+{
+}
+
+Manifest::~Manifest()
+{
+    unload();
+}
+
+bool Manifest::load(const std::string &path)
+{
+    unload();
+    path_ = path;
+
+    FILE *f = fopen(path_.c_str(), "rb");
+    if (!f)
+        return true;
+
+    ManifestHeader header;
+    bool isok = fread(&header, sizeof(header), 1, f) == 1 &&
+            memcmp(header.magic, MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC)) == 0 &&
+            header.version == MANIFEST_VERSION &&
+            header.recordSize == sizeof(ManifestRecord);
+    long fileSize = -1;
+    if (isok && fseek(f, 0, SEEK_END) == 0)
+        fileSize = ftell(f);
+    if (fileSize < 0 ||
+        static_cast<uint64_t>(fileSize - sizeof(header)) / sizeof(ManifestRecord) < header.count)
+        isok = false;
+
+    if (!isok) {
+        fclose(f);
+        GMP3ENC_LOGGER_ERROR("Not a valid manifest file: %s", path_.c_str());
+        return false;
+    }
+
+    count_ = static_cast<size_t>(header.count);
+    if (!count_) {
+        fclose(f);
+        return true;
+    }
+
+#ifdef __linux__
+    mapSize_ = sizeof(header) + count_ * sizeof(ManifestRecord);
+    void *p = mmap(NULL, mapSize_, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    fclose(f);
+    if (p == MAP_FAILED) {
+        GMP3ENC_LOGGER_ERROR("Could not map manifest file: %s", path_.c_str());
+        map_ = NULL;
+        mapSize_ = 0;
+        count_ = 0;
+        return false;
+    }
+    map_ = p;
+    records_ = reinterpret_cast<const ManifestRecord*>(
+                static_cast<const uint8_t*>(map_) + sizeof(header));
+#else
+    buffer_.resize(count_);
+    isok = fseek(f, sizeof(header), SEEK_SET) == 0 &&
+            fread(&buffer_[0], sizeof(ManifestRecord), count_, f) == count_;
+    fclose(f);
+    if (!isok) {
+        GMP3ENC_LOGGER_ERROR("Could not read manifest file: %s", path_.c_str());
+        buffer_.clear();
+        count_ = 0;
+        return false;
+    }
+    records_ = &buffer_[0];
+#endif
+
+    return true;
+}
+
+void Manifest::unload()
+{
+#ifdef __linux__
+    if (map_)
+        munmap(map_, mapSize_);
+    map_ = NULL;
+    mapSize_ = 0;
+#else
+    buffer_.clear();
+#endif
+    records_ = NULL;
+    count_ = 0;
+}
+
+const ManifestRecord* Manifest::find(uint64_t pathHash) const
+{
+    std::map<uint64_t, ManifestRecord>::const_iterator it = updates_.find(pathHash);
+    if (it != updates_.end())
+        return &it->second;
+    if (removed_.count(pathHash))
+        return NULL;
+
+    size_t lo = 0;
+    size_t hi = count_;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (records_[mid].pathHash < pathHash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo < count_ && records_[lo].pathHash == pathHash)
+        return &records_[lo];
+    return NULL;
+}
+
+void Manifest::update(const ManifestRecord &record)
+{
+    removed_.erase(record.pathHash);
+    updates_[record.pathHash] = record;
+}
+
+void Manifest::remove(uint64_t pathHash)
+{
+    updates_.erase(pathHash);
+    removed_.insert(pathHash);
+}
+
+bool Manifest::save()
+{
+    if (path_.empty())
+        return false;
+    if (updates_.empty() && removed_.empty())
+        return true;
+
+    // Readers never see a partially written file:
+    std::string tmp = path_ + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (!f) {
+        GMP3ENC_LOGGER_ERROR("Could not open manifest file: %s", tmp.c_str());
+        return false;
+    }
+
+    ManifestHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC));
+    header.version = MANIFEST_VERSION;
+    header.recordSize = sizeof(ManifestRecord);
+    bool isok = fwrite(&header, sizeof(header), 1, f) == 1;
+
+    // Both sides are sorted by path hash, updated records win:
+    uint64_t count = 0;
+    size_t i = 0;
+    std::map<uint64_t, ManifestRecord>::const_iterator uit = updates_.begin();
+    while (isok && (i < count_ || uit != updates_.end())) {
+        const ManifestRecord *r;
+        if (uit == updates_.end() || (i < count_ && records_[i].pathHash < uit->first)) {
+            r = &records_[i++];
+            if (removed_.count(r->pathHash))
+                continue;
+        } else {
+            if (i < count_ && records_[i].pathHash == uit->first)
+                i++;
+            r = &uit->second;
+            ++uit;
+        }
+        isok = fwrite(r, sizeof(ManifestRecord), 1, f) == 1;
+        count++;
+    }
+
+    header.count = count;
+    if (isok)
+        isok = fseek(f, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, f) == 1;
+    if (fclose(f) != 0)
+        isok = false;
+
+    if (isok) {
+        std::string path = path_;
+        unload();
+#ifdef _WIN32
+        ::remove(path.c_str());
+#endif
+        isok = rename(tmp.c_str(), path.c_str()) == 0;
+        if (isok) {
+            updates_.clear();
+            removed_.clear();
+        }
+        load(path);
+    }
+
+    if (!isok) {
+        GMP3ENC_LOGGER_ERROR("Could not write manifest file: %s", path_.c_str());
+        ::remove(tmp.c_str());
+    }
+    return isok;
+}
+
+uint64_t Manifest::hash(const std::string &s)
+{
+    return fnv1a(FNV_OFFSET, reinterpret_cast<const uint8_t*>(s.data()), s.size());
+}
+
+bool Manifest::hashContent(const std::string &path, int64_t size, uint64_t &hash)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f)
+        return false;
+
+    std::vector<uint8_t> buf(CONTENT_BLOCK_SIZE);
+    hash = fnv1a(FNV_OFFSET, reinterpret_cast<const uint8_t*>(&size), sizeof(size));
+
+    size_t rb = fread(&buf[0], 1, buf.size(), f);
+    hash = fnv1a(hash, &buf[0], rb);
+
+    bool isok = !ferror(f);
+    if (isok && size > static_cast<int64_t>(2 * CONTENT_BLOCK_SIZE)) {
+        isok = fseek(f, -static_cast<long>(CONTENT_BLOCK_SIZE), SEEK_END) == 0;
+        if (isok) {
+            rb = fread(&buf[0], 1, buf.size(), f);
+            hash = fnv1a(hash, &buf[0], rb);
+            isok = !ferror(f);
+        }
+    }
+
+    fclose(f);
+
+    // 0 is reserved for "not computed":
+    if (!hash)
+        hash = 1;
+    return isok;
+}
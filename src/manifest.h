@@ -0,0 +1,75 @@
+#ifndef GMP3ENC_MANIFEST_
+#define GMP3ENC_MANIFEST_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace GMp3Enc {
+
+// State of a source file when its mp3 was produced. Paths and settings
+// are stored as hashes, so all records have the same size.
+struct ManifestRecord
+{
+    uint64_t pathHash;       // Source path relative to the input root.
+    uint64_t outputHash;     // Destination path.
+    uint64_t settingsHash;   // Encoder settings.
+    uint64_t contentHash;    // 0 - not computed.
+    int64_t sourceSize;
+    int64_t sourceMtimeNs;
+    uint64_t sourceInode;
+    int64_t outputSize;
+};
+
+// Persistent index of encoded files for incremental directory runs.
+// The file is a header followed by records sorted by path hash. It is
+// mapped into memory and searched in place, changes are kept aside and
+// merged into a new file on save.
+class Manifest
+{
+public:
+    Manifest();
+    ~Manifest();
+
+    // Missing file gives an empty manifest.
+    bool load(const std::string &path);
+    bool save();
+
+    const ManifestRecord* find(uint64_t pathHash) const;
+    void update(const ManifestRecord &record);
+    void remove(uint64_t pathHash);
+
+    inline size_t size() const { return count_; }
+    inline std::string path() const { return path_; }
+
+    static uint64_t hash(const std::string &s);
+
+    // Hash of the file size and its first and last blocks. Catches
+    // rewritten files with preserved mtime, not a full checksum.
+    static bool hashContent(const std::string &path, int64_t size, uint64_t &hash);
+
+private:
+    Manifest(const Manifest&);
+    Manifest& operator=(const Manifest&);
+
+    void unload();
+
+    std::string path_;
+    const ManifestRecord *records_;
+    size_t count_;
+#ifdef __linux__
+    void *map_;
+    size_t mapSize_;
+#else
+    std::vector<ManifestRecord> buffer_;
+#endif
+    std::map<uint64_t, ManifestRecord> updates_;
+    std::set<uint64_t> removed_;
+};
+
+}
+
+#endif
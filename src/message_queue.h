@@ -2,6 +2,11 @@
 #define GMP3ENC_MESSAGE_QUEUE_
 
 #include <pthread.h>
+#ifdef __linux__
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
 #include <queue>
 #include <list>
 
@@ -60,11 +65,18 @@ public:
     MessageQueue()
         : isInitialized_(false)
         , isValid_(false)
+#ifdef __linux__
+        , eventFd_(-1)
+#endif
     {
     }
 
     ~MessageQueue()
     {
+#ifdef __linux__
+        if (eventFd_ != -1)
+            close(eventFd_);
+#endif
         if (isInitialized_) {
             pthread_cond_destroy(&q_condv_);
             pthread_mutex_destroy(&q_mutex_);
@@ -136,7 +148,40 @@ public:
         MutexGuard g(&q_mutex_);
         queue_.push(item);
         pthread_cond_signal(&q_condv_);
+        g.unlock();
+
+#ifdef __linux__
+        if (eventFd_ != -1) {
+            uint64_t v = 1;
+            ssize_t r = write(eventFd_, &v, sizeof(v));
+            (void)r;
+        }
+#endif
+    }
+
+#ifdef __linux__
+    // Creates eventfd which becomes readable when a message is sent,
+    // so the receiver can wait for messages in epoll.
+    bool enableEventFd()
+    {
+        if (eventFd_ == -1)
+            eventFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        return eventFd_ != -1;
+    }
+
+    inline int eventFd() const { return eventFd_; }
+
+    // Must be called before receiving, so messages sent after
+    // receiving signal the eventfd again.
+    void clearEvent()
+    {
+        if (eventFd_ != -1) {
+            uint64_t v;
+            ssize_t r = read(eventFd_, &v, sizeof(v));
+            (void)r;
+        }
     }
+#endif
 
     void invalidate()
     {
@@ -162,6 +207,9 @@ private:
     std::queue<T> queue_;
     pthread_mutex_t q_mutex_;
     pthread_cond_t  q_condv_;
+#ifdef __linux__
+    int eventFd_;
+#endif
 };
 
 }
@@ -0,0 +1,295 @@
+#include "metrics.h"
+
+#ifdef __linux__
+#include <time.h>
+#elif defined(_WIN32)
+#include <Windows.h>
+#endif
+#include <sstream>
+
+using namespace GMp3Enc;
+
+static const char* const RESULT_NAMES[ManagerMetrics::RESULTS_COUNT] = {
+    "success",
+    "bad_source",
+    "bad_destination",
+    "system_error",
+    "canceled"
+};
+
+static double toSeconds(long long us)
+{
+    return us / 1e6;
+}
+
+LatencyHistogram::LatencyHistogram()
+    : sumUs_(0)
+{
+    for (int i = 0; i <= BUCKETS_COUNT; i++)
+        counts_[i] = 0;
+}
+
+void LatencyHistogram::record(long long us)
+{
+    int i = 0;
+    while (i < BUCKETS_COUNT && us > bucketBound(i))
+        i++;
+    metricAdd(&counts_[i], 1);
+    metricAdd(&sumUs_, us);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other)
+{
+    for (int i = 0; i <= BUCKETS_COUNT; i++)
+        metricAdd(&counts_[i], other.count(i));
+    metricAdd(&sumUs_, other.sumUs());
+}
+
+long long LatencyHistogram::bucketBound(int i)
+{
+    return 100LL << i;
+}
+
+long long LatencyHistogram::count(int i) const
+{
+    return atomicLoadRelaxed(&counts_[i]);
+}
+
+long long LatencyHistogram::sumUs() const
+{
+    return atomicLoadRelaxed(&sumUs_);
+}
+
+long long LatencyHistogram::totalCount() const
+{
+    long long n = 0;
+    for (int i = 0; i <= BUCKETS_COUNT; i++)
+        n += count(i);
+    return n;
+}
+
+WorkerMetrics::WorkerMetrics()
+    : busyUs(0)
+    , idleUs(0)
+    , busySinceUs(0)
+    , idleSinceUs(0)
+    , tasksStarted(0)
+    , lameContextHits(0)
+    , lameContextMisses(0)
+{
+}
+
+ManagerMetrics::ManagerMetrics()
+    : tasksSubmitted(0)
+    , bytesIn(0)
+    , bytesOut(0)
+    , shutdownUs(0)
+{
+    for (int i = 0; i < RESULTS_COUNT; i++)
+        results[i] = 0;
+}
+
+MetricsRegistry::MetricsRegistry(size_t workersCount)
+    : workers_(workersCount)
+    , startUs_(nowUs())
+{
+}
+
+std::string MetricsRegistry::prometheusText() const
+{
+    LatencyHistogram queueWait;
+    LatencyHistogram encodeLatency;
+    LatencyHistogram cancelLatency;
+    mergeHistograms(queueWait, encodeLatency, cancelLatency);
+
+    std::ostringstream ss;
+    ss << "# HELP gmp3enc_uptime_seconds Time since the encoder start.\n"
+       << "# TYPE gmp3enc_uptime_seconds gauge\n"
+       << "gmp3enc_uptime_seconds " << toSeconds(nowUs() - startUs_) << "\n";
+
+    ss << "# HELP gmp3enc_task_queue_depth Submitted tasks not started yet.\n"
+       << "# TYPE gmp3enc_task_queue_depth gauge\n"
+       << "gmp3enc_task_queue_depth " << queueDepth() << "\n";
+
+    ss << "# HELP gmp3enc_tasks_submitted_total Submitted encoding tasks.\n"
+       << "# TYPE gmp3enc_tasks_submitted_total counter\n"
+       << "gmp3enc_tasks_submitted_total "
+       << atomicLoadRelaxed(&manager_.tasksSubmitted) << "\n";
+
+    ss << "# HELP gmp3enc_tasks_completed_total Completed tasks by result.\n"
+       << "# TYPE gmp3enc_tasks_completed_total counter\n";
+    for (int i = 0; i < ManagerMetrics::RESULTS_COUNT; i++) {
+        ss << "gmp3enc_tasks_completed_total{result=\"" << RESULT_NAMES[i] << "\"} "
+           << atomicLoadRelaxed(&manager_.results[i]) << "\n";
+    }
+
+    ss << "# HELP gmp3enc_input_bytes_total PCM bytes of completed tasks.\n"
+       << "# TYPE gmp3enc_input_bytes_total counter\n"
+       << "gmp3enc_input_bytes_total " << atomicLoadRelaxed(&manager_.bytesIn) << "\n";
+
+    ss << "# HELP gmp3enc_output_bytes_total MP3 bytes of completed tasks.\n"
+       << "# TYPE gmp3enc_output_bytes_total counter\n"
+       << "gmp3enc_output_bytes_total " << atomicLoadRelaxed(&manager_.bytesOut) << "\n";
+
+    ss << "# HELP gmp3enc_shutdown_seconds Time to interrupt running tasks and stop workers.\n"
+       << "# TYPE gmp3enc_shutdown_seconds gauge\n"
+       << "gmp3enc_shutdown_seconds " << toSeconds(atomicLoadRelaxed(&manager_.shutdownUs)) << "\n";
+
+    long long now = nowUs();
+    ss << "# HELP gmp3enc_worker_busy_seconds_total Time spent in tasks.\n"
+       << "# TYPE gmp3enc_worker_busy_seconds_total counter\n";
+    for (size_t i = 0; i < workers_.size(); i++) {
+        const WorkerMetrics &w = workers_[i];
+        ss << "gmp3enc_worker_busy_seconds_total{worker=\"" << i << "\"} "
+           << toSeconds(atomicLoadRelaxed(&w.busyUs) + currentPeriod(&w.busySinceUs, now))
+           << "\n";
+    }
+
+    ss << "# HELP gmp3enc_worker_idle_seconds_total Time spent waiting for tasks.\n"
+       << "# TYPE gmp3enc_worker_idle_seconds_total counter\n";
+    for (size_t i = 0; i < workers_.size(); i++) {
+        const WorkerMetrics &w = workers_[i];
+        ss << "gmp3enc_worker_idle_seconds_total{worker=\"" << i << "\"} "
+           << toSeconds(atomicLoadRelaxed(&w.idleUs) + currentPeriod(&w.idleSinceUs, now))
+           << "\n";
+    }
+
+    ss << "# HELP gmp3enc_lame_contexts_total Lame contexts taken ready or created by tasks.\n"
+       << "# TYPE gmp3enc_lame_contexts_total counter\n";
+    for (size_t i = 0; i < workers_.size(); i++) {
+        const WorkerMetrics &w = workers_[i];
+        ss << "gmp3enc_lame_contexts_total{worker=\"" << i << "\",cache=\"hit\"} "
+           << atomicLoadRelaxed(&w.lameContextHits) << "\n"
+           << "gmp3enc_lame_contexts_total{worker=\"" << i << "\",cache=\"miss\"} "
+           << atomicLoadRelaxed(&w.lameContextMisses) << "\n";
+    }
+
+    const LatencyHistogram *histograms[3] = { &queueWait, &encodeLatency, &cancelLatency };
+    const char *names[3] = {
+        "gmp3enc_task_queue_wait_seconds",
+        "gmp3enc_task_encode_seconds",
+        "gmp3enc_task_cancel_seconds"
+    };
+    const char *helps[3] = {
+        "Time from task submission to its start.",
+        "Time from task start to the end of encoding.",
+        "Time from cancellation or deadline to the stop of the running task."
+    };
+    for (int h = 0; h < 3; h++) {
+        ss << "# HELP " << names[h] << " " << helps[h] << "\n"
+           << "# TYPE " << names[h] << " histogram\n";
+        long long cumulative = 0;
+        for (int i = 0; i <= LatencyHistogram::BUCKETS_COUNT; i++) {
+            cumulative += histograms[h]->count(i);
+            ss << names[h] << "_bucket{le=\"";
+            if (i < LatencyHistogram::BUCKETS_COUNT)
+                ss << toSeconds(LatencyHistogram::bucketBound(i));
+            else
+                ss << "+Inf";
+            ss << "\"} " << cumulative << "\n";
+        }
+        ss << names[h] << "_sum " << toSeconds(histograms[h]->sumUs()) << "\n"
+           << names[h] << "_count " << cumulative << "\n";
+    }
+
+    return ss.str();
+}
+
+std::string MetricsRegistry::json() const
+{
+    LatencyHistogram queueWait;
+    LatencyHistogram encodeLatency;
+    LatencyHistogram cancelLatency;
+    mergeHistograms(queueWait, encodeLatency, cancelLatency);
+
+    std::ostringstream ss;
+    ss << "{\"uptime_seconds\": " << toSeconds(nowUs() - startUs_)
+       << ", \"task_queue_depth\": " << queueDepth()
+       << ", \"tasks_submitted\": " << atomicLoadRelaxed(&manager_.tasksSubmitted)
+       << ", \"tasks_completed\": {";
+    for (int i = 0; i < ManagerMetrics::RESULTS_COUNT; i++) {
+        ss << (i ? ", " : "") << "\"" << RESULT_NAMES[i] << "\": "
+           << atomicLoadRelaxed(&manager_.results[i]);
+    }
+    ss << "}, \"input_bytes\": " << atomicLoadRelaxed(&manager_.bytesIn)
+       << ", \"output_bytes\": " << atomicLoadRelaxed(&manager_.bytesOut)
+       << ", \"shutdown_seconds\": " << toSeconds(atomicLoadRelaxed(&manager_.shutdownUs))
+       << ", \"workers\": [";
+    long long now = nowUs();
+    for (size_t i = 0; i < workers_.size(); i++) {
+        const WorkerMetrics &w = workers_[i];
+        ss << (i ? ", " : "")
+           << "{\"busy_seconds\": "
+           << toSeconds(atomicLoadRelaxed(&w.busyUs) + currentPeriod(&w.busySinceUs, now))
+           << ", \"idle_seconds\": "
+           << toSeconds(atomicLoadRelaxed(&w.idleUs) + currentPeriod(&w.idleSinceUs, now))
+           << ", \"tasks_started\": " << atomicLoadRelaxed(&w.tasksStarted)
+           << ", \"lame_context_hits\": " << atomicLoadRelaxed(&w.lameContextHits)
+           << ", \"lame_context_misses\": " << atomicLoadRelaxed(&w.lameContextMisses)
+           << "}";
+    }
+    ss << "]";
+
+    const LatencyHistogram *histograms[3] = { &queueWait, &encodeLatency, &cancelLatency };
+    const char *names[3] = { "queue_wait_seconds", "encode_seconds", "cancel_seconds" };
+    for (int h = 0; h < 3; h++) {
+        ss << ", \"" << names[h] << "\": {\"buckets\": [";
+        for (int i = 0; i <= LatencyHistogram::BUCKETS_COUNT; i++) {
+            ss << (i ? ", " : "") << "{\"le\": ";
+            if (i < LatencyHistogram::BUCKETS_COUNT)
+                ss << toSeconds(LatencyHistogram::bucketBound(i));
+            else
+                ss << "\"+Inf\"";
+            ss << ", \"count\": " << histograms[h]->count(i) << "}";
+        }
+        ss << "], \"sum\": " << toSeconds(histograms[h]->sumUs())
+           << ", \"count\": " << histograms[h]->totalCount() << "}";
+    }
+    ss << "}\n";
+
+    return ss.str();
+}
+
+long long MetricsRegistry::nowUs()
+{
+#ifdef __linux__
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+#elif defined(_WIN32)
+    LARGE_INTEGER freq;
+    LARGE_INTEGER counter;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&counter);
+    return counter.QuadPart * 1000000LL / freq.QuadPart;
+#else
+    return 0;
+#endif
+}
+
+long long MetricsRegistry::queueDepth() const
+{
+    long long started = 0;
+    for (size_t i = 0; i < workers_.size(); i++)
+        started += atomicLoadRelaxed(&workers_[i].tasksStarted);
+    long long depth = atomicLoadRelaxed(&manager_.tasksSubmitted) - started;
+    return depth > 0 ? depth : 0;
+}
+
+long long MetricsRegistry::currentPeriod(const volatile long long *sinceUs, long long nowUs)
+{
+    long long since = atomicLoadRelaxed(sinceUs);
+    return since && nowUs > since ? nowUs - since : 0;
+}
+
+void MetricsRegistry::mergeHistograms(
+        LatencyHistogram &queueWait,
+        LatencyHistogram &encodeLatency,
+        LatencyHistogram &cancelLatency) const
+{
+    for (size_t i = 0; i < workers_.size(); i++) {
+        queueWait.merge(workers_[i].queueWait);
+        encodeLatency.merge(workers_[i].encodeLatency);
+        cancelLatency.merge(workers_[i].cancelLatency);
+    }
+}
@@ -0,0 +1,110 @@
+#ifndef GMP3ENC_METRICS_
+#define GMP3ENC_METRICS_
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#include "atomic_utils.h"
+
+namespace GMp3Enc {
+
+// Every metric slot has a single writer thread, so it is updated by
+// relaxed load and store without locks or read-modify-write operations.
+// Readers may see a slightly stale value.
+inline void metricAdd(volatile long long *p, long long v)
+{
+    atomicStoreRelaxed(p, atomicLoadRelaxed(p) + v);
+}
+
+// Latency histogram with exponential buckets: 100us * 2^i.
+class LatencyHistogram
+{
+public:
+    static const int BUCKETS_COUNT = 20;
+
+    LatencyHistogram();
+
+    void record(long long us);
+
+    // Adds values of other histogram, used for snapshots.
+    void merge(const LatencyHistogram &other);
+
+    // Upper bound of the bucket in microseconds, the last one is infinite.
+    static long long bucketBound(int i);
+
+    long long count(int i) const;
+    long long sumUs() const;
+    long long totalCount() const;
+
+private:
+    volatile long long counts_[BUCKETS_COUNT + 1];
+    volatile long long sumUs_;
+};
+
+// Metrics updated by one worker thread.
+struct WorkerMetrics
+{
+    WorkerMetrics();
+
+    // Completed periods, the current one starts at busySinceUs
+    // or idleSinceUs (the other one is 0):
+    volatile long long busyUs;
+    volatile long long idleUs;
+    volatile long long busySinceUs;
+    volatile long long idleSinceUs;
+    volatile long long tasksStarted;
+    volatile long long lameContextHits;
+    volatile long long lameContextMisses;
+    LatencyHistogram queueWait;
+    LatencyHistogram encodeLatency;
+    LatencyHistogram cancelLatency;  // From cancel or deadline to the stop.
+
+    // Workers are updated concurrently, no false sharing:
+    char padding[64];
+};
+
+// Metrics updated by the management thread.
+struct ManagerMetrics
+{
+    static const int RESULTS_COUNT = 5;
+
+    ManagerMetrics();
+
+    volatile long long tasksSubmitted;
+    volatile long long bytesIn;
+    volatile long long bytesOut;
+    volatile long long results[RESULTS_COUNT]; // By EncodingTask::EncodingResult.
+    volatile long long shutdownUs;  // Time to interrupt tasks and stop workers.
+};
+
+class MetricsRegistry
+{
+public:
+    explicit MetricsRegistry(size_t workersCount);
+
+    inline WorkerMetrics& worker(size_t index) { return workers_[index]; }
+    inline ManagerMetrics& manager() { return manager_; }
+
+    std::string prometheusText() const;
+    std::string json() const;
+
+    // Monotonic time in microseconds.
+    static long long nowUs();
+
+private:
+    long long queueDepth() const;
+    static long long currentPeriod(const volatile long long *sinceUs, long long nowUs);
+    void mergeHistograms(
+            LatencyHistogram &queueWait,
+            LatencyHistogram &encodeLatency,
+            LatencyHistogram &cancelLatency) const;
+
+    std::vector<WorkerMetrics> workers_;
+    ManagerMetrics manager_;
+    long long startUs_;
+};
+
+}
+
+#endif
@@ -0,0 +1,189 @@
+#include "mp3_segment.h"
+
+#include <string.h>
+#include <sstream>
+
+#include "riff_wave.h"
+#include "output_writer.h"
+
+using namespace GMp3Enc;
+
+static const int MPEG1_L3_BITRATES[16] = {
+    0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0
+};
+
+static const int MPEG2_L3_BITRATES[16] = {
+    0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0
+};
+
+static const int MPEG_SAMPLERATES[4][3] = {
+    { 11025, 12000, 8000 },  // MPEG 2.5
+    { 0, 0, 0 },             // reserved
+    { 22050, 24000, 16000 }, // MPEG 2
+    { 44100, 48000, 32000 }  // MPEG 1
+};
+
+Mp3SegmentFilter::Mp3SegmentFilter()
+    : frameIndex_(0)
+    , skipFrames_(0)
+    , keepFrames_(0)
+{
+}
+
+void Mp3SegmentFilter::reset(const EncodingSegment &segment)
+{
+    pending_.clear();
+    frameIndex_ = 0;
+    skipFrames_ = segment.skipFrames;
+    keepFrames_ = segment.keepFrames;
+}
+
+bool Mp3SegmentFilter::write(const uint8_t *data, size_t size, OutputFile *f)
+{
+    pending_.insert(pending_.end(), data, data + size);
+
+    size_t pos = 0;
+    size_t outBegin = 0;
+    size_t outEnd = 0;
+    while (pending_.size() - pos >= 4) {
+        size_t len = frameLength(&pending_[pos]);
+        if (!len)
+            return false;
+        if (pending_.size() - pos < len)
+            break;
+
+        bool keep = frameIndex_ >= skipFrames_ &&
+                (!keepFrames_ || frameIndex_ < skipFrames_ + keepFrames_);
+        if (keep) {
+            if (outEnd != pos)
+                outBegin = pos;
+            outEnd = pos + len;
+        } else if (outEnd > outBegin) {
+            if (!f->write(&pending_[outBegin], outEnd - outBegin))
+                return false;
+            outBegin = outEnd = 0;
+        }
+
+        frameIndex_++;
+        pos += len;
+    }
+
+    if (outEnd > outBegin) {
+        if (!f->write(&pending_[outBegin], outEnd - outBegin))
+            return false;
+    }
+
+    pending_.erase(pending_.begin(), pending_.begin() + pos);
+    return true;
+}
+
+bool Mp3SegmentFilter::planSegments(
+        const RiffWave &wave,
+        int maxSegments,
+        std::vector<EncodingSegment> &segments)
+{
+    segments.clear();
+
+    int frameSize = mp3FrameSize(wave.samplesPerSec());
+    if (!frameSize || maxSegments < 2)
+        return false;
+
+    unsigned long numSamples = wave.numSamples();
+    unsigned long totalFrames = (numSamples + frameSize - 1) / frameSize;
+    unsigned long count = totalFrames / SEGMENT_MIN_FRAMES;
+    if (count > static_cast<unsigned long>(maxSegments))
+        count = maxSegments;
+    if (count < 2)
+        return false;
+
+    unsigned long framesPerSegment = totalFrames / count;
+    for (unsigned long i = 0; i < count; i++) {
+        bool isLast = i + 1 == count;
+        unsigned long beginFrame = i * framesPerSegment;
+        unsigned long endFrame = isLast ? totalFrames : beginFrame + framesPerSegment;
+        unsigned long startFrame = i ? beginFrame - SEGMENT_PRIMING_FRAMES : 0;
+
+        unsigned long endSample = numSamples;
+        if (!isLast && (endFrame + SEGMENT_TAIL_FRAMES) * frameSize < numSamples)
+            endSample = (endFrame + SEGMENT_TAIL_FRAMES) * frameSize;
+
+        EncodingSegment s;
+        s.index = i;
+        s.count = count;
+        s.frameSize = frameSize;
+        s.firstSample = startFrame * frameSize;
+        s.numSamples = endSample - s.firstSample;
+        s.skipFrames = beginFrame - startFrame;
+        s.keepFrames = isLast ? 0 : endFrame - beginFrame;
+        segments.push_back(s);
+    }
+
+    return true;
+}
+
+int Mp3SegmentFilter::mp3FrameSize(int samplesPerSec)
+{
+    for (int v = 0; v < 4; v++) {
+        for (int i = 0; i < 3; i++) {
+            if (MPEG_SAMPLERATES[v][i] == samplesPerSec)
+                return v == 3 ? 1152 : 576;
+        }
+    }
+    return 0;
+}
+
+std::string Mp3SegmentFilter::segmentFileName(const std::string &mp3Destination, int index)
+{
+    std::ostringstream ss;
+    ss << mp3Destination << ".part" << index;
+    return ss.str();
+}
+
+bool Mp3SegmentFilter::appendSegmentFile(FILE *dst, const std::string &segmentPath)
+{
+    FILE *src = fopen(segmentPath.c_str(), "rb");
+    if (!src)
+        return false;
+
+    bool isok = true;
+    std::vector<uint8_t> buf(1 << 16);
+    while (true) {
+        size_t rb = fread(&buf[0], 1, buf.size(), src);
+        if (rb && fwrite(&buf[0], 1, rb, dst) != rb) {
+            isok = false;
+            break;
+        }
+        if (rb < buf.size()) {
+            isok = !ferror(src);
+            break;
+        }
+    }
+
+    fclose(src);
+    return isok;
+}
+
+size_t Mp3SegmentFilter::frameLength(const uint8_t *header)
+{
+    if (header[0] != 0xFF || (header[1] & 0xE0) != 0xE0)
+        return 0;
+
+    int version = (header[1] >> 3) & 0x03;
+    int layer = (header[1] >> 1) & 0x03;
+    int bitrateIndex = header[2] >> 4;
+    int samplerateIndex = (header[2] >> 2) & 0x03;
+    int padding = (header[2] >> 1) & 0x01;
+
+    // Only layer III, what lame produces:
+    if (version == 1 || layer != 1 || samplerateIndex == 3)
+        return 0;
+
+    int samplerate = MPEG_SAMPLERATES[version][samplerateIndex];
+    if (version == 3) {
+        int bitrate = MPEG1_L3_BITRATES[bitrateIndex];
+        return bitrate ? 144000 * bitrate / samplerate + padding : 0;
+    }
+
+    int bitrate = MPEG2_L3_BITRATES[bitrateIndex];
+    return bitrate ? 72000 * bitrate / samplerate + padding : 0;
+}
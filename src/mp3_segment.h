@@ -0,0 +1,87 @@
+#ifndef GMP3ENC_MP3_SEGMENT_
+#define GMP3ENC_MP3_SEGMENT_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+namespace GMp3Enc {
+
+class RiffWave;
+class OutputFile;
+
+// Describes a part of a wave file which is encoded by its own lame instance.
+// Every segment (except the first one) starts a few mp3 frames earlier than
+// its real position, so the encoder is primed with the preceding audio.
+// mp3 frames produced from these priming samples are dropped and the rest
+// frames are joined into one stream.
+struct EncodingSegment
+{
+    EncodingSegment()
+        : index(0)
+        , count(0)
+        , frameSize(0)
+        , firstSample(0)
+        , numSamples(0)
+        , skipFrames(0)
+        , keepFrames(0)
+    {
+    }
+
+    inline bool isSegment() const { return count > 0; }
+    inline bool isLast() const { return index + 1 == count; }
+
+    // Samples of the file which belong to the segment. Priming and
+    // tail samples overlap the neighbours and are not included.
+    inline unsigned long primingSamples() const { return skipFrames * frameSize; }
+    inline unsigned long ownSamples() const
+    {
+        return isLast() ? numSamples - primingSamples() : keepFrames * frameSize;
+    }
+
+    int index;
+    int count;                  // 0 - whole file encoding.
+    int frameSize;              // Samples per mp3 frame.
+    unsigned long firstSample;  // First sample passed to the encoder.
+    unsigned long numSamples;   // Samples passed to the encoder.
+    unsigned long skipFrames;   // Priming frames to be dropped.
+    unsigned long keepFrames;   // Frames to be kept. 0 - all remaining.
+};
+
+class Mp3SegmentFilter
+{
+public:
+    static const int SEGMENT_PRIMING_FRAMES = 4;
+    static const int SEGMENT_TAIL_FRAMES = 2;
+    static const int SEGMENT_MIN_FRAMES = 512;
+
+    Mp3SegmentFilter();
+
+    void reset(const EncodingSegment &segment);
+
+    // Takes encoder output and writes only frames which belong to
+    // the segment. Incomplete frames are kept until next call.
+    bool write(const uint8_t *data, size_t size, OutputFile *f);
+
+    static bool planSegments(
+            const RiffWave &wave,
+            int maxSegments,
+            std::vector<EncodingSegment> &segments);
+
+    static int mp3FrameSize(int samplesPerSec);
+    static std::string segmentFileName(const std::string &mp3Destination, int index);
+    static bool appendSegmentFile(FILE *dst, const std::string &segmentPath);
+
+private:
+    static size_t frameLength(const uint8_t *header);
+
+    std::vector<uint8_t> pending_;
+    unsigned long frameIndex_;
+    unsigned long skipFrames_;
+    unsigned long keepFrames_;
+};
+
+}
+
+#endif
@@ -0,0 +1,151 @@
+#include "notification_channel.h"
+
+#ifdef __linux__
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+#include <new>
+
+#include "atomic_utils.h"
+#include "message_queue.h"
+
+using namespace GMp3Enc;
+
+NotificationRing::NotificationRing(size_t capacity)
+    : head_(0)
+    , tail_(0)
+    , cachedHead_(0)
+    , overflowCount_(0)
+{
+    capacity = roundUpPowerOfTwo(capacity);
+    buffer_ = new EncodingNotification[capacity];
+    mask_ = static_cast<long>(capacity) - 1;
+    pthread_mutex_init(&overflowMutex_, NULL);
+}
+
+NotificationRing::~NotificationRing()
+{
+    pthread_mutex_destroy(&overflowMutex_);
+    delete[] buffer_;
+}
+
+void NotificationRing::push(const EncodingNotification &ntf)
+{
+    // While the overflow list is not empty the ring is bypassed,
+    // otherwise newer notifications would be read first:
+    if (!atomicLoadRelaxed(&overflowCount_)) {
+        long t = tail_;
+        if (t - cachedHead_ > mask_)
+            cachedHead_ = atomicLoadAcquire(&head_);
+        if (t - cachedHead_ <= mask_) {
+            buffer_[t & mask_] = ntf;
+            atomicStoreRelease(&tail_, t + 1);
+            return;
+        }
+    }
+
+    MutexGuard g(&overflowMutex_);
+    overflow_.push_back(ntf);
+    atomicStoreRelease(&overflowCount_, static_cast<long>(overflow_.size()));
+}
+
+void NotificationRing::popAll(std::vector<EncodingNotification> &ntfs)
+{
+    // The overflow is checked first, ring notifications pushed before
+    // it are visible then:
+    bool hasOverflow = atomicLoadAcquire(&overflowCount_) != 0;
+
+    long h = head_;
+    long t = atomicLoadAcquire(&tail_);
+    for (; h != t; h++)
+        ntfs.push_back(buffer_[h & mask_]);
+    atomicStoreRelease(&head_, h);
+
+    if (hasOverflow) {
+        MutexGuard g(&overflowMutex_);
+        ntfs.insert(ntfs.end(), overflow_.begin(), overflow_.end());
+        overflow_.clear();
+        atomicStoreRelease(&overflowCount_, 0L);
+    }
+}
+
+NotificationChannel::NotificationChannel(size_t producersCount)
+    : producersCount_(producersCount)
+#ifdef __linux__
+    , isSignaled_(0)
+    , eventFd_(-1)
+#endif
+{
+}
+
+NotificationChannel::~NotificationChannel()
+{
+#ifdef __linux__
+    if (eventFd_ != -1)
+        close(eventFd_);
+#endif
+    for (size_t i = 0; i < rings_.size(); i++)
+        delete rings_[i];
+}
+
+bool NotificationChannel::init()
+{
+    if (!rings_.empty())
+        return true;
+
+    try {
+        for (size_t i = 0; i < producersCount_; i++)
+            rings_.push_back(new NotificationRing(RING_CAPACITY));
+    } catch(std::bad_alloc &e) {
+        for (size_t i = 0; i < rings_.size(); i++)
+            delete rings_[i];
+        rings_.clear();
+        return false;
+    }
+    return true;
+}
+
+void NotificationChannel::send(size_t producer, const EncodingNotification &ntf)
+{
+    rings_[producer]->push(ntf);
+
+#ifdef __linux__
+    // A burst of notifications wakes the consumer once:
+    if (eventFd_ != -1 && !atomicExchange(&isSignaled_, 1L)) {
+        uint64_t v = 1;
+        ssize_t r = write(eventFd_, &v, sizeof(v));
+        (void)r;
+    }
+#endif
+}
+
+void NotificationChannel::recvAll(std::vector<EncodingNotification> &ntfs)
+{
+    for (size_t i = rings_.size(); i > 0; i--)
+        rings_[i - 1]->popAll(ntfs);
+}
+
+#ifdef __linux__
+
+bool NotificationChannel::enableEventFd()
+{
+    if (eventFd_ == -1)
+        eventFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return eventFd_ != -1;
+}
+
+void NotificationChannel::clearEvent()
+{
+    if (eventFd_ == -1)
+        return;
+
+    // The flag is reset after the eventfd is read, a producer which
+    // sees it reset writes the eventfd again:
+    uint64_t v;
+    ssize_t r = read(eventFd_, &v, sizeof(v));
+    (void)r;
+    atomicExchange(&isSignaled_, 0L);
+}
+
+#endif
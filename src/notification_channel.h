@@ -0,0 +1,91 @@
+#ifndef GMP3ENC_NOTIFICATION_CHANNEL_
+#define GMP3ENC_NOTIFICATION_CHANNEL_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <vector>
+
+#include "encoding_task.h"
+
+namespace GMp3Enc {
+
+// Bounded single-producer single-consumer ring. If the consumer falls
+// behind, notifications are kept in an overflow list until it catches up,
+// so the producer never blocks and the order is preserved.
+class NotificationRing
+{
+public:
+    explicit NotificationRing(size_t capacity);
+    ~NotificationRing();
+
+    void push(const EncodingNotification &ntf);
+
+    // Appends all pushed notifications to ntfs.
+    void popAll(std::vector<EncodingNotification> &ntfs);
+
+private:
+    NotificationRing(const NotificationRing&);
+    NotificationRing& operator=(const NotificationRing&);
+
+    // head_ is advanced by the consumer, tail_ by the producer:
+    volatile long head_;
+    char headPadding_[64 - sizeof(long)];
+    volatile long tail_;
+    long cachedHead_;
+    char tailPadding_[64 - 2 * sizeof(long)];
+    EncodingNotification *buffer_;
+    long mask_;
+
+    pthread_mutex_t overflowMutex_;
+    volatile long overflowCount_;
+    std::vector<EncodingNotification> overflow_;
+};
+
+// Notifications from workers and the output writer to the main thread.
+// Every producer has its own ring, sending takes no lock and allocates
+// nothing. The main thread drains all rings in one pass.
+class NotificationChannel
+{
+public:
+    static const size_t RING_CAPACITY = 1024;
+
+    explicit NotificationChannel(size_t producersCount);
+    ~NotificationChannel();
+
+    bool init();
+    inline bool isInitialized() const { return !rings_.empty(); }
+
+    // Only one thread may send as the given producer.
+    void send(size_t producer, const EncodingNotification &ntf);
+
+    // Appends notifications of all producers to ntfs. Rings are drained
+    // from the last producer to the first one: notifications of the last
+    // one (the output writer) follow notifications sent by workers
+    // before, so those are never read later.
+    void recvAll(std::vector<EncodingNotification> &ntfs);
+
+#ifdef __linux__
+    // The eventfd is written only if the consumer has not been
+    // signaled since the last clearEvent().
+    bool enableEventFd();
+    inline int eventFd() const { return eventFd_; }
+
+    // Must be called before receiving.
+    void clearEvent();
+#endif
+
+private:
+    NotificationChannel(const NotificationChannel&);
+    NotificationChannel& operator=(const NotificationChannel&);
+
+    size_t producersCount_;
+    std::vector<NotificationRing*> rings_;
+#ifdef __linux__
+    volatile long isSignaled_;
+    int eventFd_;
+#endif
+};
+
+}
+
+#endif
@@ -0,0 +1,411 @@
+#include "output_writer.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+#include <string.h>
+#include <new>
+
+#include "logging_utils.h"
+
+using namespace GMp3Enc;
+
+OutputFile::OutputFile()
+    : f_(NULL)
+    , writer_(NULL)
+    , buffer_(NULL)
+    , written_(0)
+    , preallocated_(false)
+    , hasError_(false)
+    , isStream_(false)
+{
+}
+
+OutputFile::~OutputFile()
+{
+    if (f_ && !isStream_)
+        fclose(f_);
+}
+
+bool OutputFile::open(const std::string &path, OutputWriter *writer)
+{
+    written_ = 0;
+    preallocated_ = false;
+    hasError_ = false;
+    header_.clear();
+
+    if (path == "-") {
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        f_ = stdout;
+        writer_ = NULL;
+        isStream_ = true;
+        return true;
+    }
+
+    f_ = fopen(path.c_str(), "wb");
+    if (!f_)
+        return false;
+
+    writer_ = writer;
+    isStream_ = false;
+
+    // Writer thread issues large writes, stdio buffering is not needed:
+    if (writer_)
+        setvbuf(f_, NULL, _IONBF, 0);
+
+    return true;
+}
+
+void OutputFile::preallocate(long long size)
+{
+#ifdef __linux__
+    // Blocks are reserved without changing the file size, unused
+    // blocks are released by truncation when the file is closed.
+    if (f_ && !isStream_ && size > 0)
+        preallocated_ = fallocate(fileno(f_), FALLOC_FL_KEEP_SIZE, 0, size) == 0;
+#endif
+}
+
+bool OutputFile::write(const uint8_t *data, size_t size)
+{
+    if (!writer_) {
+        if (fwrite(data, 1, size, f_) != size)
+            return false;
+        if (isStream_ && fflush(f_) != 0)
+            return false;
+        written_ += size;
+        return true;
+    }
+
+    while (size) {
+        if (!buffer_) {
+            buffer_ = writer_->acquireBuffer();
+            if (!buffer_)
+                return false;
+        }
+
+        size_t n = OutputWriter::OUTPUT_BUFFER_SIZE - buffer_->size;
+        if (n > size)
+            n = size;
+        memcpy(buffer_->data + buffer_->size, data, n);
+        buffer_->size += n;
+        data += n;
+        size -= n;
+
+        if (buffer_->size == OutputWriter::OUTPUT_BUFFER_SIZE) {
+            writer_->submit(this, buffer_);
+            buffer_ = NULL;
+        }
+    }
+
+    return true;
+}
+
+void OutputFile::setHeader(const uint8_t *data, size_t size)
+{
+    header_.assign(data, data + size);
+}
+
+bool OutputFile::close()
+{
+    if (writer_)
+        return false;
+    return finish();
+}
+
+bool OutputFile::finish()
+{
+    if (!f_)
+        return false;
+
+    if (fflush(f_) != 0)
+        hasError_ = true;
+
+    // Standard output stays open:
+    if (isStream_) {
+        f_ = NULL;
+        return !hasError_;
+    }
+
+    // Write-behind data could be written by io_uring at file offsets,
+    // so the header is written at the offset too:
+    if (!header_.empty() && !hasError_) {
+        if (written_ < static_cast<long long>(header_.size()))
+            hasError_ = true;
+#ifdef __linux__
+        else if (pwrite(fileno(f_), &header_[0], header_.size(), 0) !=
+                 static_cast<ssize_t>(header_.size()))
+            hasError_ = true;
+#else
+        else if (fseek(f_, 0, SEEK_SET) != 0 ||
+                 fwrite(&header_[0], 1, header_.size(), f_) != header_.size() ||
+                 fflush(f_) != 0)
+            hasError_ = true;
+#endif
+    }
+
+#ifdef __linux__
+    if (preallocated_ && ftruncate(fileno(f_), written_) != 0)
+        hasError_ = true;
+#endif
+
+    if (fclose(f_) != 0)
+        hasError_ = true;
+    f_ = NULL;
+
+    return !hasError_;
+}
+
+OutputWriter::OutputWriter(NotificationChannel &results, size_t producer, size_t buffersCount)
+    : results_(results)
+    , producer_(producer)
+    , buffers_(buffersCount)
+    , memory_(NULL)
+    , pending_(buffersCount)
+    , isIoRingEnabled_(false)
+    , isRunning_(false)
+{
+}
+
+OutputWriter::~OutputWriter()
+{
+    stop();
+    if (memory_)
+        delete[] memory_;
+}
+
+bool OutputWriter::start()
+{
+    if (isRunning_)
+        return false;
+
+    if (!requestQueue_.init() || !freeBuffers_.init()) {
+        GMP3ENC_LOGGER_ERROR("Failed to init output writer queues.");
+        return false;
+    }
+
+    try {
+        memory_ = new uint8_t[buffers_.size() * OUTPUT_BUFFER_SIZE];
+    } catch(std::bad_alloc &e) {
+        GMP3ENC_LOGGER_ERROR(
+                    "Failed to allocate output buffers. Size: %zu",
+                    buffers_.size() * OUTPUT_BUFFER_SIZE);
+        memory_ = NULL;
+        return false;
+    }
+
+    for (size_t i = 0; i < buffers_.size(); i++) {
+        buffers_[i].data = memory_ + i * OUTPUT_BUFFER_SIZE;
+        buffers_[i].size = 0;
+        freeBuffers_.send(&buffers_[i]);
+    }
+
+    // Every buffer could be in the ring at once:
+    if (isIoRingEnabled_ && !ring_.isValid() && !ring_.init(buffers_.size()))
+        GMP3ENC_LOGGER_DEBUG("Failed to set up io_uring for output writer, using synchronous writes");
+
+    int r = pthread_create(
+                &pthreadId_,
+                NULL,
+                &threadFunc,
+                reinterpret_cast<void*>(this));
+    if (r)
+        return false;
+
+    isRunning_ = true;
+    return true;
+}
+
+void OutputWriter::stop()
+{
+    if (!isRunning_)
+        return;
+
+    // All queued data is written before the thread exits:
+    OutputRequest req;
+    req.type = OutputRequest::StopRequest;
+    req.file = NULL;
+    req.buffer = NULL;
+    requestQueue_.send(req);
+
+    pthread_join(pthreadId_, NULL);
+    isRunning_ = false;
+
+    freeBuffers_.invalidate();
+    requestQueue_.invalidate();
+}
+
+void OutputWriter::close(OutputFile *file, const EncodingNotification &ntf)
+{
+    if (file->buffer_) {
+        if (file->buffer_->size)
+            submit(file, file->buffer_);
+        else
+            freeBuffers_.send(file->buffer_);
+        file->buffer_ = NULL;
+    }
+
+    OutputRequest req;
+    req.type = OutputRequest::CloseRequest;
+    req.file = file;
+    req.buffer = NULL;
+    req.ntf = ntf;
+    requestQueue_.send(req);
+}
+
+OutputBuffer* OutputWriter::acquireBuffer()
+{
+    OutputBuffer *buffer = NULL;
+    if (freeBuffers_.recv(buffer, true) != MsgQResSuccess)
+        return NULL;
+    buffer->size = 0;
+    return buffer;
+}
+
+void OutputWriter::submit(OutputFile *file, OutputBuffer *buffer)
+{
+    OutputRequest req;
+    req.type = OutputRequest::WriteRequest;
+    req.file = file;
+    req.buffer = buffer;
+    requestQueue_.send(req);
+}
+
+void OutputWriter::closeFile(OutputFile *file, const EncodingNotification &ntf)
+{
+    EncodingNotification r = ntf;
+    if (!file->finish() && r.result == EncodingTask::EncodingSuccess) {
+        r.task->setOutputError();
+        r.result = EncodingTask::EncodingBadDestination;
+    }
+    results_.send(producer_, r);
+}
+
+void OutputWriter::exec()
+{
+    if (ring_.isValid()) {
+        execAsync();
+        return;
+    }
+
+    OutputRequest req;
+    while (requestQueue_.recv(req, true) == MsgQResSuccess) {
+        if (req.type == OutputRequest::StopRequest)
+            break;
+
+        OutputFile *file = req.file;
+
+        if (req.type == OutputRequest::WriteRequest) {
+            if (!file->hasError_) {
+                size_t n = fwrite(req.buffer->data, 1, req.buffer->size, file->f_);
+                if (n != req.buffer->size)
+                    file->hasError_ = true;
+                file->written_ += n;
+            }
+            freeBuffers_.send(req.buffer);
+
+        } else if (req.type == OutputRequest::CloseRequest) {
+            closeFile(file, req.ntf);
+        }
+    }
+}
+
+void OutputWriter::execAsync()
+{
+    std::list<OutputRequest> reqs;
+    bool isStopped = false;
+    while (!isStopped && requestQueue_.recvAll(reqs, true) == MsgQResSuccess) {
+        std::list<OutputRequest>::iterator it = reqs.begin();
+        for (; it != reqs.end() && !isStopped; ++it) {
+            OutputRequest &req = *it;
+
+            if (req.type == OutputRequest::WriteRequest) {
+                // Writes are issued at the file offsets, buffers of
+                // different files go to the disk in parallel:
+                if (req.file->hasError_ || !queueWrite(req.file, req.buffer))
+                    freeBuffers_.send(req.buffer);
+                continue;
+            }
+
+            // The file is closed after all of its data is written:
+            completeWrites(true);
+            if (req.type == OutputRequest::StopRequest)
+                isStopped = true;
+            else
+                closeFile(req.file, req.ntf);
+        }
+        reqs.clear();
+
+        // Workers wait for the buffers, they are not held over
+        // to the next batch:
+        completeWrites(true);
+    }
+}
+
+bool OutputWriter::queueWrite(OutputFile *file, OutputBuffer *buffer)
+{
+    PendingWrite &w = pending_[buffer - &buffers_[0]];
+    w.file = file;
+    w.offset = file->written_;
+    w.done = 0;
+    file->written_ += buffer->size;
+
+    while (!ring_.prepareWrite(fileno(file->f_), buffer->data, buffer->size, w.offset, buffer)) {
+        if (!ring_.inFlight() || !completeWrites(false)) {
+            file->hasError_ = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool OutputWriter::completeWrites(bool waitAll)
+{
+    while (ring_.inFlight()) {
+        if (!ring_.submit(1)) {
+            GMP3ENC_LOGGER_ERROR("io_uring submission failed for output writes");
+            return false;
+        }
+
+        void *userData;
+        int result;
+        while (ring_.popCompletion(userData, result)) {
+            OutputBuffer *buffer = static_cast<OutputBuffer*>(userData);
+            PendingWrite &w = pending_[buffer - &buffers_[0]];
+            if (result <= 0) {
+                w.file->hasError_ = true;
+            } else {
+                w.done += result;
+                if (w.done < buffer->size) {
+                    if (ring_.prepareWrite(
+                                fileno(w.file->f_),
+                                buffer->data + w.done,
+                                buffer->size - w.done,
+                                w.offset + w.done,
+                                buffer))
+                        continue;
+                    w.file->hasError_ = true;
+                }
+            }
+            freeBuffers_.send(buffer);
+        }
+
+        if (!waitAll)
+            break;
+    }
+    return true;
+}
+
+void* OutputWriter::threadFunc(void *h)
+{
+    OutputWriter *obj = static_cast<OutputWriter*>(h);
+    obj->exec();
+    return NULL;
+}
@@ -0,0 +1,154 @@
+#ifndef GMP3ENC_OUTPUT_WRITER_
+#define GMP3ENC_OUTPUT_WRITER_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <list>
+#include <string>
+#include <vector>
+
+#include "encoding_task.h"
+#include "io_ring.h"
+#include "message_queue.h"
+#include "notification_channel.h"
+
+namespace GMp3Enc {
+
+class OutputWriter;
+
+struct OutputBuffer
+{
+    uint8_t *data;
+    size_t size;
+};
+
+// Destination file of the encoding task. Data is either written directly
+// or collected into large buffers which are written by OutputWriter thread.
+class OutputFile
+{
+public:
+    OutputFile();
+    ~OutputFile();
+
+    // "-" opens the standard output. It is written directly and flushed
+    // on every write, so mp3 frames reach the consumer promptly.
+    bool open(const std::string &path, OutputWriter *writer);
+    void preallocate(long long size);
+    bool write(const uint8_t *data, size_t size);
+
+    // Data written over the beginning of the file when it is closed:
+    // the Info tag, which lame can build only after the flush.
+    void setHeader(const uint8_t *data, size_t size);
+
+    // Closes file written directly. Write-behind file is closed
+    // by OutputWriter::close.
+    bool close();
+
+    inline bool isOpen() const { return f_ != NULL; }
+    inline bool isWriteBehind() const { return writer_ != NULL; }
+    inline bool isStream() const { return isStream_; }
+
+private:
+    friend class OutputWriter;
+
+    OutputFile(const OutputFile&);
+    OutputFile& operator=(const OutputFile&);
+
+    bool finish();
+
+    FILE *f_;
+    OutputWriter *writer_;
+    OutputBuffer *buffer_;
+    std::vector<uint8_t> header_;
+    long long written_;
+    bool preallocated_;
+    bool hasError_;
+    bool isStream_;
+};
+
+struct OutputRequest
+{
+    enum RequestType
+    {
+        WriteRequest,
+        CloseRequest,
+        StopRequest
+    };
+
+    RequestType type;
+    OutputFile *file;
+    OutputBuffer *buffer;
+    EncodingNotification ntf;
+};
+
+typedef MessageQueue<OutputRequest> OutputRequestQueue;
+typedef MessageQueue<OutputBuffer*> OutputBufferQueue;
+
+// Write-behind stage. Workers hand over filled buffers and continue
+// encoding, the writer thread issues large writes and closes files.
+// Number of buffers is limited, so workers are blocked when the
+// destination is slower than encoding.
+class OutputWriter
+{
+public:
+    static const size_t OUTPUT_BUFFER_SIZE = 256 * 1024;
+
+    // Notifications are sent into the results channel as the given producer.
+    OutputWriter(NotificationChannel &results, size_t producer, size_t buffersCount);
+    ~OutputWriter();
+
+    // Writes of every received batch are queued to io_uring together.
+    // Must be called before start(), synchronous writes are used if
+    // the ring can't be set up.
+    inline void enableIoRing() { isIoRingEnabled_ = true; }
+
+    bool start();
+    void stop();
+
+    inline bool isRunning() const { return isRunning_; }
+    inline bool isIoRingActive() const { return ring_.isValid(); }
+
+    // Sends rest of the file data, closes the file and then
+    // sends notification into the results channel.
+    void close(OutputFile *file, const EncodingNotification &ntf);
+
+private:
+    friend class OutputFile;
+
+    OutputWriter(const OutputWriter&);
+    OutputWriter& operator=(const OutputWriter&);
+
+    // Write of one buffer in the ring, a short write is queued again
+    // for the rest of the buffer:
+    struct PendingWrite
+    {
+        OutputFile *file;
+        long long offset;
+        size_t done;
+    };
+
+    OutputBuffer* acquireBuffer();
+    void submit(OutputFile *file, OutputBuffer *buffer);
+    void closeFile(OutputFile *file, const EncodingNotification &ntf);
+    void exec();
+    void execAsync();
+    bool queueWrite(OutputFile *file, OutputBuffer *buffer);
+    bool completeWrites(bool waitAll);
+    static void* threadFunc(void* h);
+
+    NotificationChannel &results_;
+    size_t producer_;
+    OutputRequestQueue requestQueue_;
+    OutputBufferQueue freeBuffers_;
+    std::vector<OutputBuffer> buffers_;
+    uint8_t *memory_;
+    IoRing ring_;
+    std::vector<PendingWrite> pending_;
+    bool isIoRingEnabled_;
+    pthread_t pthreadId_;
+    bool isRunning_;
+};
+
+}
+
+#endif
@@ -0,0 +1,411 @@
+#include "pcm_unpack.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define GMP3ENC_PCM_UNPACK_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(GMP3ENC_PCM_UNPACK_X86) && defined(__GNUC__)
+#define GMP3ENC_TARGET_SSE2 __attribute__((target("sse2")))
+#define GMP3ENC_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define GMP3ENC_TARGET_SSE2
+#define GMP3ENC_TARGET_AVX2
+#endif
+
+using namespace GMp3Enc;
+
+PcmUnpack::KernelSet PcmUnpack::kernelSet_ = PcmUnpack::KernelScalar;
+PcmUnpackFunc PcmUnpack::kernels_[4][2] = {
+    { NULL, NULL }, { NULL, NULL }, { NULL, NULL }, { NULL, NULL }
+};
+
+// Scalar reference, the same conversion as lame frontend does:
+// 8 bit samples are unsigned, the rest are signed little endian.
+template <int B>
+static inline int32_t unpackSample(const uint8_t *p);
+
+template <>
+inline int32_t unpackSample<1>(const uint8_t *p)
+{
+    return static_cast<int32_t>(
+                static_cast<uint32_t>(p[0] ^ 0x80) << 24 | 0x7f << 16);
+}
+
+template <>
+inline int32_t unpackSample<2>(const uint8_t *p)
+{
+    return static_cast<int32_t>(
+                static_cast<uint32_t>(p[0]) << 16 |
+                static_cast<uint32_t>(p[1]) << 24);
+}
+
+template <>
+inline int32_t unpackSample<3>(const uint8_t *p)
+{
+    return static_cast<int32_t>(
+                static_cast<uint32_t>(p[0]) << 8 |
+                static_cast<uint32_t>(p[1]) << 16 |
+                static_cast<uint32_t>(p[2]) << 24);
+}
+
+template <>
+inline int32_t unpackSample<4>(const uint8_t *p)
+{
+    return static_cast<int32_t>(
+                static_cast<uint32_t>(p[0]) |
+                static_cast<uint32_t>(p[1]) << 8 |
+                static_cast<uint32_t>(p[2]) << 16 |
+                static_cast<uint32_t>(p[3]) << 24);
+}
+
+template <int B>
+static void unpackMonoScalar(const uint8_t *src, size_t count, int32_t *left, int32_t *)
+{
+    for (size_t i = 0; i < count; i++)
+        left[i] = unpackSample<B>(src + i * B);
+}
+
+template <int B>
+static void unpackStereoScalar(const uint8_t *src, size_t count, int32_t *left, int32_t *right)
+{
+    for (size_t i = 0; i < count; i++) {
+        left[i] = unpackSample<B>(src + 2 * i * B);
+        right[i] = unpackSample<B>(src + 2 * i * B + B);
+    }
+}
+
+#ifdef GMP3ENC_PCM_UNPACK_X86
+
+// SSE2 kernels. There is no byte shuffle in SSE2, so 24 bit samples
+// are left for the scalar code.
+
+GMP3ENC_TARGET_SSE2
+static inline void deinterleaveStoreSse2(__m128i a, __m128i b, int32_t *left, int32_t *right)
+{
+    __m128 fa = _mm_castsi128_ps(a);
+    __m128 fb = _mm_castsi128_ps(b);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(left),
+                     _mm_castps_si128(_mm_shuffle_ps(fa, fb, _MM_SHUFFLE(2, 0, 2, 0))));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(right),
+                     _mm_castps_si128(_mm_shuffle_ps(fa, fb, _MM_SHUFFLE(3, 1, 3, 1))));
+}
+
+GMP3ENC_TARGET_SSE2
+static void unpack8MonoSse2(const uint8_t *src, size_t count, int32_t *left, int32_t *right)
+{
+    const __m128i sign = _mm_set1_epi8(static_cast<char>(0x80));
+    const __m128i low = _mm_set1_epi8(0x7f);
+    const __m128i zero = _mm_setzero_si128();
+
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i v = _mm_xor_si128(
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)), sign);
+        __m128i lo = _mm_unpacklo_epi8(low, v);
+        __m128i hi = _mm_unpackhi_epi8(low, v);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(left + i), _mm_unpacklo_epi16(zero, lo));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(left + i + 4), _mm_unpackhi_epi16(zero, lo));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(left + i + 8), _mm_unpacklo_epi16(zero, hi));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(left + i + 12), _mm_unpackhi_epi16(zero, hi));
+    }
+    unpackMonoScalar<1>(src + i, count - i, left + i, right);
+}
+
+GMP3ENC_TARGET_SSE2
+static void unpack8StereoSse2(const uint8_t *src, size_t count, int32_t *left, int32_t *right)
+{
+    const __m128i sign = _mm_set1_epi8(static_cast<char>(0x80));
+    const __m128i low = _mm_set1_epi8(0x7f);
+    const __m128i zero = _mm_setzero_si128();
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i v = _mm_xor_si128(
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2 * i)), sign);
+        __m128i lo = _mm_unpacklo_epi8(low, v);
+        __m128i hi = _mm_unpackhi_epi8(low, v);
+        deinterleaveStoreSse2(
+                    _mm_unpacklo_epi16(zero, lo), _mm_unpackhi_epi16(zero, lo),
+                    left + i, right + i);
+        deinterleaveStoreSse2(
+                    _mm_unpacklo_epi16(zero, hi), _mm_unpackhi_epi16(zero, hi),
+                    left + i + 4, right + i + 4);
+    }
+    unpackStereoScalar<1>(src + 2 * i, count - i, left + i, right + i);
+}
+
+GMP3ENC_TARGET_SSE2
+static void unpack16MonoSse2(const uint8_t *src, size_t count, int32_t *left, int32_t *right)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2 * i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(left + i), _mm_unpacklo_epi16(zero, v));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(left + i + 4), _mm_unpackhi_epi16(zero, v));
+    }
+    unpackMonoScalar<2>(src + 2 * i, count - i, left + i, right);
+}
+
+GMP3ENC_TARGET_SSE2
+static void unpack16StereoSse2(const uint8_t *src, size_t count, int32_t *left, int32_t *right)
+{
+    const __m128i highMask = _mm_set1_epi32(static_cast<int>(0xffff0000));
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 4 * i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(left + i), _mm_slli_epi32(v, 16));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(right + i), _mm_and_si128(v, highMask));
+    }
+    unpackStereoScalar<2>(src + 4 * i, count - i, left + i, right + i);
+}
+
+GMP3ENC_TARGET_SSE2
+static void unpack32MonoSse2(const uint8_t *src, size_t count, int32_t *left, int32_t *right)
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 4 * i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(left + i), v);
+    }
+    unpackMonoScalar<4>(src + 4 * i, count - i, left + i, right);
+}
+
+GMP3ENC_TARGET_SSE2
+static void unpack32StereoSse2(const uint8_t *src, size_t count, int32_t *left, int32_t *right)
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 8 * i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 8 * i + 16));
+        deinterleaveStoreSse2(a, b, left + i, right + i);
+    }
+    unpackStereoScalar<4>(src + 8 * i, count - i, left + i, right + i);
+}
+
+// AVX2 kernels.
+
+GMP3ENC_TARGET_AVX2
+static inline void deinterleaveStoreAvx2(__m256i v, int32_t *left, int32_t *right)
+{
+    const __m256i idx = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    __m256i p = _mm256_permutevar8x32_epi32(v, idx);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(left), _mm256_castsi256_si128(p));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(right), _mm256_extracti128_si256(p, 1));
+}
+
+GMP3ENC_TARGET_AVX2
+static inline __m256i widen8Avx2(const uint8_t *src)
+{
+    const __m256i sign = _mm256_set1_epi32(0x80);
+    const __m256i low = _mm256_set1_epi32(0x7f << 16);
+    __m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src)));
+    return _mm256_or_si256(_mm256_slli_epi32(_mm256_xor_si256(v, sign), 24), low);
+}
+
+GMP3ENC_TARGET_AVX2
+static inline __m256i widen24Avx2(const uint8_t *src)
+{
+    // Every lane takes 4 samples (12 bytes), the lowest byte is zero.
+    const __m256i shuffle = _mm256_setr_epi8(
+                -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+                -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+    __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+    __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 12));
+    __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+    return _mm256_shuffle_epi8(v, shuffle);
+}
+
+GMP3ENC_TARGET_AVX2
+static void unpack8MonoAvx2(const uint8_t *src, size_t count, int32_t *left, int32_t *right)
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(left + i), widen8Avx2(src + i));
+    unpackMonoScalar<1>(src + i, count - i, left + i, right);
+}
+
+GMP3ENC_TARGET_AVX2
+static void unpack8StereoAvx2(const uint8_t *src, size_t count, int32_t *left, int32_t *right)
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+        deinterleaveStoreAvx2(widen8Avx2(src + 2 * i), left + i, right + i);
+    unpackStereoScalar<1>(src + 2 * i, count - i, left + i, right + i);
+}
+
+GMP3ENC_TARGET_AVX2
+static void unpack16MonoAvx2(const uint8_t *src, size_t count, int32_t *left, int32_t *right)
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i v = _mm256_cvtepu16_epi32(
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2 * i)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(left + i), _mm256_slli_epi32(v, 16));
+    }
+    unpackMonoScalar<2>(src + 2 * i, count - i, left + i, right);
+}
+
+GMP3ENC_TARGET_AVX2
+static void unpack16StereoAvx2(const uint8_t *src, size_t count, int32_t *left, int32_t *right)
+{
+    const __m256i highMask = _mm256_set1_epi32(static_cast<int>(0xffff0000));
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 4 * i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(left + i), _mm256_slli_epi32(v, 16));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(right + i), _mm256_and_si256(v, highMask));
+    }
+    unpackStereoScalar<2>(src + 4 * i, count - i, left + i, right + i);
+}
+
+GMP3ENC_TARGET_AVX2
+static void unpack24MonoAvx2(const uint8_t *src, size_t count, int32_t *left, int32_t *right)
+{
+    // Last load of an iteration takes 28 bytes of the source.
+    size_t i = 0;
+    for (; i + 10 <= count; i += 8)
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(left + i), widen24Avx2(src + 3 * i));
+    unpackMonoScalar<3>(src + 3 * i, count - i, left + i, right);
+}
+
+GMP3ENC_TARGET_AVX2
+static void unpack24StereoAvx2(const uint8_t *src, size_t count, int32_t *left, int32_t *right)
+{
+    size_t i = 0;
+    for (; i + 5 <= count; i += 4)
+        deinterleaveStoreAvx2(widen24Avx2(src + 6 * i), left + i, right + i);
+    unpackStereoScalar<3>(src + 6 * i, count - i, left + i, right + i);
+}
+
+GMP3ENC_TARGET_AVX2
+static void unpack32MonoAvx2(const uint8_t *src, size_t count, int32_t *left, int32_t *right)
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 4 * i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(left + i), v);
+    }
+    unpackMonoScalar<4>(src + 4 * i, count - i, left + i, right);
+}
+
+GMP3ENC_TARGET_AVX2
+static void unpack32StereoAvx2(const uint8_t *src, size_t count, int32_t *left, int32_t *right)
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 8 * i));
+        deinterleaveStoreAvx2(v, left + i, right + i);
+    }
+    unpackStereoScalar<4>(src + 8 * i, count - i, left + i, right + i);
+}
+
+#endif
+
+void PcmUnpack::selectKernels()
+{
+    selectKernels(KernelAvx2);
+}
+
+void PcmUnpack::selectKernels(KernelSet maxSet)
+{
+    KernelSet set = detectKernelSet();
+    if (set > maxSet)
+        set = maxSet;
+
+    kernels_[0][0] = &unpackMonoScalar<1>;
+    kernels_[0][1] = &unpackStereoScalar<1>;
+    kernels_[1][0] = &unpackMonoScalar<2>;
+    kernels_[1][1] = &unpackStereoScalar<2>;
+    kernels_[2][0] = &unpackMonoScalar<3>;
+    kernels_[2][1] = &unpackStereoScalar<3>;
+    kernels_[3][0] = &unpackMonoScalar<4>;
+    kernels_[3][1] = &unpackStereoScalar<4>;
+
+#ifdef GMP3ENC_PCM_UNPACK_X86
+    if (set == KernelSse2) {
+        kernels_[0][0] = &unpack8MonoSse2;
+        kernels_[0][1] = &unpack8StereoSse2;
+        kernels_[1][0] = &unpack16MonoSse2;
+        kernels_[1][1] = &unpack16StereoSse2;
+        kernels_[3][0] = &unpack32MonoSse2;
+        kernels_[3][1] = &unpack32StereoSse2;
+    } else if (set == KernelAvx2) {
+        kernels_[0][0] = &unpack8MonoAvx2;
+        kernels_[0][1] = &unpack8StereoAvx2;
+        kernels_[1][0] = &unpack16MonoAvx2;
+        kernels_[1][1] = &unpack16StereoAvx2;
+        kernels_[2][0] = &unpack24MonoAvx2;
+        kernels_[2][1] = &unpack24StereoAvx2;
+        kernels_[3][0] = &unpack32MonoAvx2;
+        kernels_[3][1] = &unpack32StereoAvx2;
+    }
+#endif
+
+    kernelSet_ = set;
+}
+
+PcmUnpackFunc PcmUnpack::kernel(int bytesPerSample, int channels)
+{
+    if (bytesPerSample < 1 || bytesPerSample > 4 || channels < 1 || channels > 2)
+        return NULL;
+    if (!kernels_[0][0])
+        selectKernels();
+    return kernels_[bytesPerSample - 1][channels - 1];
+}
+
+PcmUnpack::KernelSet PcmUnpack::kernelSet()
+{
+    return kernelSet_;
+}
+
+const char* PcmUnpack::kernelSetName()
+{
+    switch (kernelSet_) {
+    case KernelSse2:
+        return "sse2";
+    case KernelAvx2:
+        return "avx2";
+    default:
+        break;
+    }
+    return "scalar";
+}
+
+PcmUnpack::KernelSet PcmUnpack::detectKernelSet()
+{
+#ifdef GMP3ENC_PCM_UNPACK_X86
+    bool sse2 = false;
+    bool avx2 = false;
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    int maxLeaf = info[0];
+    __cpuid(info, 1);
+    sse2 = (info[3] & (1 << 26)) != 0;
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    if (maxLeaf >= 7 && osxsave && avx && (_xgetbv(0) & 0x06) == 0x06) {
+        __cpuidex(info, 7, 0);
+        avx2 = (info[1] & (1 << 5)) != 0;
+    }
+#else
+    __builtin_cpu_init();
+    sse2 = __builtin_cpu_supports("sse2");
+    avx2 = __builtin_cpu_supports("avx2");
+#endif
+    if (avx2)
+        return KernelAvx2;
+    if (sse2)
+        return KernelSse2;
+#endif
+    return KernelScalar;
+}
@@ -0,0 +1,47 @@
+#ifndef GMP3ENC_PCM_UNPACK_
+#define GMP3ENC_PCM_UNPACK_
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace GMp3Enc {
+
+// Unpacks count interleaved PCM samples per channel into planar left
+// justified int32 buffers (the format of lame_encode_buffer_int).
+// right is not used for mono source.
+typedef void (*PcmUnpackFunc)(
+        const uint8_t *src,
+        size_t count,
+        int32_t *left,
+        int32_t *right);
+
+class PcmUnpack
+{
+public:
+    enum KernelSet
+    {
+        KernelScalar,
+        KernelSse2,
+        KernelAvx2
+    };
+
+    // Detects CPU features and selects the kernels. Must be called
+    // once before worker threads are started.
+    static void selectKernels();
+    static void selectKernels(KernelSet maxSet);
+
+    static PcmUnpackFunc kernel(int bytesPerSample, int channels);
+
+    static KernelSet kernelSet();
+    static const char* kernelSetName();
+
+private:
+    static KernelSet detectKernelSet();
+
+    static KernelSet kernelSet_;
+    static PcmUnpackFunc kernels_[4][2];
+};
+
+}
+
+#endif
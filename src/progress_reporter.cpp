@@ -0,0 +1,187 @@
+#include "progress_reporter.h"
+
+#ifdef __linux__
+#include <time.h>
+#elif defined(_WIN32)
+#include <Windows.h>
+#endif
+
+#include "encoding_task.h"
+#include "logging_utils.h"
+
+using namespace GMp3Enc;
+
+static const double BYTES_IN_MB = 1024.0 * 1024.0;
+
+ProgressReporter::Totals::Totals()
+    : audioSeconds(0.0)
+    , totalAudioSeconds(0.0)
+    , inputBytes(0.0)
+    , outputBytes(0.0)
+    , isSizeKnown(true)
+{
+}
+
+ProgressReporter::ProgressReporter()
+    : startTime_(0.0)
+{
+}
+
+void ProgressReporter::start()
+{
+    startTime_ = now();
+    finished_ = Totals();
+    taskStartTimes_.clear();
+}
+
+void ProgressReporter::taskStarted(EncodingTask *task)
+{
+    taskStartTimes_[task] = now();
+}
+
+void ProgressReporter::taskFinished(EncodingTask *task)
+{
+    add(task, finished_);
+    taskStartTimes_.erase(task);
+}
+
+void ProgressReporter::report(
+        const std::set<EncodingTask*> &activeTasks,
+        const std::set<EncodingTask*> &inProgressTasks)
+{
+    double t = now();
+
+    std::set<EncodingTask*>::const_iterator it;
+    for (it = inProgressTasks.begin(); it != inProgressTasks.end(); ++it) {
+        EncodingTask *task = *it;
+        std::map<EncodingTask*, double>::iterator sit = taskStartTimes_.find(task);
+        if (sit == taskStartTimes_.end())
+            sit = taskStartTimes_.insert(std::make_pair(task, t)).first;
+
+        if (task->samplesPerSec() <= 0)
+            continue;
+
+        double elapsed = t - sit->second;
+        double seconds = static_cast<double>(task->samplesEncoded()) / task->samplesPerSec();
+        double rt = elapsed > 0.0 ? seconds / elapsed : 0.0;
+
+        if (task->totalSamples()) {
+            double percent = 100.0 * task->samplesEncoded() / task->totalSamples();
+            if (task->segment().isSegment()) {
+                GMP3ENC_LOGGER_INFO(
+                            "  %s [%d/%d]: %.1f%%, %.1fx realtime",
+                            task->sourceFilePath().c_str(),
+                            task->segment().index + 1,
+                            task->segment().count,
+                            percent,
+                            rt);
+            } else {
+                GMP3ENC_LOGGER_INFO(
+                            "  %s: %.1f%%, %.1fx realtime",
+                            task->sourceFilePath().c_str(),
+                            percent,
+                            rt);
+            }
+        } else {
+            GMP3ENC_LOGGER_INFO(
+                        "  %s: %.1f s, %.1fx realtime",
+                        task->sourceFilePath().c_str(),
+                        seconds,
+                        rt);
+        }
+    }
+
+    Totals totals;
+    collect(activeTasks, totals);
+
+    double elapsed = t - startTime_;
+    double rt = elapsed > 0.0 ? totals.audioSeconds / elapsed : 0.0;
+    double mbps = elapsed > 0.0 ? totals.inputBytes / BYTES_IN_MB / elapsed : 0.0;
+
+    if (totals.isSizeKnown && totals.totalAudioSeconds > 0.0) {
+        double percent = 100.0 * totals.audioSeconds / totals.totalAudioSeconds;
+        double eta = rt > 0.0 ? (totals.totalAudioSeconds - totals.audioSeconds) / rt : 0.0;
+        GMP3ENC_LOGGER_INFO(
+                    "Progress: %.1f%%, %.1fx realtime, %.2f MB/s, ETA %.0f s",
+                    percent,
+                    rt,
+                    mbps,
+                    eta);
+    } else {
+        GMP3ENC_LOGGER_INFO(
+                    "Progress: %.1f s encoded, %.1fx realtime, %.2f MB/s",
+                    totals.audioSeconds,
+                    rt,
+                    mbps);
+    }
+}
+
+void ProgressReporter::summary(
+        const std::set<EncodingTask*> &activeTasks,
+        size_t submittedCount,
+        size_t completedCount,
+        size_t failedCount)
+{
+    Totals totals;
+    collect(activeTasks, totals);
+
+    double elapsed = now() - startTime_;
+    double rt = elapsed > 0.0 ? totals.audioSeconds / elapsed : 0.0;
+    double mbps = elapsed > 0.0 ? totals.inputBytes / BYTES_IN_MB / elapsed : 0.0;
+
+    GMP3ENC_LOGGER_INFO(
+                "Summary: %zu of %zu tasks completed, %zu failed, %.1f s of audio "
+                "in %.2f s (%.1fx realtime), %.2f MB/s input, %.2f MB written",
+                completedCount,
+                submittedCount,
+                failedCount,
+                totals.audioSeconds,
+                elapsed,
+                rt,
+                mbps,
+                totals.outputBytes / BYTES_IN_MB);
+}
+
+double ProgressReporter::now()
+{
+#ifdef __linux__
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#elif defined(_WIN32)
+    LARGE_INTEGER freq;
+    LARGE_INTEGER counter;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&counter);
+    return static_cast<double>(counter.QuadPart) / freq.QuadPart;
+#else
+    return 0.0;
+#endif
+}
+
+void ProgressReporter::add(const EncodingTask *task, Totals &totals)
+{
+    double rate = task->samplesPerSec();
+    unsigned long samples = task->sourceSamplesEncoded();
+    if (rate <= 0.0)
+        return;
+
+    // A shared source is read once for all of its outputs, every
+    // output counts its share of the input:
+    double share = 1.0 / task->sourceOutputsCount();
+    totals.audioSeconds += share * samples / rate;
+    totals.inputBytes += share * samples * task->inputBlockSize();
+    totals.outputBytes += task->bytesWritten();
+    if (task->sourceTotalSamples())
+        totals.totalAudioSeconds += share * task->sourceTotalSamples() / rate;
+    else
+        totals.isSizeKnown = false;
+}
+
+void ProgressReporter::collect(const std::set<EncodingTask*> &tasks, Totals &totals) const
+{
+    totals = finished_;
+    std::set<EncodingTask*>::const_iterator it;
+    for (it = tasks.begin(); it != tasks.end(); ++it)
+        add(*it, totals);
+}
@@ -0,0 +1,65 @@
+#ifndef GMP3ENC_PROGRESS_REPORTER_
+#define GMP3ENC_PROGRESS_REPORTER_
+
+#include <stddef.h>
+#include <map>
+#include <set>
+
+namespace GMp3Enc {
+
+class EncodingTask;
+
+// Renders progress of the tasks from their counters. Finished tasks
+// are folded into totals, so only active tasks are kept. Used only by
+// the management thread.
+class ProgressReporter
+{
+public:
+    ProgressReporter();
+
+    void start();
+    void taskStarted(EncodingTask *task);
+
+    // Adds counters of the finished task to the totals. Called before
+    // the task is deleted.
+    void taskFinished(EncodingTask *task);
+
+    // Per-file progress of running tasks and aggregate progress
+    // with realtime factor, input MB/s and ETA. activeTasks are
+    // submitted tasks which are not finished yet.
+    void report(
+            const std::set<EncodingTask*> &activeTasks,
+            const std::set<EncodingTask*> &inProgressTasks);
+
+    void summary(
+            const std::set<EncodingTask*> &activeTasks,
+            size_t submittedCount,
+            size_t completedCount,
+            size_t failedCount);
+
+    // Monotonic time in seconds.
+    static double now();
+
+private:
+    struct Totals
+    {
+        Totals();
+
+        double audioSeconds;       // Encoded.
+        double totalAudioSeconds;  // Known sizes only.
+        double inputBytes;
+        double outputBytes;
+        bool isSizeKnown;
+    };
+
+    static void add(const EncodingTask *task, Totals &totals);
+    void collect(const std::set<EncodingTask*> &tasks, Totals &totals) const;
+
+    double startTime_;
+    Totals finished_;
+    std::map<EncodingTask*, double> taskStartTimes_;
+};
+
+}
+
+#endif
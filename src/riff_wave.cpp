@@ -4,6 +4,9 @@
 #include <string.h>
 #include <sstream>
 
+#include "wave_reader.h"
+#include "pcm_unpack.h"
+
 // Many thanks to lame frontend developers! :)
 static int const WAV_ID_RIFF = 0x52494646; // "RIFF"
 static int const WAV_ID_WAVE = 0x57415645; // "WAVE"
@@ -22,10 +25,73 @@ static long make_even_number_of_bytes_in_length(long x)
     return x;
 }
 
-static int read_16_bits_low_high(FILE * fp)
+using namespace GMp3Enc;
+
+// Header is read from the first block of the file at once, data behind
+// the block (huge chunks before "data") is read from the file directly.
+// Streams are read only forward without the block.
+class GMp3Enc::RiffHeaderInput
+{
+public:
+    static const size_t BLOCK_SIZE = 4096;
+
+    RiffHeaderInput(FILE *f, bool seekable)
+        : f_(f)
+        , seekable_(seekable)
+        , blockSize_(0)
+        , pos_(0)
+    {
+        if (seekable_)
+            blockSize_ = fread(block_, 1, BLOCK_SIZE, f_);
+    }
+
+    bool read(unsigned char *dst, size_t n)
+    {
+        if (pos_ + n <= blockSize_) {
+            memcpy(dst, block_ + pos_, n);
+            pos_ += n;
+            return true;
+        }
+
+        if (seekable_ && fseek(f_, pos_, SEEK_SET) != 0)
+            return false;
+        size_t rb = fread(dst, 1, n, f_);
+        pos_ += rb;
+        return rb == n;
+    }
+
+    // Chunks are skipped by reading when the source is not seekable:
+    bool skip(long n)
+    {
+        if (seekable_) {
+            pos_ += n;
+            return true;
+        }
+
+        unsigned char buf[256];
+        while (n > 0) {
+            size_t len = n < (long) sizeof(buf) ? (size_t) n : sizeof(buf);
+            if (!read(buf, len))
+                return false;
+            n -= (long) len;
+        }
+        return true;
+    }
+
+    inline long position() const { return static_cast<long>(pos_); }
+
+private:
+    FILE *f_;
+    bool seekable_;
+    unsigned char block_[BLOCK_SIZE];
+    size_t blockSize_;
+    size_t pos_;
+};
+
+static int read_16_bits_low_high(RiffHeaderInput &in)
 {
     unsigned char bytes[2] = { 0, 0 };
-    fread(bytes, 1, 2, fp);
+    in.read(bytes, 2);
     {
         int32_t const low = bytes[0];
         int32_t const high = (signed char) (bytes[1]);
@@ -33,10 +99,10 @@ static int read_16_bits_low_high(FILE * fp)
     }
 }
 
-static int read_32_bits_low_high(FILE * fp)
+static int read_32_bits_low_high(RiffHeaderInput &in)
 {
     unsigned char bytes[4] = { 0, 0, 0, 0 };
-    fread(bytes, 1, 4, fp);
+    in.read(bytes, 4);
     {
         int32_t const low = bytes[0];
         int32_t const medl = bytes[1];
@@ -46,21 +112,10 @@ static int read_32_bits_low_high(FILE * fp)
     }
 }
 
-static int read_16_bits_high_low(FILE * fp)
-{
-    unsigned char bytes[2] = { 0, 0 };
-    fread(bytes, 1, 2, fp);
-    {
-        int32_t const low = bytes[1];
-        int32_t const high = (signed char) (bytes[0]);
-        return (high << 8) | low;
-    }
-}
-
-static int read_32_bits_high_low(FILE * fp)
+static int read_32_bits_high_low(RiffHeaderInput &in)
 {
     unsigned char bytes[4] = { 0, 0, 0, 0 };
-    fread(bytes, 1, 4, fp);
+    in.read(bytes, 4);
     {
         int32_t const low = bytes[3];
         int32_t const medl = bytes[2];
@@ -88,8 +143,6 @@ static void write_32_bits_low_high(FILE * fp, int val)
     fwrite(bytes, 1, 4, fp);
 }
 
-using namespace GMp3Enc;
-
 struct GMp3Enc::RiffWaveHeaderInternal
 {
     int formatTag;
@@ -105,24 +158,53 @@ struct GMp3Enc::RiffWaveHeaderInternal
 
 RiffWave::RiffWave()
     : f_(NULL)
+    , stream_(NULL)
     , hi_(NULL)
+    , reader_(NULL)
+    , readerType_(WaveReaderStdio)
+    , ioRing_(NULL)
+    , interrupt_(NULL)
+    , rangeFirst_(0)
+    , rangeSize_(0)
+    , rangeLeft_(0)
 {
 }
 
 RiffWave::RiffWave(const RiffWave &other)
     : f_(NULL)
+    , stream_(NULL)
     , hi_(NULL)
+    , reader_(NULL)
+    , readerType_(WaveReaderStdio)
+    , ioRing_(NULL)
+    , interrupt_(NULL)
+    , rangeFirst_(0)
+    , rangeSize_(0)
+    , rangeLeft_(0)
 {
     if (other.isValid()) {
         hi_ = new RiffWaveHeaderInternal;
         memcpy(hi_, other.hi_, sizeof(RiffWaveHeaderInternal));
         riffWavePath_ = other.riffWavePath_;
+        stream_ = other.stream_;
+        readerType_ = other.readerType_;
+        rangeFirst_ = other.rangeFirst_;
+        rangeSize_ = other.rangeSize_;
+        rangeLeft_ = other.rangeSize_;
     }
 }
 
 RiffWave::RiffWave(const std::string &riffWavePath)
     : f_(NULL)
+    , stream_(NULL)
     , hi_(NULL)
+    , reader_(NULL)
+    , readerType_(WaveReaderStdio)
+    , ioRing_(NULL)
+    , interrupt_(NULL)
+    , rangeFirst_(0)
+    , rangeSize_(0)
+    , rangeLeft_(0)
 {
     readWave(riffWavePath);
 }
@@ -140,6 +222,11 @@ RiffWave &RiffWave::operator=(const RiffWave &other)
         hi_ = new RiffWaveHeaderInternal;
         memcpy(hi_, other.hi_, sizeof(RiffWaveHeaderInternal));
         riffWavePath_ = other.riffWavePath_;
+        stream_ = other.stream_;
+        readerType_ = other.readerType_;
+        rangeFirst_ = other.rangeFirst_;
+        rangeSize_ = other.rangeSize_;
+        rangeLeft_ = other.rangeSize_;
     }
 
     return *this;
@@ -154,103 +241,147 @@ bool RiffWave::readWave(const std::string &riffWavePath)
     if (!f_)
         return false;
 
-    int type = read_32_bits_high_low(f_);
-    if (type != WAV_ID_RIFF) {
+    // The header block is read by one call, stdio buffer is not needed:
+    setvbuf(f_, NULL, _IONBF, 0);
+
+    long dataSize = 0;
+    RiffHeaderInput in(f_, true);
+    if (!readHeader(in, dataSize)) {
         clear();
         return false;
     }
 
-    long fileLength = read_32_bits_high_low(f_);
-    if (read_32_bits_high_low(f_) != WAV_ID_WAVE) {
+    hi_->dataOffset = in.position();
+
+    // Data chunk size could be unknown (0 or 0xFFFFFFFF) if the wave was
+    // written by a streaming application. Data is limited by the file end:
+    long fileSize = -1;
+    if (fseek(f_, 0, SEEK_END) == 0)
+        fileSize = ftell(f_);
+    if (fileSize >= hi_->dataOffset &&
+        (dataSize <= 0 || dataSize > fileSize - hi_->dataOffset))
+        dataSize = fileSize - hi_->dataOffset;
+
+    setDataSize(dataSize);
+
+    // Header is parsed, data will be read by the reader backend:
+    fclose(f_);
+    f_ = NULL;
+
+    return true;
+}
+
+bool RiffWave::readWaveStream(FILE *stream, const std::string &name)
+{
+    clear();
+
+    riffWavePath_ = name;
+    if (!stream)
+        return false;
+
+#ifdef __linux__
+    // Data is read from the descriptor when it is ready, stdio must not
+    // take it ahead. Exact reads of the header leave it in the kernel:
+    setvbuf(stream, NULL, _IONBF, 0);
+#endif
+
+    long dataSize = 0;
+    RiffHeaderInput in(stream, false);
+    if (!readHeader(in, dataSize)) {
         clear();
         return false;
     }
 
+    // Stream is read only forward, data follows the header:
+    stream_ = stream;
+    hi_->dataOffset = 0;
+    setDataSize(dataSize);
+
+    return true;
+}
+
+bool RiffWave::readHeader(RiffHeaderInput &f, long &dataSize)
+{
+    int type = read_32_bits_high_low(f);
+    if (type != WAV_ID_RIFF)
+        return false;
+
+    read_32_bits_high_low(f); // RIFF chunk length is not used
+    if (read_32_bits_high_low(f) != WAV_ID_WAVE)
+        return false;
+
     int formatTag = 0;
     int channels = 0;
     int blockAlign = 0;
     int bitsPerSample = 0;
     int samplesPerSec = 0;
     int avgBytesPerSec = 0;
-    long dataSize = 0;
     long subSize = 0;
 
+    dataSize = 0;
+
     bool is_wav = false;
     for (int i = 0; i < 20; i++) {
-        type = read_32_bits_high_low(f_);
+        type = read_32_bits_high_low(f);
 
         if (type == WAV_ID_FMT) {
-            subSize = read_32_bits_low_high(f_);
+            subSize = read_32_bits_low_high(f);
             subSize = make_even_number_of_bytes_in_length(subSize);
-            if (subSize < 16) {
-                clear();
+            if (subSize < 16)
                 return false;
-            }
 
-            formatTag = read_16_bits_low_high(f_);
+            formatTag = read_16_bits_low_high(f);
             subSize -= 2;
-            channels = read_16_bits_low_high(f_);
+            channels = read_16_bits_low_high(f);
             subSize -= 2;
-            samplesPerSec = read_32_bits_low_high(f_);
+            samplesPerSec = read_32_bits_low_high(f);
             subSize -= 4;
-            avgBytesPerSec = read_32_bits_low_high(f_);
+            avgBytesPerSec = read_32_bits_low_high(f);
             subSize -= 4;
-            blockAlign = read_16_bits_low_high(f_);
+            blockAlign = read_16_bits_low_high(f);
             subSize -= 2;
-            bitsPerSample = read_16_bits_low_high(f_);
+            bitsPerSample = read_16_bits_low_high(f);
             subSize -= 2;
 
             if ((subSize > 9) && (formatTag == WAVE_FORMAT_EXTENSIBLE)) {
-                read_16_bits_low_high(f_);
-                read_16_bits_low_high(f_);
-                read_32_bits_low_high(f_);
-                formatTag = read_16_bits_low_high(f_);
+                read_16_bits_low_high(f);
+                read_16_bits_low_high(f);
+                read_32_bits_low_high(f);
+                formatTag = read_16_bits_low_high(f);
                 subSize -= 10;
             }
 
             if (subSize > 0) {
-                if (fseek(f_, (long) subSize, SEEK_CUR) != 0) {
-                    clear();
+                if (!f.skip(subSize))
                     return false;
-                }
             }
 
         } else if (type == WAV_ID_DATA) {
             is_wav = true;
-            subSize = read_32_bits_low_high(f_);
-            dataSize = subSize;
+            // 0xFFFFFFFF is read as -1, so unknown size is <= 0:
+            dataSize = read_32_bits_low_high(f);
             break;
 
         } else {
-            subSize = read_32_bits_low_high(f_);
+            subSize = read_32_bits_low_high(f);
             subSize = make_even_number_of_bytes_in_length(subSize);
-            if (fseek(f_, (long) subSize, SEEK_CUR) != 0) {
-                clear();
+            if (!f.skip(subSize))
                 return false;
-            }
         }
     }
 
-    if (!is_wav) {
-        clear();
+    if (!is_wav)
         return false;
-    }
 
-    if (channels != 1 && channels != 2) {
-        clear();
+    if (channels != 1 && channels != 2)
         return false;
-    }
 
     if (bitsPerSample != 8  && bitsPerSample != 16 &&
-        bitsPerSample != 24 && bitsPerSample != 32) {
-        clear();
+        bitsPerSample != 24 && bitsPerSample != 32)
         return false;
-    }
 
-    if (formatTag != WAVE_FORMAT_PCM) {
-        clear();
+    if (formatTag != WAVE_FORMAT_PCM)
         return false;
-    }
 
     hi_ = new RiffWaveHeaderInternal;
     hi_->formatTag = formatTag;
@@ -259,107 +390,203 @@ bool RiffWave::readWave(const std::string &riffWavePath)
     hi_->bitsPerSample = bitsPerSample;
     hi_->samplesPerSec = samplesPerSec;
     hi_->avgBytesPerSec = avgBytesPerSec;
-    hi_->dataSize = dataSize;
-    hi_->dataOffset = ftell(f_);
-    hi_->numSamples = dataSize / (channels * ((bitsPerSample + 7) / 8));
+    hi_->dataOffset = 0;
+    hi_->dataSize = 0;
+    hi_->numSamples = 0;
 
     return true;
 }
 
+void RiffWave::setDataSize(long dataSize)
+{
+    // Negative size means the data lasts until the end of the stream:
+    if (dataSize <= 0)
+        dataSize = stream_ ? -1 : 0;
+
+    hi_->dataSize = dataSize;
+    hi_->numSamples = dataSize > 0 ?
+                dataSize / (hi_->channels * ((hi_->bitsPerSample + 7) / 8)) : 0;
+
+    rangeFirst_ = 0;
+    rangeSize_ = hi_->numSamples;
+    rangeLeft_ = hi_->numSamples;
+}
+
 bool RiffWave::isValid() const
 {
     return hi_ != NULL;
 }
 
-bool RiffWave::unpackReadSamples(int *buffer, size_t count, size_t &rs)
+bool RiffWave::unpackReadSamples(
+        int32_t *left,
+        int32_t *right,
+        uint8_t *readBuffer,
+        size_t count,
+        size_t &rs)
 {
-    const int b = sizeof(int) * 8;
-    int bytesPerSample = hi_->bitsPerSample / 8;
-    bool swapOrder = bytesPerSample == 1;
-
+    rs = 0;
     if (!isValid())
         return false;
 
-    if (!f_) {
+    int bytesPerSample = hi_->bitsPerSample / 8;
+    int blockSize = hi_->channels * bytesPerSample;
+
+    if (!reader_) {
         if (!seekStart())
             return false;
     }
 
-    if (feof(f_)) {
-        rs = 0;
+    // Reading is limited by the range, stream of unknown size
+    // is read until its end:
+    bool isBounded = hi_->dataSize >= 0;
+    if (isBounded && count > rangeLeft_)
+        count = rangeLeft_;
+    if (!count)
         return true;
+
+    size_t rb = 0;
+    const uint8_t *ip = reader_->read(readBuffer, count * blockSize, rb);
+    if (!ip)
+        return false;
+
+    rs = rb / blockSize;
+    if (isBounded) {
+        rangeLeft_ -= rs;
+        if (rs != count)
+            rangeLeft_ = 0;
     }
 
-    rs = fread(buffer, bytesPerSample, count, f_);
-    if (rs != count) {
-        if (ferror(f_))
+    PcmUnpackFunc unpack = PcmUnpack::kernel(bytesPerSample, hi_->channels);
+    if (!unpack)
+        return false;
+    unpack(ip, rs, left, right);
+
+    return true;
+}
+
+bool RiffWave::seekStart()
+{
+    if (!isValid())
+        return false;
+
+    int blockSize = hi_->channels * (hi_->bitsPerSample / 8);
+    long offset = hi_->dataOffset + rangeFirst_ * blockSize;
+    long size = rangeSize_ * blockSize;
+    rangeLeft_ = rangeSize_;
+
+    if (stream_) {
+        // Stream can't be rewound, it is read only once:
+        if (reader_)
             return false;
+        reader_ = new StreamWaveReader(stream_, interrupt_);
+        return reader_->open(riffWavePath_, 0, hi_->dataSize);
     }
 
-    unsigned char *ip = reinterpret_cast<unsigned char *>(buffer);
-    int *op = buffer + rs;
-
-    // Lame frontend algo:
-    if (!swapOrder) {
-
-        if (bytesPerSample == 1) {
-            for(int i = rs * bytesPerSample; (i -= bytesPerSample) >=0;)
-                * --op = ip[i] << (b - 8);
-        } else if (bytesPerSample == 2) {
-            for(int i = rs * bytesPerSample; (i -= bytesPerSample) >=0;)
-                * --op = ip[i] << (b - 16) | ip[i + 1] << (b - 8);
-        } else if (bytesPerSample == 3) {
-            for(int i = rs * bytesPerSample; (i -= bytesPerSample) >=0;)
-                * --op = ip[i] << (b - 24) | ip[i + 1] << (b - 16) | ip[i + 2] << (b - 8);
-        } else if (bytesPerSample == 4) {
-            for(int i = rs * bytesPerSample; (i -= bytesPerSample) >=0;)
-                * --op = ip[i] << (b - 32) | ip[i + 1] << (b - 24) | ip[i + 2] << (b - 16) | ip[i + 3] << (b - 8);
-        }
+#ifdef __linux__
+    // Reads of the worker are queued to its ring, regular readers
+    // are used if the ring is busy or the file can't be opened:
+    if (!reader_ && ioRing_) {
+        reader_ = new UringWaveReader(ioRing_);
+        if (reader_->open(riffWavePath_, offset, size))
+            return true;
+        delete reader_;
+        reader_ = NULL;
+    }
+#endif
 
-    } else {
-
-        if (bytesPerSample == 1) {
-            for(int i = rs * bytesPerSample; (i -= bytesPerSample) >=0;)
-                * --op = (ip[i] ^ 0x80) << (b - 8) | 0x7f << (b - 16); /* convert from unsigned */
-        } else if (bytesPerSample == 2) {
-            for(int i = rs * bytesPerSample; (i -= bytesPerSample) >=0;)
-                * --op = ip[i] << (b - 8) | ip[i + 1] << (b - 16);
-        } else if (bytesPerSample == 3) {
-            for(int i = rs * bytesPerSample; (i -= bytesPerSample) >=0;)
-                * --op = ip[i] << (b - 8) | ip[i + 1] << (b - 16) | ip[i + 2] << (b - 24);
-        } else if (bytesPerSample == 4) {
-            for(int i = rs * bytesPerSample; (i -= bytesPerSample) >=0;)
-                * --op = ip[i] << (b - 8) | ip[i + 1] << (b - 16) | ip[i + 2] << (b - 24) | ip[i + 3] << (b - 32);
-        }
+    if (!reader_)
+        reader_ = WaveReader::create(readerType_);
+    if (reader_->open(riffWavePath_, offset, size))
+        return true;
 
+    // Fallback to the plain stdio reading:
+    if (readerType_ != WaveReaderStdio) {
+        delete reader_;
+        reader_ = WaveReader::create(WaveReaderStdio);
+        if (reader_->open(riffWavePath_, offset, size))
+            return true;
     }
 
-    return true;
+    delete reader_;
+    reader_ = NULL;
+    return false;
 }
 
-bool RiffWave::seekStart()
+void RiffWave::setReaderType(WaveReaderType type)
 {
-    if (!isValid())
+    // Stream has its own reader:
+    if (stream_)
+        return;
+
+    readerType_ = type;
+    if (reader_) {
+        delete reader_;
+        reader_ = NULL;
+    }
+}
+
+void RiffWave::setIoRing(IoRing *ring)
+{
+    if (stream_ || ring == ioRing_)
+        return;
+
+    ioRing_ = ring;
+    if (reader_) {
+        delete reader_;
+        reader_ = NULL;
+    }
+}
+
+void RiffWave::closeReader()
+{
+    if (reader_) {
+        delete reader_;
+        reader_ = NULL;
+    }
+    ioRing_ = NULL;
+}
+
+bool RiffWave::setReadRange(unsigned long firstSample, unsigned long numSamples)
+{
+    if (!isValid() || stream_)
         return false;
 
-    if (!f_) {
-        f_ = fopen(riffWavePath_.c_str(), "rb");
-        if (!f_)
-            return false;
+    if (firstSample > hi_->numSamples || numSamples > hi_->numSamples - firstSample)
+        return false;
+
+    rangeFirst_ = firstSample;
+    rangeSize_ = numSamples;
+    rangeLeft_ = numSamples;
+
+    // Next read will seek to the range start:
+    if (reader_) {
+        delete reader_;
+        reader_ = NULL;
     }
 
-    return fseek(f_, hi_->dataOffset, SEEK_SET) == 0;
+    return true;
 }
 
 void RiffWave::clear()
 {
     riffWavePath_.clear();
+    stream_ = NULL;
+    ioRing_ = NULL;
+    interrupt_ = NULL;
+    rangeFirst_ = 0;
+    rangeSize_ = 0;
+    rangeLeft_ = 0;
 
     if (f_) {
         fclose(f_);
         f_ = NULL;
     }
 
+    if (reader_) {
+        delete reader_;
+        reader_ = NULL;
+    }
+
     if (hi_) {
         delete hi_;
         hi_ = NULL;
@@ -394,9 +621,21 @@ int RiffWave::numSamples() const
     return hi_->numSamples;
 }
 
-size_t RiffWave::dataSize() const
+int RiffWave::blockSize() const
 {
     if (!hi_)
         return 0;
+    return hi_->channels * (hi_->bitsPerSample / 8);
+}
+
+size_t RiffWave::dataSize() const
+{
+    if (!hi_ || hi_->dataSize < 0)
+        return 0;
     return static_cast<size_t>(hi_->dataSize);
 }
+
+bool RiffWave::isSizeKnown() const
+{
+    return hi_ && hi_->dataSize >= 0;
+}
@@ -6,10 +6,12 @@
 #include <string>
 
 #include "logging_utils.h"
+#include "wave_reader.h"
 
 namespace GMp3Enc {
 
 struct RiffWaveHeaderInternal;
+class RiffHeaderInput;
 
 class RiffWave
 {
@@ -22,24 +24,65 @@ public:
     RiffWave &operator=(const RiffWave &other);
 
     bool readWave(const std::string &riffWavePath);
+
+    // Parses the header reading the stream only forward, data is read
+    // from the stream afterwards. The stream is not owned.
+    bool readWaveStream(FILE *stream, const std::string &name);
     bool isValid() const;
 
-    bool unpackReadSamples(int *buffer, size_t count, size_t &rs);
+    // Reads up to count samples per channel and unpacks them into planar
+    // buffers (right is not used for mono). readBuffer must have room for
+    // count raw sample blocks, it is used when data can't be taken
+    // directly from the reader.
+    bool unpackReadSamples(
+            int32_t *left,
+            int32_t *right,
+            uint8_t *readBuffer,
+            size_t count,
+            size_t &rs);
     bool seekStart();
+    bool setReadRange(unsigned long firstSample, unsigned long numSamples);
+    void setReaderType(WaveReaderType type);
+
+    // Data is read ahead through the io_uring of the calling worker.
+    // The ring is not copied with the wave, closeReader() must be called
+    // by the same thread before the ring serves another wave.
+    void setIoRing(IoRing *ring);
+    void closeReader();
+
+    // Reading of a stream stops with an error when it is interrupted.
+    // Not copied with the wave.
+    inline void setReadInterrupt(ReadInterrupt *interrupt) { interrupt_ = interrupt; }
     void clear();
 
     short int channelsNumber() const;
     int samplesPerSec() const;
     int avgBytesPerSec() const;
     int numSamples() const;
+    int blockSize() const;
     size_t dataSize() const;
 
+    // Streams may have unknown size, numSamples() and dataSize() are 0 then.
+    bool isSizeKnown() const;
+
+    inline bool isStream() const { return stream_ != NULL; }
     inline std::string riffWavePath() const { return riffWavePath_; }
 
 private:
+    bool readHeader(RiffHeaderInput &f, long &dataSize);
+    void setDataSize(long dataSize);
+
     std::string riffWavePath_;
     FILE *f_;
+    FILE *stream_;
     RiffWaveHeaderInternal *hi_;
+    WaveReader *reader_;
+    WaveReaderType readerType_;
+    IoRing *ioRing_;
+    ReadInterrupt *interrupt_;
+    unsigned long rangeFirst_;
+    unsigned long rangeSize_;
+    unsigned long rangeLeft_;
 
 };
 
@@ -0,0 +1,351 @@
+#include "shared_pcm_source.h"
+
+#include "atomic_utils.h"
+#include "encoding_task.h"
+#include "worker_thread.h"
+
+using namespace GMp3Enc;
+
+SharedPcmSource::SharedPcmSource(size_t outputs)
+    : refs_(1)
+    , outputsCount_(outputs)
+    , readerType_(WaveReaderStdio)
+    , prepareState_(0)
+    , firstIndex_(0)
+    , activeLanes_(0)
+    , isReading_(false)
+    , isEnd_(false)
+    , isFailed_(false)
+{
+    lanes_.reserve(outputs);
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&condv_, NULL);
+}
+
+SharedPcmSource::~SharedPcmSource()
+{
+    for (size_t i = 0; i < blocks_.size(); i++)
+        delete blocks_[i];
+    for (size_t i = 0; i < freeBlocks_.size(); i++)
+        delete freeBlocks_[i];
+    pthread_cond_destroy(&condv_);
+    pthread_mutex_destroy(&mutex_);
+}
+
+SharedPcmSource* SharedPcmSource::create(const RiffWave &wave, size_t outputs)
+{
+    // Stream can't be read by tasks which fall behind:
+    if (!wave.isValid() || wave.isStream())
+        return NULL;
+
+    SharedPcmSource *source = new SharedPcmSource(outputs);
+    source->path_ = wave.riffWavePath();
+    source->wave_ = wave;
+    source->reader_ = wave;
+    source->prepareState_ = 1;
+    return source;
+}
+
+SharedPcmSource* SharedPcmSource::createDeferred(
+        const std::string &path,
+        WaveReaderType readerType,
+        size_t outputs)
+{
+    SharedPcmSource *source = new SharedPcmSource(outputs);
+    source->path_ = path;
+    source->readerType_ = readerType;
+    return source;
+}
+
+void SharedPcmSource::retain()
+{
+    atomicFetchAdd(&refs_, 1L);
+}
+
+void SharedPcmSource::release()
+{
+    if (atomicFetchAdd(&refs_, -1L) == 1)
+        delete this;
+}
+
+bool SharedPcmSource::prepare()
+{
+    MutexGuard g(&mutex_);
+    if (prepareState_ == 0) {
+        prepareState_ = wave_.readWave(path_) ? 1 : -1;
+        if (prepareState_ == 1) {
+            wave_.setReaderType(readerType_);
+            reader_ = wave_;
+        }
+    }
+    return prepareState_ == 1;
+}
+
+void SharedPcmSource::addOutput(EncodingTask *task)
+{
+    MutexGuard g(&mutex_);
+    Lane lane;
+    lane.task = task;
+    lane.driver = NULL;
+    lane.position = 0;
+    lane.isStarted = false;
+    lane.isBusy = false;
+    lane.isDone = false;
+    lanes_.push_back(lane);
+    activeLanes_++;
+}
+
+void SharedPcmSource::encode(EncodingTask *task, WorkerThread *executor, uint8_t *mp3Buffer)
+{
+    MutexGuard g(&mutex_);
+    Lane *own = findLane(task);
+    if (!own)
+        return;
+
+    // The lane could be adopted by another task, it is taken back
+    // between blocks:
+    while (own->isBusy)
+        pthread_cond_wait(&condv_, &mutex_);
+    if (own->isDone)
+        return;
+    own->driver = task;
+
+    // The task is parsed only while it holds own lane, a driver of
+    // the adopted lane could be preparing it in beginEncoding():
+    own->isBusy = true;
+    g.unlock();
+    bool isValid = task->prepare();
+    g.lock();
+    own->isBusy = false;
+
+    if (!isValid) {
+        setLaneDone(own);
+        pthread_cond_broadcast(&condv_);
+        return;
+    }
+
+    bool isInterrupted = false;
+    while (true) {
+        if (executor && executor->checkCancelationSignal()) {
+            isInterrupted = true;
+            break;
+        }
+
+        // The most behind lane goes first, so adopted lanes catch up
+        // and release the oldest blocks:
+        Lane *lane = nextLane(task);
+        if (!lane)
+            break;
+
+        // Every output has own cancellation and deadline:
+        if (lane->task->checkInterrupt(executor)) {
+            cancelLane(g, lane, mp3Buffer);
+        } else if (lane->position < firstIndex_ + blocks_.size()) {
+            encodeBlock(g, lane, executor, mp3Buffer);
+        } else if (isEnd_ || isFailed_) {
+            finishLane(g, lane, executor, mp3Buffer);
+        } else if (isReading_) {
+            pthread_cond_wait(&condv_, &mutex_);
+        } else if (blocks_.size() < MAX_BLOCKS) {
+            readBlock(g);
+        } else if (!adoptWaitingLanes(task)) {
+            // Running tasks are behind, the oldest block is still needed:
+            pthread_cond_wait(&condv_, &mutex_);
+        }
+    }
+
+    if (isInterrupted) {
+        // Adopted lanes are left to their own tasks:
+        for (size_t i = 0; i < lanes_.size(); i++) {
+            if (lanes_[i].driver == task && lanes_[i].task != task)
+                lanes_[i].driver = NULL;
+        }
+        if (!own->isDone && task->checkInterrupt(executor))
+            cancelLane(g, own, mp3Buffer);
+        pthread_cond_broadcast(&condv_);
+    }
+}
+
+SharedPcmSource::Lane* SharedPcmSource::findLane(EncodingTask *task)
+{
+    for (size_t i = 0; i < lanes_.size(); i++) {
+        if (lanes_[i].task == task)
+            return &lanes_[i];
+    }
+    return NULL;
+}
+
+SharedPcmSource::Lane* SharedPcmSource::nextLane(EncodingTask *driver)
+{
+    Lane *next = NULL;
+    for (size_t i = 0; i < lanes_.size(); i++) {
+        Lane &lane = lanes_[i];
+        if (lane.driver != driver || lane.isDone)
+            continue;
+        if (!next || lane.position < next->position)
+            next = &lane;
+    }
+    return next;
+}
+
+bool SharedPcmSource::adoptWaitingLanes(EncodingTask *driver)
+{
+    bool isAdopted = false;
+    for (size_t i = 0; i < lanes_.size(); i++) {
+        Lane &lane = lanes_[i];
+        if (!lane.driver && !lane.isDone && !lane.isBusy) {
+            lane.driver = driver;
+            isAdopted = true;
+        }
+    }
+    return isAdopted;
+}
+
+void SharedPcmSource::readBlock(MutexGuard &g)
+{
+    Block *b;
+    if (!freeBlocks_.empty()) {
+        b = freeBlocks_.back();
+        freeBlocks_.pop_back();
+    } else {
+        b = new Block;
+        b->left.resize(BLOCK_SAMPLES);
+        b->right.resize(BLOCK_SAMPLES);
+    }
+    if (readBuffer_.empty())
+        readBuffer_.resize(BLOCK_SAMPLES * reader_.blockSize());
+
+    // Blocks already kept are available to other tasks while the next
+    // one is being read:
+    isReading_ = true;
+    g.unlock();
+
+    size_t rs = 0;
+    bool isok = reader_.unpackReadSamples(
+                &b->left[0],
+                &b->right[0],
+                &readBuffer_[0],
+                BLOCK_SAMPLES,
+                rs);
+
+    g.lock();
+    isReading_ = false;
+    if (!isok || !rs) {
+        freeBlocks_.push_back(b);
+        if (!isok)
+            isFailed_ = true;
+        else
+            isEnd_ = true;
+    } else {
+        b->samples = rs;
+        b->refs = static_cast<long>(activeLanes_);
+        blocks_.push_back(b);
+    }
+    pthread_cond_broadcast(&condv_);
+}
+
+void SharedPcmSource::encodeBlock(
+        MutexGuard &g,
+        Lane *lane,
+        WorkerThread *executor,
+        uint8_t *mp3Buffer)
+{
+    // The block is kept until this lane has encoded it:
+    Block *b = blockAt(lane->position);
+    EncodingTask *task = lane->task;
+    bool needBegin = !lane->isStarted;
+    bool writeBehind = lane->driver == task;
+    lane->isBusy = true;
+    lane->isStarted = true;
+    g.unlock();
+
+    bool isStarted = !needBegin || task->beginEncoding(executor, writeBehind);
+    bool isok = isStarted && task->encodeSamples(&b->left[0], &b->right[0], b->samples, mp3Buffer);
+    if (isStarted && !isok)
+        task->finishEncoding(mp3Buffer);
+
+    g.lock();
+    lane->isBusy = false;
+    lane->position++;
+    b->refs--;
+    if (!isok)
+        setLaneDone(lane);
+    dropEncodedBlocks();
+    pthread_cond_broadcast(&condv_);
+}
+
+void SharedPcmSource::finishLane(
+        MutexGuard &g,
+        Lane *lane,
+        WorkerThread *executor,
+        uint8_t *mp3Buffer)
+{
+    EncodingTask *task = lane->task;
+    bool needBegin = !lane->isStarted;
+    bool writeBehind = lane->driver == task;
+    bool isFailed = isFailed_ && lane->position >= firstIndex_ + blocks_.size();
+    lane->isBusy = true;
+    lane->isStarted = true;
+    g.unlock();
+
+    // Empty source still gives a valid mp3:
+    if (isFailed) {
+        task->setSourceError();
+        if (!needBegin)
+            task->finishEncoding(mp3Buffer);
+    } else if (!needBegin || task->beginEncoding(executor, writeBehind)) {
+        task->finishEncoding(mp3Buffer);
+    }
+
+    g.lock();
+    lane->isBusy = false;
+    setLaneDone(lane);
+    dropEncodedBlocks();
+    pthread_cond_broadcast(&condv_);
+}
+
+void SharedPcmSource::cancelLane(MutexGuard &g, Lane *lane, uint8_t *mp3Buffer)
+{
+    // Started output is closed without flushing lame:
+    bool isStarted = lane->isStarted;
+    lane->isBusy = true;
+    g.unlock();
+
+    if (isStarted)
+        lane->task->finishEncoding(mp3Buffer);
+
+    g.lock();
+    lane->isBusy = false;
+    setLaneDone(lane);
+    dropEncodedBlocks();
+    pthread_cond_broadcast(&condv_);
+}
+
+void SharedPcmSource::setLaneDone(Lane *lane)
+{
+    lane->isDone = true;
+    activeLanes_--;
+
+    // Rest of the kept blocks are not needed by the lane anymore:
+    unsigned long first = lane->position > firstIndex_ ? lane->position : firstIndex_;
+    for (size_t i = first - firstIndex_; i < blocks_.size(); i++)
+        blocks_[i]->refs--;
+}
+
+SharedPcmSource::Block* SharedPcmSource::blockAt(unsigned long index)
+{
+    if (index < firstIndex_ || index - firstIndex_ >= blocks_.size())
+        return NULL;
+    return blocks_[index - firstIndex_];
+}
+
+void SharedPcmSource::dropEncodedBlocks()
+{
+    // Lanes go through blocks in order, so encoded blocks are
+    // at the front:
+    while (!blocks_.empty() && blocks_.front()->refs <= 0) {
+        freeBlocks_.push_back(blocks_.front());
+        blocks_.pop_front();
+        firstIndex_++;
+    }
+}
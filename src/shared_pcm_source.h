@@ -0,0 +1,123 @@
+#ifndef GMP3ENC_SHARED_PCM_SOURCE_
+#define GMP3ENC_SHARED_PCM_SOURCE_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "message_queue.h"
+#include "riff_wave.h"
+
+namespace GMp3Enc {
+
+class EncodingTask;
+class WorkerThread;
+
+// Wave file encoded into several outputs, one task per output. Samples
+// are read and unpacked once into blocks, which are shared by the tasks
+// running on different workers. A block is dropped when all outputs
+// have encoded it.
+//
+// Every output is a lane, a running task drives its own lane. Only
+// a window of blocks is kept: when it is full and some tasks are still
+// waiting in the queue, the running task adopts their lanes and encodes
+// them too, so the file is never read twice. A task which starts later
+// takes its lane back and continues where the other one has stopped.
+// Reference counted, every task holds a reference.
+class SharedPcmSource
+{
+public:
+    static const size_t BLOCK_SAMPLES = 1152 * 4;
+    static const size_t MAX_BLOCKS = 64;
+
+    // The source is created with one reference owned by the caller.
+    static SharedPcmSource* create(const RiffWave &wave, size_t outputs);
+
+    // The header is parsed by the first task which runs.
+    static SharedPcmSource* createDeferred(
+            const std::string &path,
+            WaveReaderType readerType,
+            size_t outputs);
+
+    void retain();
+    void release();
+
+    inline std::string path() const { return path_; }
+    inline size_t outputsCount() const { return outputsCount_; }
+
+    // Parses the header once, later calls return the same result.
+    bool prepare();
+
+    // Valid after prepare() has succeeded.
+    inline const RiffWave& wave() const { return wave_; }
+
+    // Adds the task of the next output. All outputs are added before
+    // any of the tasks is executed.
+    void addOutput(EncodingTask *task);
+
+    // Called by the task on its worker. Returns when the task's own
+    // output and the outputs it has adopted are done, the result is
+    // stored in the task.
+    void encode(EncodingTask *task, WorkerThread *executor, uint8_t *mp3Buffer);
+
+private:
+    SharedPcmSource(size_t outputs);
+    ~SharedPcmSource();
+    SharedPcmSource(const SharedPcmSource&);
+    SharedPcmSource& operator=(const SharedPcmSource&);
+
+    struct Block
+    {
+        std::vector<int32_t> left;
+        std::vector<int32_t> right;
+        size_t samples;
+        long refs;  // Outputs which have not encoded the block yet.
+    };
+
+    struct Lane
+    {
+        EncodingTask *task;
+        EncodingTask *driver;    // Task encoding the lane, NULL - nobody.
+        unsigned long position;  // Next block to be encoded.
+        bool isStarted;
+        bool isBusy;             // The driver works on it without the lock.
+        bool isDone;
+    };
+
+    Lane* findLane(EncodingTask *task);
+    Lane* nextLane(EncodingTask *driver);
+    bool adoptWaitingLanes(EncodingTask *driver);
+    void readBlock(MutexGuard &g);
+    void encodeBlock(MutexGuard &g, Lane *lane, WorkerThread *executor, uint8_t *mp3Buffer);
+    void finishLane(MutexGuard &g, Lane *lane, WorkerThread *executor, uint8_t *mp3Buffer);
+    void cancelLane(MutexGuard &g, Lane *lane, uint8_t *mp3Buffer);
+    void setLaneDone(Lane *lane);
+    Block* blockAt(unsigned long index);
+    void dropEncodedBlocks();
+
+    volatile long refs_;
+    size_t outputsCount_;
+    pthread_mutex_t mutex_;
+    pthread_cond_t condv_;
+    std::string path_;
+    WaveReaderType readerType_;
+    int prepareState_;  // 0 - not parsed, 1 - valid, -1 - invalid.
+    RiffWave wave_;
+    RiffWave reader_;
+    std::vector<uint8_t> readBuffer_;
+    std::deque<Block*> blocks_;
+    std::vector<Block*> freeBlocks_;
+    unsigned long firstIndex_;  // Index of blocks_.front().
+    std::vector<Lane> lanes_;
+    size_t activeLanes_;
+    bool isReading_;
+    bool isEnd_;
+    bool isFailed_;
+};
+
+}
+
+#endif
@@ -0,0 +1,46 @@
+#include "task_ordering.h"
+
+#include "encoding_task.h"
+
+using namespace GMp3Enc;
+
+TaskOrderingPolicy* TaskOrderingPolicy::create(const std::string &name)
+{
+    if (name == "fifo")
+        return new FifoOrdering();
+    if (name == "lpt")
+        return new LargestFirstOrdering();
+    if (name == "spt")
+        return new SmallestFirstOrdering();
+    return NULL;
+}
+
+long long FifoOrdering::key(const EncodingTask *) const
+{
+    return 0;
+}
+
+const char* FifoOrdering::name() const
+{
+    return "fifo";
+}
+
+long long LargestFirstOrdering::key(const EncodingTask *task) const
+{
+    return -static_cast<long long>(task->workload());
+}
+
+const char* LargestFirstOrdering::name() const
+{
+    return "lpt";
+}
+
+long long SmallestFirstOrdering::key(const EncodingTask *task) const
+{
+    return static_cast<long long>(task->workload());
+}
+
+const char* SmallestFirstOrdering::name() const
+{
+    return "spt";
+}
@@ -0,0 +1,57 @@
+#ifndef GMP3ENC_TASK_ORDERING_
+#define GMP3ENC_TASK_ORDERING_
+
+#include <string>
+
+namespace GMp3Enc {
+
+class EncodingTask;
+
+// Defines in which order tasks are submitted to workers. Tasks with
+// smaller keys go first, equal keys keep the order in which tasks
+// were found.
+class TaskOrderingPolicy
+{
+public:
+    virtual ~TaskOrderingPolicy() {}
+
+    virtual long long key(const EncodingTask *task) const = 0;
+    virtual const char* name() const = 0;
+
+    // Whether keys depend on file sizes, so they must be known
+    // before tasks are ordered.
+    virtual bool usesWorkload() const { return true; }
+
+    // Known policies: fifo, lpt (largest first), spt (smallest first).
+    static TaskOrderingPolicy* create(const std::string &name);
+};
+
+// Tasks are executed in the order they were found.
+class FifoOrdering : public TaskOrderingPolicy
+{
+public:
+    long long key(const EncodingTask *task) const;
+    const char* name() const;
+    bool usesWorkload() const { return false; }
+};
+
+// Longest processing time first. A large file found last doesn't
+// run alone after the rest of the batch is done.
+class LargestFirstOrdering : public TaskOrderingPolicy
+{
+public:
+    long long key(const EncodingTask *task) const;
+    const char* name() const;
+};
+
+// Shortest processing time first, gives the lowest average latency.
+class SmallestFirstOrdering : public TaskOrderingPolicy
+{
+public:
+    long long key(const EncodingTask *task) const;
+    const char* name() const;
+};
+
+}
+
+#endif
@@ -0,0 +1,333 @@
+#include "task_scheduler.h"
+
+#include <sched.h>
+
+#include "atomic_utils.h"
+#include "message_queue.h"
+
+using namespace GMp3Enc;
+
+WorkStealingDeque::WorkStealingDeque(size_t capacity)
+    : top_(0)
+    , bottom_(0)
+{
+    capacity = roundUpPowerOfTwo(capacity);
+    buffer_ = new EncodingTask*[capacity];
+    mask_ = static_cast<long>(capacity) - 1;
+}
+
+WorkStealingDeque::~WorkStealingDeque()
+{
+    delete[] buffer_;
+}
+
+bool WorkStealingDeque::push(EncodingTask *task)
+{
+    long b = atomicLoadRelaxed(&bottom_);
+    long t = atomicLoadAcquire(&top_);
+    if (b - t > mask_)
+        return false;
+
+    atomicStoreRelaxed(&buffer_[b & mask_], task);
+    atomicFenceRelease();
+    atomicStoreRelaxed(&bottom_, b + 1);
+    return true;
+}
+
+EncodingTask* WorkStealingDeque::pop()
+{
+    long b = atomicLoadRelaxed(&bottom_) - 1;
+    atomicStoreRelaxed(&bottom_, b);
+    atomicFenceSeqCst();
+    long t = atomicLoadRelaxed(&top_);
+
+    if (t > b) {
+        // Deque is empty:
+        atomicStoreRelaxed(&bottom_, b + 1);
+        return NULL;
+    }
+
+    EncodingTask *task = atomicLoadRelaxed(&buffer_[b & mask_]);
+    if (t == b) {
+        // The last task, race with thieves:
+        if (!atomicCompareExchange(&top_, t, t + 1))
+            task = NULL;
+        atomicStoreRelaxed(&bottom_, b + 1);
+    }
+
+    return task;
+}
+
+bool WorkStealingDeque::isEmpty() const
+{
+    return atomicLoadAcquire(&top_) >= atomicLoadAcquire(&bottom_);
+}
+
+EncodingTask* WorkStealingDeque::steal()
+{
+    long t = atomicLoadAcquire(&top_);
+    atomicFenceSeqCst();
+    long b = atomicLoadAcquire(&bottom_);
+
+    if (t >= b)
+        return NULL;
+
+    EncodingTask *task = atomicLoadRelaxed(&buffer_[t & mask_]);
+    if (!atomicCompareExchange(&top_, t, t + 1))
+        return NULL;
+
+    return task;
+}
+
+InjectionQueue::InjectionQueue(size_t capacity)
+    : enqueuePos_(0)
+    , dequeuePos_(0)
+{
+    capacity = roundUpPowerOfTwo(capacity);
+    cells_ = new Cell[capacity];
+    mask_ = static_cast<long>(capacity) - 1;
+    for (size_t i = 0; i < capacity; i++) {
+        cells_[i].sequence = static_cast<long>(i);
+        cells_[i].task = NULL;
+    }
+}
+
+InjectionQueue::~InjectionQueue()
+{
+    delete[] cells_;
+}
+
+bool InjectionQueue::push(EncodingTask *task)
+{
+    Cell *cell;
+    long pos = atomicLoadRelaxed(&enqueuePos_);
+    while (true) {
+        cell = &cells_[pos & mask_];
+        long seq = atomicLoadAcquire(&cell->sequence);
+        long dif = seq - pos;
+        if (dif == 0) {
+            if (atomicCompareExchange(&enqueuePos_, pos, pos + 1))
+                break;
+            pos = atomicLoadRelaxed(&enqueuePos_);
+        } else if (dif < 0) {
+            return false;
+        } else {
+            pos = atomicLoadRelaxed(&enqueuePos_);
+        }
+    }
+
+    cell->task = task;
+    atomicStoreRelease(&cell->sequence, pos + 1);
+    return true;
+}
+
+EncodingTask* InjectionQueue::pop()
+{
+    Cell *cell;
+    long pos = atomicLoadRelaxed(&dequeuePos_);
+    while (true) {
+        cell = &cells_[pos & mask_];
+        long seq = atomicLoadAcquire(&cell->sequence);
+        long dif = seq - (pos + 1);
+        if (dif == 0) {
+            if (atomicCompareExchange(&dequeuePos_, pos, pos + 1))
+                break;
+            pos = atomicLoadRelaxed(&dequeuePos_);
+        } else if (dif < 0) {
+            return NULL;
+        } else {
+            pos = atomicLoadRelaxed(&dequeuePos_);
+        }
+    }
+
+    EncodingTask *task = cell->task;
+    atomicStoreRelease(&cell->sequence, pos + mask_ + 1);
+    return task;
+}
+
+TaskScheduler::TaskScheduler(size_t workersCount)
+    : seeds_(workersCount)
+    , injectionQueue_(INJECTION_CAPACITY)
+    , sleepers_(0)
+    , isValid_(0)
+    , isInitialized_(false)
+{
+    deques_.resize(workersCount);
+    for (size_t i = 0; i < deques_.size(); i++) {
+        deques_[i] = new WorkStealingDeque(DEQUE_CAPACITY);
+        seeds_[i] = 2463534242UL + i;
+    }
+}
+
+TaskScheduler::~TaskScheduler()
+{
+    for (size_t i = 0; i < deques_.size(); i++)
+        delete deques_[i];
+
+    if (isInitialized_) {
+        pthread_cond_destroy(&condv_);
+        pthread_mutex_destroy(&mutex_);
+    }
+}
+
+bool TaskScheduler::init()
+{
+    if (isInitialized_)
+        return true;
+
+    int r = pthread_mutex_init(&mutex_, NULL);
+    if (r)
+        return false;
+    r = pthread_cond_init(&condv_, NULL);
+    if (r) {
+        pthread_mutex_destroy(&mutex_);
+        return false;
+    }
+
+    isInitialized_ = true;
+    atomicStoreRelease(&isValid_, 1L);
+    return true;
+}
+
+void TaskScheduler::invalidate()
+{
+    if (!isInitialized_)
+        return;
+
+    MutexGuard g(&mutex_);
+    atomicStoreRelease(&isValid_, 0L);
+    pthread_cond_broadcast(&condv_);
+}
+
+bool TaskScheduler::submit(EncodingTask *task)
+{
+    while (!injectionQueue_.push(task)) {
+        if (!isValid())
+            return false;
+        wakeWorker();
+        sched_yield();
+    }
+
+    wakeWorker();
+    return true;
+}
+
+void TaskScheduler::setWorkerNodes(const std::vector<int> &nodes)
+{
+    workerNodes_ = nodes;
+}
+
+bool InjectionQueue::isEmpty() const
+{
+    return atomicLoadAcquire(&dequeuePos_) >= atomicLoadAcquire(&enqueuePos_);
+}
+
+bool TaskScheduler::hasQueuedTasks() const
+{
+    if (!injectionQueue_.isEmpty())
+        return true;
+    for (size_t i = 0; i < deques_.size(); i++) {
+        if (!deques_[i]->isEmpty())
+            return true;
+    }
+    return false;
+}
+
+bool TaskScheduler::acquire(size_t worker, EncodingTask *&task)
+{
+    bool hasMore = false;
+    while (isValid()) {
+        task = findTask(worker, hasMore);
+        if (task) {
+            if (hasMore)
+                wakeWorker();
+            return true;
+        }
+
+        // Going to sleep. A task submitted after sleepers_ counter was
+        // increased is found by the check below or wakes us up.
+        MutexGuard g(&mutex_);
+        atomicFetchAdd(&sleepers_, 1);
+        task = findTask(worker, hasMore);
+        if (!task && isValid())
+            pthread_cond_wait(&condv_, &mutex_);
+        atomicFetchAdd(&sleepers_, -1);
+
+        if (task) {
+            if (hasMore && atomicLoadRelaxed(&sleepers_) > 0)
+                pthread_cond_signal(&condv_);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+EncodingTask* TaskScheduler::findTask(size_t worker, bool &hasMore)
+{
+    hasMore = false;
+
+    EncodingTask *task = deques_[worker]->pop();
+    if (task)
+        return task;
+
+    // Rest of the batch is left in the own deque, so other
+    // workers can steal it. It is pushed in reverse order, so the owner
+    // keeps the submission order.
+    task = injectionQueue_.pop();
+    if (task) {
+        EncodingTask *batch[INJECTION_BATCH];
+        size_t n = 0;
+        while (n < INJECTION_BATCH - 1) {
+            batch[n] = injectionQueue_.pop();
+            if (!batch[n])
+                break;
+            n++;
+        }
+        while (n > 0)
+            deques_[worker]->push(batch[--n]);
+        hasMore = batch[0] != NULL;
+        return task;
+    }
+
+    // xorshift to choose the first victim:
+    unsigned long &seed = seeds_[worker];
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+
+    // Victims of the own node are tried in the first pass:
+    size_t n = deques_.size();
+    size_t start = seed % n;
+    bool isLocalFirst = !workerNodes_.empty();
+    for (size_t i = 0; i < (isLocalFirst ? 2 * n : n); i++) {
+        size_t victim = (start + i) % n;
+        if (victim == worker)
+            continue;
+        if (isLocalFirst && (workerNodes_[victim] == workerNodes_[worker]) != (i < n))
+            continue;
+        task = deques_[victim]->steal();
+        if (task) {
+            // Victim could have more tasks, next sleeping worker
+            // will try to steal them too.
+            hasMore = true;
+            return task;
+        }
+    }
+
+    return NULL;
+}
+
+void TaskScheduler::wakeWorker()
+{
+    atomicFenceSeqCst();
+    if (atomicLoadRelaxed(&sleepers_) > 0) {
+        MutexGuard g(&mutex_);
+        pthread_cond_signal(&condv_);
+    }
+}
+
+bool TaskScheduler::isValid() const
+{
+    return atomicLoadAcquire(&isValid_) != 0;
+}
@@ -0,0 +1,123 @@
+#ifndef GMP3ENC_TASK_SCHEDULER_
+#define GMP3ENC_TASK_SCHEDULER_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <vector>
+
+namespace GMp3Enc {
+
+class EncodingTask;
+
+// Bounded Chase-Lev deque. Only the owner thread pushes and pops tasks
+// at the bottom, other threads steal them from the top.
+class WorkStealingDeque
+{
+public:
+    explicit WorkStealingDeque(size_t capacity);
+    ~WorkStealingDeque();
+
+    bool push(EncodingTask *task);
+    EncodingTask* pop();
+    EncodingTask* steal();
+    bool isEmpty() const;
+
+private:
+    WorkStealingDeque(const WorkStealingDeque&);
+    WorkStealingDeque& operator=(const WorkStealingDeque&);
+
+    // top_ and bottom_ are changed by different threads:
+    volatile long top_;
+    char topPadding_[64 - sizeof(long)];
+    volatile long bottom_;
+    char bottomPadding_[64 - sizeof(long)];
+    EncodingTask * volatile *buffer_;
+    long mask_;
+};
+
+// Bounded lock-free queue (D. Vyukov's algorithm). Main thread
+// injects tasks, workers take them.
+class InjectionQueue
+{
+public:
+    explicit InjectionQueue(size_t capacity);
+    ~InjectionQueue();
+
+    bool push(EncodingTask *task);
+    EncodingTask* pop();
+    bool isEmpty() const;
+
+private:
+    InjectionQueue(const InjectionQueue&);
+    InjectionQueue& operator=(const InjectionQueue&);
+
+    struct Cell
+    {
+        volatile long sequence;
+        EncodingTask *task;
+    };
+
+    Cell *cells_;
+    long mask_;
+    volatile long enqueuePos_;
+    char enqueuePadding_[64 - sizeof(long)];
+    volatile long dequeuePos_;
+    char dequeuePadding_[64 - sizeof(long)];
+};
+
+// Every worker runs tasks from its own deque. Empty worker takes a small
+// batch from the injection queue or steals a task from other worker.
+// Mutex and wait condition are used only to park idle workers.
+class TaskScheduler
+{
+public:
+    static const size_t DEQUE_CAPACITY = 64;
+    static const size_t INJECTION_CAPACITY = 65536;
+    static const size_t INJECTION_BATCH = 4;
+
+    explicit TaskScheduler(size_t workersCount);
+    ~TaskScheduler();
+
+    bool init();
+    void invalidate();
+
+    inline bool isInitialized() const { return isInitialized_; }
+
+    // Called by the main thread only. Waits if the injection queue is full.
+    bool submit(EncodingTask *task);
+
+    // NUMA nodes of workers. An empty worker steals from workers of its
+    // own node first. Empty vector - no preference. Must be set before
+    // workers are started.
+    void setWorkerNodes(const std::vector<int> &nodes);
+
+    // Waits for a task for the worker. Returns false when the scheduler
+    // is invalidated.
+    bool acquire(size_t worker, EncodingTask *&task);
+
+    // Some tasks are waiting in the queues. It is only a hint, tasks
+    // could be taken or submitted concurrently.
+    bool hasQueuedTasks() const;
+
+private:
+    TaskScheduler(const TaskScheduler&);
+    TaskScheduler& operator=(const TaskScheduler&);
+
+    EncodingTask* findTask(size_t worker, bool &hasMore);
+    void wakeWorker();
+    bool isValid() const;
+
+    std::vector<WorkStealingDeque*> deques_;
+    std::vector<unsigned long> seeds_;
+    std::vector<int> workerNodes_;
+    InjectionQueue injectionQueue_;
+    volatile long sleepers_;
+    volatile long isValid_;
+    bool isInitialized_;
+    pthread_mutex_t mutex_;
+    pthread_cond_t condv_;
+};
+
+}
+
+#endif
@@ -4,10 +4,19 @@
 using namespace GMp3Enc;
 
 ThreadPool::ThreadPool(size_t threadsCount)
+    : taskTimeoutMs_(0)
+    , ioBackend_(IoBackendSync)
+    , metrics_(threadsCount)
+    , scheduler_(threadsCount)
+    , results_(threadsCount + 1)
+    , outputWriter_(results_, threadsCount, threadsCount * OUTPUT_BUFFERS_PER_THREAD)
 {
+    // Workers send notifications as producers 0..n-1, the output
+    // writer is the last one:
     workers_.resize(threadsCount);
     for (size_t i = 0; i < workers_.size(); i++)
-        workers_[i] = new WorkerThread(taskQueue_, resultMsgQueue_);
+        workers_[i] = new WorkerThread(
+                    i, scheduler_, results_, &outputWriter_, &metrics_.worker(i), &placement_);
 }
 
 ThreadPool::~ThreadPool()
@@ -15,14 +24,56 @@ ThreadPool::~ThreadPool()
     stopThreads();
 }
 
+bool ThreadPool::setPlacement(CpuPlacement::Policy policy)
+{
+    if (!placement_.plan(policy, workers_.size()))
+        return false;
+
+    // Pools of nodes steal from the same node first:
+    std::vector<int> nodes;
+    if (policy == CpuPlacement::PolicyNodes) {
+        nodes.resize(workers_.size());
+        for (size_t i = 0; i < nodes.size(); i++)
+            nodes[i] = placement_.workerNode(i);
+    }
+    scheduler_.setWorkerNodes(nodes);
+    return true;
+}
+
+bool ThreadPool::setIoBackend(IoBackend backend)
+{
+    if (backend == IoBackendUring && !IoRing::isSupported())
+        return false;
+
+    // Every worker reads through its own ring, writes of all workers
+    // are batched by the output writer:
+    if (backend == IoBackendUring) {
+        for (size_t i = 0; i < workers_.size(); i++)
+            workers_[i]->enableIoRing();
+        outputWriter_.enableIoRing();
+    }
+    ioBackend_ = backend;
+    return true;
+}
+
 bool ThreadPool::runThreads()
 {
-    if (!taskQueue_.init()) {
-        GMP3ENC_LOGGER_ERROR("Failed to init taskQueue.");
+    if (!scheduler_.init()) {
+        GMP3ENC_LOGGER_ERROR("Failed to init task scheduler.");
         return false;
     }
-    if (!resultMsgQueue_.init()) {
-        GMP3ENC_LOGGER_ERROR("Failed to init resultMsgQueue_.");
+    if (!results_.init()) {
+        GMP3ENC_LOGGER_ERROR("Failed to init results_.");
+        return false;
+    }
+#ifdef __linux__
+    if (!results_.enableEventFd()) {
+        GMP3ENC_LOGGER_ERROR("Failed to create eventfd for results_.");
+        return false;
+    }
+#endif
+    if (!outputWriter_.start()) {
+        GMP3ENC_LOGGER_ERROR("Failed to run output writer.");
         return false;
     }
 
@@ -39,51 +90,77 @@ bool ThreadPool::runThreads()
 
 void ThreadPool::stopThreads()
 {
-    if (taskQueue_.isInitialized())
-        taskQueue_.invalidate();
+    scheduler_.invalidate();
 
+    // All running tasks are interrupted at once, so the shutdown takes
+    // about one frame of the slowest task:
+    long long startUs = MetricsRegistry::nowUs();
     bool hasStoppedThreads = false;
     for (size_t i = 0; i < workers_.size(); i++) {
         if (workers_[i]->isRunning()) {
             workers_[i]->sendCancelSignal();
-            workers_[i]->join();
             hasStoppedThreads = true;
         }
     }
-    if (hasStoppedThreads)
-        GMP3ENC_LOGGER_DEBUG("Worker threads were stopped.");
+    for (size_t i = 0; i < workers_.size(); i++)
+        workers_[i]->join();
+    if (hasStoppedThreads) {
+        long long us = MetricsRegistry::nowUs() - startUs;
+        metricAdd(&metrics_.manager().shutdownUs, us);
+        GMP3ENC_LOGGER_DEBUG("Worker threads were stopped in %.1f ms.", us / 1000.0);
+    }
+
+    // Workers are stopped, so rest of output can be written:
+    outputWriter_.stop();
 }
 
 void ThreadPool::readThreadMessages(
-        std::list<EncodingTask*> &startedTasks,
-        std::list<EncodingTask*> &finishedTasks)
+        std::vector<EncodingTask*> &startedTasks,
+        std::vector<EncodingTask*> &finishedTasks)
 {
     startedTasks.clear();
     finishedTasks.clear();
 
-    if (!resultMsgQueue_.isInitialized())
+    if (!results_.isInitialized())
         return;
 
-    std::list<EncodingNotification> ntfs;
-    resultMsgQueue_.recvAll(ntfs, false);
+    std::vector<EncodingNotification> &ntfs = notifications_;
+    ntfs.clear();
+#ifdef __linux__
+    results_.clearEvent();
+#endif
+    results_.recvAll(ntfs);
 
-    if (ntfs.empty())
-        return;
-
-    std::list<EncodingNotification>::iterator it;
+    std::vector<EncodingNotification>::iterator it;
     for (it = ntfs.begin(); it != ntfs.end(); ++it) {
-        if (it->type == EncodingNotification::EncodingStarted)
+        if (it->type == EncodingNotification::EncodingStarted) {
             startedTasks.push_back(it->task);
-        else if (it->type == EncodingNotification::EncodingFinished)
+        } else if (it->type == EncodingNotification::EncodingFinished) {
             finishedTasks.push_back(it->task);
+
+            ManagerMetrics &m = metrics_.manager();
+            EncodingTask *t = it->task;
+            metricAdd(&m.results[it->result], 1);
+            // Input of a shared source is read once for all of its
+            // outputs, overlap of segments is read twice:
+            long long bytesIn = static_cast<long long>(t->sourceSamplesEncoded()) * t->inputBlockSize();
+            metricAdd(&m.bytesIn, bytesIn / static_cast<long long>(t->sourceOutputsCount()));
+            metricAdd(&m.bytesOut, t->bytesWritten());
+        }
     }
 }
 
 bool ThreadPool::executeAsyncTask(EncodingTask *task)
 {
-    if (!taskQueue_.isInitialized() || !workers_[0]->isRunning())
+    if (!scheduler_.isInitialized() || !workers_[0]->isRunning())
+        return false;
+
+    task->setSubmitTimeUs(MetricsRegistry::nowUs());
+    if (taskTimeoutMs_ > 0 && !task->deadlineUs())
+        task->setDeadlineUs(task->submitTimeUs() + taskTimeoutMs_ * 1000LL);
+    if (!scheduler_.submit(task))
         return false;
 
-    taskQueue_.send(task);
+    metricAdd(&metrics_.manager().tasksSubmitted, 1);
     return true;
 }
@@ -3,6 +3,9 @@
 
 #include <vector>
 #include <list>
+#include "cpu_placement.h"
+#include "io_ring.h"
+#include "notification_channel.h"
 #include "worker_thread.h"
 
 namespace GMp3Enc
@@ -11,24 +14,56 @@ namespace GMp3Enc
 class ThreadPool
 {
 public:
+    static const size_t OUTPUT_BUFFERS_PER_THREAD = 4;
+
     ThreadPool(size_t threadsCount);
     ~ThreadPool();
 
     bool runThreads();
     void stopThreads();
 
+    // Output vectors are cleared and refilled, they keep their capacity,
+    // so polling allocates nothing in steady state.
     void readThreadMessages(
-            std::list<EncodingTask*> &startedTasks,
-            std::list<EncodingTask*> &finishedTasks);
+            std::vector<EncodingTask*> &startedTasks,
+            std::vector<EncodingTask*> &finishedTasks);
 
     bool executeAsyncTask(EncodingTask *task);
 
+    // Deadline of submitted tasks without own one, counted from
+    // the submission. 0 - no deadline.
+    inline void setTaskTimeoutMs(long ms) { taskTimeoutMs_ = ms; }
+
+    // Must be called before runThreads(). Returns false if the policy
+    // is not supported, workers float over all CPUs then.
+    bool setPlacement(CpuPlacement::Policy policy);
+    inline const CpuPlacement& placement() const { return placement_; }
+
+    // Must be called before runThreads(). Returns false if the backend
+    // is not supported by the kernel, synchronous i/o is used then.
+    bool setIoBackend(IoBackend backend);
+    inline IoBackend ioBackend() const { return ioBackend_; }
+
+    inline size_t threadsCount() const { return workers_.size(); }
+    inline const MetricsRegistry& metrics() const { return metrics_; }
+
+#ifdef __linux__
+    // Readable when there are new thread messages.
+    inline int messagesEventFd() const { return results_.eventFd(); }
+#endif
+
 private:
-    ThreadPool(const ThreadPool&) {}
+    ThreadPool(const ThreadPool&);
     ThreadPool& operator=(const ThreadPool&) {}
 
-    EncodingTaskQueue taskQueue_;
-    EncodingResultQueue resultMsgQueue_;
+    long taskTimeoutMs_;
+    CpuPlacement placement_;
+    IoBackend ioBackend_;
+    MetricsRegistry metrics_;
+    TaskScheduler scheduler_;
+    NotificationChannel results_;
+    std::vector<EncodingNotification> notifications_;
+    OutputWriter outputWriter_;
     std::vector<WorkerThread*> workers_;
     std::list<EncodingTask*> runningTasks_;
 };
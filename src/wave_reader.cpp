@@ -0,0 +1,473 @@
+#include "wave_reader.h"
+
+#ifdef __linux__
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+#include <string.h>
+#include <new>
+
+#include "io_ring.h"
+
+using namespace GMp3Enc;
+
+WaveReader* WaveReader::create(WaveReaderType type)
+{
+#ifdef __linux__
+    if (type == WaveReaderMmap)
+        return new MmapWaveReader(false);
+    if (type == WaveReaderMmapHugePages)
+        return new MmapWaveReader(true);
+#endif
+    return new StdioWaveReader();
+}
+
+StdioWaveReader::StdioWaveReader()
+    : f_(NULL)
+    , left_(0)
+{
+}
+
+StdioWaveReader::~StdioWaveReader()
+{
+    close();
+}
+
+bool StdioWaveReader::open(const std::string &path, long offset, long size)
+{
+    close();
+
+    f_ = fopen(path.c_str(), "rb");
+    if (!f_)
+        return false;
+
+    if (fseek(f_, offset, SEEK_SET) != 0) {
+        close();
+        return false;
+    }
+
+    left_ = size;
+    return true;
+}
+
+void StdioWaveReader::close()
+{
+    if (f_) {
+        fclose(f_);
+        f_ = NULL;
+    }
+    left_ = 0;
+}
+
+const uint8_t* StdioWaveReader::read(uint8_t *buffer, size_t size, size_t &rb)
+{
+    rb = 0;
+    if (!f_)
+        return NULL;
+
+    if (size > static_cast<size_t>(left_))
+        size = left_;
+    if (!size)
+        return buffer;
+
+    rb = fread(buffer, 1, size, f_);
+    if (rb != size && ferror(f_))
+        return NULL;
+
+    left_ -= rb;
+    return buffer;
+}
+
+StreamWaveReader::StreamWaveReader(FILE *stream, ReadInterrupt *interrupt)
+    : stream_(stream)
+    , interrupt_(interrupt)
+    , left_(0)
+{
+}
+
+StreamWaveReader::~StreamWaveReader()
+{
+    close();
+}
+
+bool StreamWaveReader::open(const std::string &, long, long size)
+{
+    left_ = size;
+    return stream_ != NULL;
+}
+
+void StreamWaveReader::close()
+{
+    left_ = 0;
+}
+
+const uint8_t* StreamWaveReader::read(uint8_t *buffer, size_t size, size_t &rb)
+{
+    rb = 0;
+    if (!stream_)
+        return NULL;
+
+    if (left_ >= 0 && size > static_cast<size_t>(left_))
+        size = left_;
+    if (!size)
+        return buffer;
+
+#ifdef __linux__
+    // The buffer is filled up unless the stream ends, interruption
+    // is checked while the producer sends nothing:
+    int fd = fileno(stream_);
+    while (rb < size) {
+        pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        int r = poll(&pfd, 1, POLL_INTERVAL_MS);
+        if (r == -1 && errno != EINTR)
+            return NULL;
+        if (r <= 0) {
+            if (interrupt_ && interrupt_->isReadInterrupted())
+                return NULL;
+            continue;
+        }
+
+        ssize_t n = ::read(fd, buffer + rb, size - rb);
+        if (n == -1) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return NULL;
+        }
+        if (!n)
+            break;
+        rb += n;
+    }
+#else
+    rb = fread(buffer, 1, size, stream_);
+    if (rb != size && ferror(stream_))
+        return NULL;
+#endif
+
+    if (left_ >= 0)
+        left_ -= rb;
+    return buffer;
+}
+
+#ifdef __linux__
+MmapWaveReader::MmapWaveReader(bool hugePages)
+    : hugePages_(hugePages)
+    , map_(NULL)
+    , mapSize_(0)
+    , data_(NULL)
+    , size_(0)
+    , pos_(0)
+{
+}
+
+MmapWaveReader::~MmapWaveReader()
+{
+    close();
+}
+
+bool MmapWaveReader::open(const std::string &path, long offset, long size)
+{
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) == -1 || !S_ISREG(statbuf.st_mode)) {
+        ::close(fd);
+        return false;
+    }
+
+    // Truncated file:
+    if (offset > statbuf.st_size)
+        offset = statbuf.st_size;
+    if (size > statbuf.st_size - offset)
+        size = statbuf.st_size - offset;
+
+    if (size <= 0) {
+        ::close(fd);
+        return true;
+    }
+
+    // Mapping offset must be aligned by page size:
+    long pageSize = sysconf(_SC_PAGESIZE);
+    long alignedOffset = offset - offset % pageSize;
+    mapSize_ = size + (offset - alignedOffset);
+
+    void *p = mmap(NULL, mapSize_, PROT_READ, MAP_PRIVATE, fd, alignedOffset);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+        mapSize_ = 0;
+        return false;
+    }
+
+    map_ = static_cast<uint8_t*>(p);
+    data_ = map_ + (offset - alignedOffset);
+    size_ = size;
+
+    madvise(map_, mapSize_, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    // Not supported for the page cache by many file systems, it is just a hint.
+    if (hugePages_)
+        madvise(map_, mapSize_, MADV_HUGEPAGE);
+#endif
+
+    return true;
+}
+
+void MmapWaveReader::close()
+{
+    if (map_) {
+        munmap(map_, mapSize_);
+        map_ = NULL;
+    }
+    mapSize_ = 0;
+    data_ = NULL;
+    size_ = 0;
+    pos_ = 0;
+}
+
+const uint8_t* MmapWaveReader::read(uint8_t *buffer, size_t size, size_t &rb)
+{
+    if (size > size_ - pos_)
+        size = size_ - pos_;
+
+    rb = size;
+    if (!size)
+        return buffer;
+
+    const uint8_t *p = data_ + pos_;
+    pos_ += size;
+    return p;
+}
+
+UringWaveReader::UringWaveReader(IoRing *ring)
+    : ring_(ring)
+    , fd_(-1)
+    , memory_(NULL)
+    , chunksCount_(0)
+    , chunkSize_(0)
+    , current_(0)
+    , pos_(0)
+    , next_(0)
+    , end_(0)
+    , isLent_(false)
+    , hasError_(false)
+{
+}
+
+UringWaveReader::~UringWaveReader()
+{
+    close();
+}
+
+bool UringWaveReader::open(const std::string &path, long offset, long size)
+{
+    close();
+
+    if (!ring_ || !ring_->isValid() || ring_->inFlight())
+        return false;
+
+    fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_ == -1)
+        return false;
+
+    struct stat statbuf;
+    if (fstat(fd_, &statbuf) == -1 || !S_ISREG(statbuf.st_mode)) {
+        close();
+        return false;
+    }
+
+    // Truncated file:
+    if (offset > statbuf.st_size)
+        offset = statbuf.st_size;
+    if (size > statbuf.st_size - offset)
+        size = statbuf.st_size - offset;
+    if (size <= 0)
+        return true;
+
+    // Short clips take one small chunk:
+    chunkSize_ = static_cast<size_t>(size) < CHUNK_SIZE ? size : CHUNK_SIZE;
+    chunksCount_ = (size + chunkSize_ - 1) / chunkSize_;
+    if (chunksCount_ > CHUNKS_COUNT)
+        chunksCount_ = CHUNKS_COUNT;
+
+    memory_ = new(std::nothrow) uint8_t[chunksCount_ * chunkSize_];
+    if (!memory_) {
+        close();
+        return false;
+    }
+
+    next_ = offset;
+    end_ = offset + size;
+    for (size_t i = 0; i < chunksCount_; i++) {
+        chunks_[i].data = memory_ + i * chunkSize_;
+        chunks_[i].isPending = false;
+        if (!submitNext(chunks_[i])) {
+            close();
+            return false;
+        }
+    }
+
+    if (!ring_->submit(0)) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void UringWaveReader::close()
+{
+    // The kernel writes into the chunks until reads are completed:
+    bool isDrained = true;
+    for (size_t i = 0; i < chunksCount_; i++) {
+        while (isDrained && chunks_[i].isPending)
+            isDrained = reap(1);
+    }
+
+    if (isDrained)
+        delete[] memory_;
+    memory_ = NULL;
+
+    if (fd_ != -1) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+    chunksCount_ = 0;
+    chunkSize_ = 0;
+    current_ = 0;
+    pos_ = 0;
+    next_ = 0;
+    end_ = 0;
+    isLent_ = false;
+    hasError_ = false;
+}
+
+const uint8_t* UringWaveReader::read(uint8_t *buffer, size_t size, size_t &rb)
+{
+    rb = 0;
+    if (hasError_)
+        return NULL;
+    if (!chunksCount_ || !size)
+        return buffer;
+
+    // Data returned by the previous call is not used anymore:
+    if (isLent_) {
+        isLent_ = false;
+        if (!submitNext(chunks_[current_]) || !ring_->submit(0))
+            return NULL;
+        current_ = (current_ + 1) % chunksCount_;
+        pos_ = 0;
+    }
+
+    const uint8_t *p = buffer;
+    while (rb < size) {
+        Chunk &chunk = chunks_[current_];
+        if (!wait(chunk))
+            return NULL;
+
+        // Empty chunk is past the end of the range (or the file):
+        size_t available = chunk.filled - pos_;
+        if (!available)
+            break;
+
+        size_t n = size - rb;
+        if (n > available)
+            n = available;
+
+        // Request inside of one chunk is not copied:
+        if (!rb && n == size) {
+            p = chunk.data + pos_;
+            pos_ += n;
+            rb = n;
+            if (pos_ == chunk.filled)
+                isLent_ = true;
+            break;
+        }
+
+        memcpy(buffer + rb, chunk.data + pos_, n);
+        pos_ += n;
+        rb += n;
+        if (pos_ == chunk.filled) {
+            if (!submitNext(chunk) || !ring_->submit(0))
+                return NULL;
+            current_ = (current_ + 1) % chunksCount_;
+            pos_ = 0;
+        }
+    }
+
+    return p;
+}
+
+bool UringWaveReader::submitNext(Chunk &chunk)
+{
+    chunk.filled = 0;
+    chunk.size = 0;
+    if (next_ >= end_)
+        return true;
+
+    chunk.offset = next_;
+    chunk.size = end_ - next_ < static_cast<long long>(chunkSize_) ? end_ - next_ : chunkSize_;
+    next_ += chunk.size;
+    return queue(chunk);
+}
+
+bool UringWaveReader::queue(Chunk &chunk)
+{
+    while (!ring_->prepareRead(
+               fd_,
+               chunk.data + chunk.filled,
+               chunk.size - chunk.filled,
+               chunk.offset + chunk.filled,
+               &chunk)) {
+        if (!reap(1))
+            return false;
+    }
+    chunk.isPending = true;
+    return true;
+}
+
+bool UringWaveReader::wait(Chunk &chunk)
+{
+    while (chunk.isPending) {
+        if (!reap(1))
+            return false;
+    }
+    return !hasError_;
+}
+
+bool UringWaveReader::reap(unsigned waitCount)
+{
+    if (!ring_->submit(waitCount)) {
+        hasError_ = true;
+        return false;
+    }
+
+    void *userData;
+    int result;
+    while (ring_->popCompletion(userData, result)) {
+        Chunk *chunk = static_cast<Chunk*>(userData);
+        chunk->isPending = false;
+        if (result < 0) {
+            hasError_ = true;
+            chunk->size = chunk->filled;
+        } else if (result == 0) {
+            // The file was truncated while it was read:
+            chunk->size = chunk->filled;
+        } else {
+            chunk->filled += result;
+            if (chunk->filled < chunk->size && !queue(*chunk))
+                return false;
+        }
+    }
+    return true;
+}
+#endif
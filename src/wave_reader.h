@@ -0,0 +1,155 @@
+#ifndef GMP3ENC_WAVE_READER_
+#define GMP3ENC_WAVE_READER_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+namespace GMp3Enc {
+
+class IoRing;
+
+enum WaveReaderType
+{
+    WaveReaderStdio,
+    WaveReaderMmap,
+    WaveReaderMmapHugePages
+};
+
+// Polled by readers which could wait for data for long (pipes), so
+// a canceled task doesn't hang in the read.
+class ReadInterrupt
+{
+public:
+    virtual ~ReadInterrupt() {}
+
+    virtual bool isReadInterrupted() = 0;
+};
+
+// Backend which delivers raw wave data bytes to RiffWave.
+class WaveReader
+{
+public:
+    virtual ~WaveReader() {}
+
+    // Opens size bytes of the file starting at offset.
+    virtual bool open(const std::string &path, long offset, long size) = 0;
+    virtual void close() = 0;
+
+    // Returns pointer to at most size next bytes. Data is either copied into
+    // the buffer or taken directly from the reader memory (zero-copy).
+    // NULL is returned on i/o error.
+    virtual const uint8_t* read(uint8_t *buffer, size_t size, size_t &rb) = 0;
+
+    static WaveReader* create(WaveReaderType type);
+};
+
+class StdioWaveReader : public WaveReader
+{
+public:
+    StdioWaveReader();
+    ~StdioWaveReader();
+
+    bool open(const std::string &path, long offset, long size);
+    void close();
+    const uint8_t* read(uint8_t *buffer, size_t size, size_t &rb);
+
+private:
+    FILE *f_;
+    long left_;
+};
+
+// Reads already opened stream (e.g. stdin) which can't be seeked.
+// The stream is not owned by the reader. On Linux the descriptor is
+// polled, a stalled producer doesn't block interruption longer than
+// POLL_INTERVAL_MS. The stream must be unbuffered then.
+class StreamWaveReader : public WaveReader
+{
+public:
+    static const int POLL_INTERVAL_MS = 20;
+
+    StreamWaveReader(FILE *stream, ReadInterrupt *interrupt);
+    ~StreamWaveReader();
+
+    // Path and offset are ignored, negative size means reading
+    // until the end of the stream.
+    bool open(const std::string &path, long offset, long size);
+    void close();
+    const uint8_t* read(uint8_t *buffer, size_t size, size_t &rb);
+
+private:
+    FILE *stream_;
+    ReadInterrupt *interrupt_;
+    long left_;
+};
+
+#ifdef __linux__
+class MmapWaveReader : public WaveReader
+{
+public:
+    MmapWaveReader(bool hugePages);
+    ~MmapWaveReader();
+
+    bool open(const std::string &path, long offset, long size);
+    void close();
+    const uint8_t* read(uint8_t *buffer, size_t size, size_t &rb);
+
+private:
+    bool hugePages_;
+    uint8_t *map_;
+    size_t mapSize_;
+    const uint8_t *data_;
+    size_t size_;
+    size_t pos_;
+};
+
+// Keeps several large reads in flight ahead of the encoder through the
+// io_uring of the worker. The ring serves one reader at a time, the reader
+// must be closed by the thread which reads, before the ring is used
+// by another reader.
+class UringWaveReader : public WaveReader
+{
+public:
+    static const size_t CHUNK_SIZE = 256 * 1024;
+    static const size_t CHUNKS_COUNT = 4;
+
+    explicit UringWaveReader(IoRing *ring);
+    ~UringWaveReader();
+
+    bool open(const std::string &path, long offset, long size);
+    void close();
+    const uint8_t* read(uint8_t *buffer, size_t size, size_t &rb);
+
+private:
+    struct Chunk
+    {
+        uint8_t *data;
+        long long offset;
+        size_t size;    // Requested bytes, 0 - past the end.
+        size_t filled;  // Bytes already read.
+        bool isPending;
+    };
+
+    bool submitNext(Chunk &chunk);
+    bool queue(Chunk &chunk);
+    bool wait(Chunk &chunk);
+    bool reap(unsigned waitCount);
+
+    IoRing *ring_;
+    int fd_;
+    uint8_t *memory_;
+    Chunk chunks_[CHUNKS_COUNT];
+    size_t chunksCount_;
+    size_t chunkSize_;
+    size_t current_;
+    size_t pos_;
+    long long next_;
+    long long end_;
+    bool isLent_;  // Data of the current chunk was returned without copying.
+    bool hasError_;
+};
+#endif
+
+}
+
+#endif
@@ -1,20 +1,41 @@
 #include "worker_thread.h"
 
+#include <string.h>
+
 using namespace GMp3Enc;
 
-WorkerThread::WorkerThread(EncodingTaskQueue &taskQueue, EncodingResultQueue &resultQueue)
-    : taskQueue_(taskQueue)
-    , resultQueue_(resultQueue)
+WorkerThread::WorkerThread(
+        size_t index,
+        TaskScheduler &scheduler,
+        NotificationChannel &results,
+        OutputWriter *outputWriter,
+        WorkerMetrics *metrics,
+        const CpuPlacement *placement)
+    : index_(index)
+    , scheduler_(scheduler)
+    , results_(results)
+    , outputWriter_(outputWriter)
+    , metrics_(metrics)
+    , placement_(placement)
+    , startState_(0)
     , isRunning_(false)
     , currentTask_(NULL)
+    , isCanceled_(0)
+    , cancelTimeUs_(0)
     , buffer_(NULL)
+    , lameCache_(metrics)
+    , isIoRingEnabled_(false)
 {
+    pthread_mutex_init(&startMutex_, NULL);
+    pthread_cond_init(&startCondv_, NULL);
 }
 
 WorkerThread::~WorkerThread()
 {
     if (buffer_)
         delete[] buffer_;
+    pthread_cond_destroy(&startCondv_);
+    pthread_mutex_destroy(&startMutex_);
 }
 
 bool WorkerThread::start()
@@ -22,29 +43,23 @@ bool WorkerThread::start()
     if (isRunning_)
         return false;
 
-    // Every thread has own buffer for performing encoding:
-    try {
-        buffer_ = new uint8_t[EncodingTask::ENCODING_BUFFER_SIZE];
-    } catch(std::bad_alloc &e) {
-        GMP3ENC_LOGGER_ERROR(
-                    "Failed to allocate internal buffer for thread. Size: %zu",
-                    EncodingTask::ENCODING_BUFFER_SIZE);
-        buffer_ = NULL;
-        return false;
-    }
+    atomicStoreRelaxed(&isCanceled_, 0L);
+    startState_ = 0;
 
-    int r = pthread_mutex_init(&cancelMutex_, NULL);
-    if (r)
-        return false;
-    pthread_mutex_lock(&cancelMutex_);
-
-    r = pthread_create(
+    int r = pthread_create(
                 &pthreadId_,
                 NULL,
                 &threadFunc,
                 reinterpret_cast<void*>(this));
-    if (r) {
-        pthread_mutex_unlock(&cancelMutex_);
+    if (r)
+        return false;
+
+    MutexGuard g(&startMutex_);
+    while (startState_ == 0)
+        pthread_cond_wait(&startCondv_, &startMutex_);
+    if (startState_ < 0) {
+        g.unlock();
+        pthread_join(pthreadId_, NULL);
         return false;
     }
 
@@ -62,54 +77,125 @@ void WorkerThread::join()
 
 void WorkerThread::sendCancelSignal()
 {
-    if (isRunning_)
-        pthread_mutex_unlock(&cancelMutex_);
+    if (!isRunning_)
+        return;
+    atomicStoreRelaxed(&cancelTimeUs_, MetricsRegistry::nowUs());
+    atomicStoreRelease(&isCanceled_, 1L);
 }
 
 bool WorkerThread::checkCancelationSignal()
 {
-    if (!pthread_mutex_trylock(&cancelMutex_)) {
-        pthread_mutex_unlock(&cancelMutex_);
-        return true;
-    }
-    return false;
+    return atomicLoadAcquire(&isCanceled_) != 0;
 }
 
-void WorkerThread::exec()
+bool WorkerThread::init()
 {
-    MessageQueueRcvResult r;
-    do {
-        r = taskQueue_.recv(currentTask_, true);
-
-        if (r == MsgQResSuccess) {
-            EncodingNotification ntf;
-
-            // Notify main thread that we started encoding:
-            ntf.task = currentTask_;
-            ntf.type = EncodingNotification::EncodingStarted;
-            ntf.result = EncodingTask::EncodingSuccess;
-            resultQueue_.send(ntf);
-
-            // Using this pointer to check when we must interrupt
-            currentTask_->setExecutor(this);
+    // Not placed worker still works, only slower:
+    if (placement_)
+        placement_->apply(index_);
+
+    // Every thread has own buffer for performing encoding. It is
+    // allocated and touched by the thread, so pages are taken from its
+    // NUMA node. Lame contexts are created by the thread as well.
+    if (!buffer_) {
+        try {
+            buffer_ = new uint8_t[EncodingTask::ENCODING_BUFFER_SIZE];
+        } catch(std::bad_alloc &e) {
+            GMP3ENC_LOGGER_ERROR(
+                        "Failed to allocate internal buffer for thread. Size: %zu",
+                        EncodingTask::ENCODING_BUFFER_SIZE);
+            buffer_ = NULL;
+            return false;
+        }
+    }
+    memset(buffer_, 0, EncodingTask::ENCODING_BUFFER_SIZE);
 
-            // Do encoding:
-            EncodingTask::EncodingResult r = currentTask_->encode();
+    // Without the ring sources are read by regular readers:
+    if (isIoRingEnabled_ && !ioRing_.isValid() && !ioRing_.init(IO_RING_ENTRIES))
+        GMP3ENC_LOGGER_DEBUG("Failed to set up io_uring for thread %zu, using synchronous reads", index_);
+    return true;
+}
 
-            // Nonify main thread that incoding was completed:
-            ntf.task = currentTask_;
-            ntf.type = EncodingNotification::EncodingFinished;
-            ntf.result = r;
-            resultQueue_.send(ntf);
+void WorkerThread::setStartState(int state)
+{
+    MutexGuard g(&startMutex_);
+    startState_ = state;
+    pthread_cond_signal(&startCondv_);
+}
 
-        }
+void WorkerThread::exec()
+{
+    long long idleSince = MetricsRegistry::nowUs();
+    atomicStoreRelaxed(&metrics_->idleSinceUs, idleSince);
+    while (scheduler_.acquire(index_, currentTask_)) {
+        EncodingNotification ntf;
+
+        long long startUs = MetricsRegistry::nowUs();
+        atomicStoreRelaxed(&metrics_->idleSinceUs, 0LL);
+        metricAdd(&metrics_->idleUs, startUs - idleSince);
+        atomicStoreRelaxed(&metrics_->busySinceUs, startUs);
+        metricAdd(&metrics_->tasksStarted, 1);
+        metrics_->queueWait.record(startUs - currentTask_->submitTimeUs());
+
+        // Notify main thread that we started encoding:
+        ntf.task = currentTask_;
+        ntf.type = EncodingNotification::EncodingStarted;
+        ntf.result = EncodingTask::EncodingSuccess;
+        results_.send(index_, ntf);
+
+        // Using this pointer to check when we must interrupt
+        currentTask_->setExecutor(this);
+
+        // Do encoding:
+        EncodingTask::EncodingResult r = currentTask_->encode();
+
+        metrics_->encodeLatency.record(MetricsRegistry::nowUs() - startUs);
+
+        // Next task likely has the same format, its context is created
+        // after the result is reported. The task could be deleted
+        // as soon as it is reported, the key is taken before:
+        LameContextKey key;
+        bool needPrepare = r == EncodingTask::EncodingSuccess &&
+                lameCache_.isPredictable() &&
+                currentTask_->lameContextKey(key);
+
+        // Nonify main thread that incoding was completed:
+        ntf.task = currentTask_;
+        ntf.type = EncodingNotification::EncodingFinished;
+        ntf.result = r;
+
+        // Write-behind output is still being written, the writer
+        // notifies main thread after the file is closed.
+        OutputFile *outf = currentTask_->outputFile();
+        if (outf->isOpen() && outf->isWriteBehind())
+            outputWriter_->close(outf, ntf);
+        else
+            results_.send(index_, ntf);
+
+        // Nothing is prepared for an empty queue, the context would
+        // wait for the next batch or the exit:
+        if (needPrepare && scheduler_.hasQueuedTasks())
+            lameCache_.prepare(key);
+
+        // Preparing is a part of the work:
+        idleSince = MetricsRegistry::nowUs();
+        atomicStoreRelaxed(&metrics_->busySinceUs, 0LL);
+        metricAdd(&metrics_->busyUs, idleSince - startUs);
+        atomicStoreRelaxed(&metrics_->idleSinceUs, idleSince);
+    }
 
-    } while (r != MsgQResInvalid);
+    atomicStoreRelaxed(&metrics_->idleSinceUs, 0LL);
+    metricAdd(&metrics_->idleUs, MetricsRegistry::nowUs() - idleSince);
 }
 
 void* WorkerThread::threadFunc(void *h)
 {
     WorkerThread *obj = static_cast<WorkerThread*>(h);
+    if (!obj->init()) {
+        obj->setStartState(-1);
+        return NULL;
+    }
+    obj->setStartState(1);
     obj->exec();
     return NULL;
 }
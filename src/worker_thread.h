@@ -3,43 +3,78 @@
 
 #include <stdint.h>
 
+#include "cpu_placement.h"
 #include "encoding_task.h"
+#include "io_ring.h"
+#include "lame_context_cache.h"
 #include "message_queue.h"
+#include "metrics.h"
+#include "notification_channel.h"
+#include "output_writer.h"
+#include "task_scheduler.h"
 
 namespace GMp3Enc
 {
 
-typedef MessageQueue<EncodingTask*> EncodingTaskQueue;
-typedef MessageQueue<EncodingNotification> EncodingResultQueue;
-
 class WorkerThread
 {
 public:
-    WorkerThread(EncodingTaskQueue &taskQueue,
-                 EncodingResultQueue &resultQueue);
+    WorkerThread(size_t index,
+                 TaskScheduler &scheduler,
+                 NotificationChannel &results,
+                 OutputWriter *outputWriter,
+                 WorkerMetrics *metrics,
+                 const CpuPlacement *placement);
     ~WorkerThread();
 
+    // Returns when the thread has placed itself and allocated its
+    // buffer, or has failed to.
     bool start();
     void join();
+    // Must be called before start(), the ring is set up by the thread.
+    inline void enableIoRing() { isIoRingEnabled_ = true; }
+    // Cancellation is a flag polled by the running task between frames,
+    // the time of the signal is kept to measure the stop latency.
     void sendCancelSignal();
     bool checkCancelationSignal();
+    inline long long cancelTimeUs() const { return atomicLoadRelaxed(&cancelTimeUs_); }
 
     inline bool isRunning() const { return isRunning_; }
 
     inline uint8_t* internalBuffer() { return buffer_; }
+    inline OutputWriter* outputWriter() { return outputWriter_; }
+    inline LameContextCache* lameCache() { return &lameCache_; }
+    inline WorkerMetrics* metrics() { return metrics_; }
+    inline IoRing* ioRing() { return ioRing_.isValid() ? &ioRing_ : NULL; }
 
 private:
+    // Read-ahead chunks of one source plus a spare entry:
+    static const unsigned IO_RING_ENTRIES = 8;
+
     WorkerThread& operator=(const WorkerThread&) {}
+    bool init();
+    void setStartState(int state);
     void exec();
     static void* threadFunc(void* h);
 
-    EncodingTaskQueue &taskQueue_;
-    EncodingResultQueue &resultQueue_;
+    size_t index_;
+    TaskScheduler &scheduler_;
+    NotificationChannel &results_;
+    OutputWriter *outputWriter_;
+    WorkerMetrics *metrics_;
+    const CpuPlacement *placement_;
     pthread_t pthreadId_;
+    pthread_mutex_t startMutex_;
+    pthread_cond_t startCondv_;
+    int startState_;  // 0 - starting, 1 - running, -1 - failed.
     bool isRunning_;
     EncodingTask *currentTask_;
-    pthread_mutex_t cancelMutex_;
+    volatile long isCanceled_;
+    volatile long long cancelTimeUs_;
     uint8_t *buffer_;
+    LameContextCache lameCache_;
+    IoRing ioRing_;
+    bool isIoRingEnabled_;
 };
 
 }
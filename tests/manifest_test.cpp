@@ -0,0 +1,278 @@
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "manifest.h"
+
+using namespace GMp3Enc;
+
+typedef std::map<uint64_t, ManifestRecord> RecordMap;
+
+static const char *MANIFEST_PATH = "gmp3enc_manifest_test.tmp";
+static const char *DAMAGED_PATH = "gmp3enc_manifest_test_damaged.tmp";
+
+// The header starts with 8 bytes of magic followed by uint32 version:
+static const size_t VERSION_OFFSET = 8;
+
+static int failed = 0;
+
+#define CHECK(expr) {                                                   \
+    if (!(expr)) {                                                      \
+        fprintf(stderr, "%s:%d: check failed: %s\n",                    \
+                __FILE__, __LINE__, #expr);                             \
+        failed++;                                                       \
+    }                                                                   \
+}
+
+static uint64_t nextRandom(uint64_t &state)
+{
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return state;
+}
+
+static ManifestRecord makeRecord(uint64_t pathHash, uint64_t &seed)
+{
+    ManifestRecord r;
+    memset(&r, 0, sizeof(r));
+    r.pathHash = pathHash;
+    r.outputHash = nextRandom(seed);
+    r.settingsHash = nextRandom(seed);
+    r.contentHash = nextRandom(seed) & 1 ? nextRandom(seed) : 0;
+    r.sourceSize = static_cast<int64_t>(nextRandom(seed) >> 20);
+    r.sourceMtimeNs = static_cast<int64_t>(nextRandom(seed) >> 2);
+    r.sourceInode = nextRandom(seed);
+    r.outputSize = static_cast<int64_t>(nextRandom(seed) >> 24);
+    return r;
+}
+
+static bool sameRecord(const ManifestRecord *a, const ManifestRecord &b)
+{
+    return a && memcmp(a, &b, sizeof(b)) == 0;
+}
+
+// Every record of expected is found, removed ones are not.
+static void checkContents(
+        const Manifest &manifest,
+        const RecordMap &expected,
+        const std::vector<uint64_t> &removed)
+{
+    size_t mismatched = 0;
+    for (RecordMap::const_iterator it = expected.begin(); it != expected.end(); ++it) {
+        if (!sameRecord(manifest.find(it->first), it->second))
+            mismatched++;
+    }
+    CHECK(mismatched == 0);
+
+    size_t found = 0;
+    for (size_t i = 0; i < removed.size(); i++) {
+        if (manifest.find(removed[i]))
+            found++;
+    }
+    CHECK(found == 0);
+}
+
+static bool readFile(const char *path, std::vector<uint8_t> &data)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return false;
+    data.clear();
+    uint8_t buf[4096];
+    size_t rb;
+    while ((rb = fread(buf, 1, sizeof(buf), f)) > 0)
+        data.insert(data.end(), buf, buf + rb);
+    bool isok = !ferror(f);
+    fclose(f);
+    return isok;
+}
+
+static bool writeFile(const char *path, const uint8_t *data, size_t size)
+{
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        return false;
+    bool isok = !size || fwrite(data, size, 1, f) == 1;
+    if (fclose(f) != 0)
+        isok = false;
+    return isok;
+}
+
+static void checkRejected(const char *what, const uint8_t *data, size_t size)
+{
+    CHECK(writeFile(DAMAGED_PATH, data, size));
+
+    Manifest manifest;
+    bool loaded = manifest.load(DAMAGED_PATH);
+    if (loaded)
+        fprintf(stderr, "%s manifest was accepted\n", what);
+    CHECK(!loaded);
+    CHECK(manifest.size() == 0);
+}
+
+static void testRoundTrip()
+{
+    const size_t RECORDS = 1000;
+    uint64_t seed = 42;
+    RecordMap expected;
+    std::vector<uint64_t> removed;
+
+    ::remove(MANIFEST_PATH);
+
+    // Missing file is an empty manifest:
+    {
+        Manifest manifest;
+        CHECK(manifest.load(MANIFEST_PATH));
+        CHECK(manifest.size() == 0);
+        CHECK(manifest.find(Manifest::hash("a.wav")) == NULL);
+
+        for (size_t i = 0; i < RECORDS; i++) {
+            ManifestRecord r = makeRecord(nextRandom(seed), seed);
+            expected[r.pathHash] = r;
+            manifest.update(r);
+        }
+        checkContents(manifest, expected, removed);
+        CHECK(manifest.save());
+        CHECK(manifest.size() == expected.size());
+        checkContents(manifest, expected, removed);
+    }
+
+    // Update, remove and insert on top of the mapped records:
+    {
+        Manifest manifest;
+        CHECK(manifest.load(MANIFEST_PATH));
+        CHECK(manifest.size() == expected.size());
+        checkContents(manifest, expected, removed);
+
+        // Nothing changed, nothing to write:
+        CHECK(manifest.save());
+
+        size_t i = 0;
+        RecordMap::iterator it = expected.begin();
+        while (it != expected.end()) {
+            uint64_t pathHash = it->first;
+            if (i % 4 == 0) {
+                manifest.remove(pathHash);
+                removed.push_back(pathHash);
+                expected.erase(it++);
+            } else if (i % 4 == 1) {
+                it->second = makeRecord(pathHash, seed);
+                manifest.update(it->second);
+                ++it;
+            } else {
+                ++it;
+            }
+            i++;
+        }
+
+        // Removed and then inserted again:
+        ManifestRecord restored = makeRecord(removed[0], seed);
+        manifest.remove(restored.pathHash);
+        manifest.update(restored);
+        expected[restored.pathHash] = restored;
+        removed.erase(removed.begin());
+
+        // Updated and then removed:
+        uint64_t dropped = expected.rbegin()->first;
+        manifest.update(makeRecord(dropped, seed));
+        manifest.remove(dropped);
+        expected.erase(dropped);
+        removed.push_back(dropped);
+
+        for (i = 0; i < RECORDS / 4; i++) {
+            ManifestRecord r = makeRecord(nextRandom(seed), seed);
+            expected[r.pathHash] = r;
+            manifest.update(r);
+        }
+
+        checkContents(manifest, expected, removed);
+        CHECK(manifest.save());
+        CHECK(manifest.size() == expected.size());
+        checkContents(manifest, expected, removed);
+    }
+
+    {
+        Manifest manifest;
+        CHECK(manifest.load(MANIFEST_PATH));
+        CHECK(manifest.size() == expected.size());
+        checkContents(manifest, expected, removed);
+
+        for (RecordMap::const_iterator it = expected.begin(); it != expected.end(); ++it) {
+            manifest.remove(it->first);
+            removed.push_back(it->first);
+        }
+        expected.clear();
+        CHECK(manifest.save());
+        CHECK(manifest.size() == 0);
+    }
+
+    {
+        Manifest manifest;
+        CHECK(manifest.load(MANIFEST_PATH));
+        CHECK(manifest.size() == 0);
+        checkContents(manifest, expected, removed);
+    }
+
+    ::remove(MANIFEST_PATH);
+}
+
+static void testDamagedFiles()
+{
+    uint64_t seed = 7;
+
+    ::remove(MANIFEST_PATH);
+    {
+        Manifest manifest;
+        CHECK(manifest.load(MANIFEST_PATH));
+        for (size_t i = 0; i < 16; i++)
+            manifest.update(makeRecord(nextRandom(seed), seed));
+        CHECK(manifest.save());
+    }
+
+    std::vector<uint8_t> data;
+    CHECK(readFile(MANIFEST_PATH, data));
+    CHECK(data.size() > sizeof(ManifestRecord) + VERSION_OFFSET + sizeof(uint32_t));
+    ::remove(MANIFEST_PATH);
+    if (failed)
+        return;
+
+    // The untouched copy is valid:
+    {
+        CHECK(writeFile(DAMAGED_PATH, &data[0], data.size()));
+        Manifest manifest;
+        CHECK(manifest.load(DAMAGED_PATH));
+        CHECK(manifest.size() == 16);
+    }
+
+    checkRejected("Empty", &data[0], 0);
+    checkRejected("Truncated header", &data[0], VERSION_OFFSET + 2);
+    checkRejected("Truncated record", &data[0], data.size() - 1);
+    checkRejected("Missing record", &data[0], data.size() - sizeof(ManifestRecord));
+
+    std::vector<uint8_t> damaged(data);
+    uint32_t version;
+    memcpy(&version, &damaged[VERSION_OFFSET], sizeof(version));
+    version++;
+    memcpy(&damaged[VERSION_OFFSET], &version, sizeof(version));
+    checkRejected("Wrong version", &damaged[0], damaged.size());
+
+    damaged = data;
+    damaged[0] ^= 0xff;
+    checkRejected("Wrong magic", &damaged[0], damaged.size());
+
+    ::remove(DAMAGED_PATH);
+}
+
+int main()
+{
+    testRoundTrip();
+    testDamagedFiles();
+
+    if (failed) {
+        printf("%d checks failed\n", failed);
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}
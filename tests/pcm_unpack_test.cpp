@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "pcm_unpack.h"
+
+using namespace GMp3Enc;
+
+static const int32_t GUARD = 0x5a5a5a5a;
+
+static uint32_t nextRandom(uint32_t &state)
+{
+    state = state * 1664525u + 1013904223u;
+    return state >> 8;
+}
+
+// The conversion RiffWave::unpackReadSamples did before the kernels:
+// lame frontend unpack into an interleaved int buffer (8 bit samples
+// are unsigned, the rest are signed little endian), then the encoding
+// loop deinterleaved it into the channel buffers.
+static void unpackReference(
+        const uint8_t *src,
+        size_t count,
+        int bytesPerSample,
+        int channels,
+        int32_t *left,
+        int32_t *right)
+{
+    const int b = sizeof(int32_t) * 8;
+    size_t rs = count * channels;
+    std::vector<int32_t> buffer(rs + 1);
+    const uint8_t *ip = src;
+    int32_t *op = &buffer[0] + rs;
+
+    for (size_t k = rs; k-- > 0;) {
+        const uint8_t *p = ip + k * bytesPerSample;
+        uint32_t v = 0;
+        if (bytesPerSample == 1)
+            v = static_cast<uint32_t>(p[0] ^ 0x80) << (b - 8) | 0x7f << (b - 16);
+        else if (bytesPerSample == 2)
+            v = static_cast<uint32_t>(p[0]) << (b - 16) |
+                static_cast<uint32_t>(p[1]) << (b - 8);
+        else if (bytesPerSample == 3)
+            v = static_cast<uint32_t>(p[0]) << (b - 24) |
+                static_cast<uint32_t>(p[1]) << (b - 16) |
+                static_cast<uint32_t>(p[2]) << (b - 8);
+        else
+            v = static_cast<uint32_t>(p[0]) << (b - 32) |
+                static_cast<uint32_t>(p[1]) << (b - 24) |
+                static_cast<uint32_t>(p[2]) << (b - 16) |
+                static_cast<uint32_t>(p[3]) << (b - 8);
+        *--op = static_cast<int32_t>(v);
+    }
+
+    if (channels == 2) {
+        const int32_t *p = &buffer[0] + rs;
+        for (size_t j = count; j-- > 0;) {
+            right[j] = *--p;
+            left[j] = *--p;
+        }
+    } else {
+        for (size_t j = 0; j < count; j++)
+            left[j] = buffer[j];
+    }
+}
+
+static bool checkChannel(
+        const char *setName,
+        int bytesPerSample,
+        int channels,
+        size_t count,
+        size_t srcOffset,
+        size_t dstOffset,
+        const char *channelName,
+        const int32_t *expected,
+        const std::vector<int32_t> &actual)
+{
+    for (size_t i = 0; i < dstOffset; i++) {
+        if (actual[i] != GUARD) {
+            fprintf(stderr, "%s %d bit %dch count %u offsets %u/%u: %s written before buffer\n",
+                    setName, bytesPerSample * 8, channels, (unsigned)count,
+                    (unsigned)srcOffset, (unsigned)dstOffset, channelName);
+            return false;
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (actual[dstOffset + i] != expected[i]) {
+            fprintf(stderr, "%s %d bit %dch count %u offsets %u/%u: %s[%u] = %08x, expected %08x\n",
+                    setName, bytesPerSample * 8, channels, (unsigned)count,
+                    (unsigned)srcOffset, (unsigned)dstOffset, channelName, (unsigned)i,
+                    (unsigned)actual[dstOffset + i], (unsigned)expected[i]);
+            return false;
+        }
+    }
+    for (size_t i = dstOffset + count; i < actual.size(); i++) {
+        if (actual[i] != GUARD) {
+            fprintf(stderr, "%s %d bit %dch count %u offsets %u/%u: %s written past count\n",
+                    setName, bytesPerSample * 8, channels, (unsigned)count,
+                    (unsigned)srcOffset, (unsigned)dstOffset, channelName);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool checkKernel(
+        const char *setName,
+        int bytesPerSample,
+        int channels,
+        size_t count,
+        size_t srcOffset,
+        size_t dstOffset,
+        uint32_t &seed)
+{
+    std::vector<uint8_t> src(count * channels * bytesPerSample + srcOffset + 1);
+    for (size_t i = 0; i < src.size(); i++)
+        src[i] = static_cast<uint8_t>(nextRandom(seed));
+
+    std::vector<int32_t> expectedLeft(count + 1);
+    std::vector<int32_t> expectedRight(count + 1);
+    unpackReference(&src[srcOffset], count, bytesPerSample, channels,
+                    &expectedLeft[0], &expectedRight[0]);
+
+    std::vector<int32_t> left(count + dstOffset + 8, GUARD);
+    std::vector<int32_t> right(count + dstOffset + 8, GUARD);
+    PcmUnpackFunc unpack = PcmUnpack::kernel(bytesPerSample, channels);
+    unpack(&src[srcOffset], count, &left[dstOffset], &right[dstOffset]);
+
+    if (!checkChannel(setName, bytesPerSample, channels, count, srcOffset, dstOffset,
+                      "left", &expectedLeft[0], left))
+        return false;
+    if (channels == 2) {
+        return checkChannel(setName, bytesPerSample, channels, count, srcOffset, dstOffset,
+                            "right", &expectedRight[0], right);
+    }
+    // Mono kernels must not touch the right channel.
+    return checkChannel(setName, bytesPerSample, channels, 0, srcOffset, 0,
+                        "right", NULL, right);
+}
+
+int main()
+{
+    // Short counts cover every tail length of the 8 and 16 sample
+    // loops, the long ones are odd so the vector loops end with a tail too.
+    static const size_t longCounts[] = { 1151, 1152 + 15, 4097 };
+    static const PcmUnpack::KernelSet sets[] = {
+        PcmUnpack::KernelScalar,
+        PcmUnpack::KernelSse2,
+        PcmUnpack::KernelAvx2
+    };
+
+    uint32_t seed = 12345;
+    int failed = 0;
+    int checked = 0;
+
+    for (size_t s = 0; s < sizeof(sets) / sizeof(sets[0]); s++) {
+        PcmUnpack::selectKernels(sets[s]);
+        if (PcmUnpack::kernelSet() != sets[s]) {
+            printf("skipped %s: not supported by CPU, %s selected\n",
+                   s == 1 ? "sse2" : "avx2", PcmUnpack::kernelSetName());
+            continue;
+        }
+        const char *setName = PcmUnpack::kernelSetName();
+        int failedBefore = failed;
+
+        for (int bytesPerSample = 1; bytesPerSample <= 4; bytesPerSample++) {
+            for (int channels = 1; channels <= 2; channels++) {
+                std::vector<size_t> counts;
+                for (size_t c = 0; c <= 70; c++)
+                    counts.push_back(c);
+                for (size_t c = 0; c < sizeof(longCounts) / sizeof(longCounts[0]); c++)
+                    counts.push_back(longCounts[c]);
+
+                for (size_t c = 0; c < counts.size(); c++) {
+                    for (size_t srcOffset = 0; srcOffset < 4; srcOffset++) {
+                        for (size_t dstOffset = 0; dstOffset < 2; dstOffset++) {
+                            checked++;
+                            if (!checkKernel(setName, bytesPerSample, channels, counts[c],
+                                             srcOffset, dstOffset, seed))
+                                failed++;
+                        }
+                    }
+                }
+            }
+        }
+        printf("%s: %s\n", setName, failed == failedBefore ? "ok" : "FAILED");
+    }
+
+    printf("%d of %d checks failed\n", failed, checked);
+    return failed ? 1 : 0;
+}